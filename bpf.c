@@ -120,11 +120,67 @@ size_t bpf_comp_jset64(struct sock_filter *filter, uint64_t mask,
 }
 #endif
 
-size_t bpf_arg_comp(struct sock_filter **pfilter,
+/* Size-aware unsigned ordered comparisons. */
+size_t bpf_comp_jgt32(struct sock_filter *filter, unsigned long c,
+		unsigned char jt, unsigned char jf)
+{
+	unsigned int lo = (unsigned int)(c & 0xFFFFFFFF);
+	set_bpf_jump(filter, BPF_JMP+BPF_JGT+BPF_K, lo, jt, jf);
+	return 1U;
+}
+
+size_t bpf_comp_jge32(struct sock_filter *filter, unsigned long c,
+		unsigned char jt, unsigned char jf)
+{
+	unsigned int lo = (unsigned int)(c & 0xFFFFFFFF);
+	set_bpf_jump(filter, BPF_JMP+BPF_JGE+BPF_K, lo, jt, jf);
+	return 1U;
+}
+
+/*
+ * On 64 bits, the high words decide the comparison unless they are equal,
+ * in which case the low words do.
+ */
+#if defined(BITS64)
+static size_t bpf_comp_ord64(struct sock_filter *filter, uint64_t c,
+		unsigned short lo_code, unsigned char jt, unsigned char jf)
+{
+	unsigned int lo = (unsigned int)(c & 0xFFFFFFFF);
+	unsigned int hi = (unsigned int)(c >> 32);
+
+	struct sock_filter *curr_block = filter;
+
+	/* bpf_load_arg leaves |hi| in A */
+	set_bpf_jump(curr_block++, BPF_JMP+BPF_JGT+BPF_K, hi,
+			SKIPN(3) + jt, NEXT);
+	set_bpf_jump(curr_block++, BPF_JMP+BPF_JEQ+BPF_K, hi,
+			NEXT, SKIPN(2) + jf);
+	set_bpf_stmt(curr_block++, BPF_LD+BPF_MEM, 0); /* swap in |lo| */
+	set_bpf_jump(curr_block++, lo_code, lo, jt, jf);
+
+	return curr_block - filter;
+}
+
+size_t bpf_comp_jgt64(struct sock_filter *filter, uint64_t c,
+		unsigned char jt, unsigned char jf)
+{
+	return bpf_comp_ord64(filter, c, BPF_JMP+BPF_JGT+BPF_K, jt, jf);
+}
+
+size_t bpf_comp_jge64(struct sock_filter *filter, uint64_t c,
+		unsigned char jt, unsigned char jf)
+{
+	return bpf_comp_ord64(filter, c, BPF_JMP+BPF_JGE+BPF_K, jt, jf);
+}
+#endif
+
+/*
+ * Writes at most BPF_ARG_COMP_MAX_LEN + 1 instructions to |filter|.
+ * Returns 0 for unsupported operators.
+ */
+size_t bpf_arg_comp(struct sock_filter *filter,
 		int op, int argidx, unsigned long c, unsigned int label_id)
 {
-	struct sock_filter *filter = calloc(BPF_ARG_COMP_LEN + 1,
-			sizeof(struct sock_filter));
 	struct sock_filter *curr_block = filter;
 	size_t (*comp_function)(struct sock_filter *filter, unsigned long k,
 				unsigned char jt, unsigned char jf);
@@ -147,8 +203,23 @@ size_t bpf_arg_comp(struct sock_filter **pfilter,
 		comp_function = bpf_comp_jset;
 		flip = 0;
 		break;
+	case GT:
+		comp_function = bpf_comp_jgt;
+		flip = 0;
+		break;
+	case GE:
+		comp_function = bpf_comp_jge;
+		flip = 0;
+		break;
+	case LT:
+		comp_function = bpf_comp_jge;
+		flip = 1;
+		break;
+	case LE:
+		comp_function = bpf_comp_jgt;
+		flip = 1;
+		break;
 	default:
-		*pfilter = NULL;
 		return 0;
 	}
 
@@ -161,7 +232,125 @@ size_t bpf_arg_comp(struct sock_filter **pfilter,
 	curr_block += comp_function(curr_block, c, jt, jf);
 	curr_block += set_bpf_jump_lbl(curr_block, label_id);
 
-	*pfilter = filter;
+	return curr_block - filter;
+}
+
+/* Sets of up to this many values are checked with a chain of JEQs. */
+#define BPF_IN_LINEAR_MAX 3
+
+/*
+ * Emits a binary search over the sorted, distinct 32-bit values in |v|,
+ * starting at |filter|[|pos|]. Matches jump to |match| and misses to
+ * |nomatch|, both indices into |filter|. With a NULL |filter| only the
+ * length is computed.
+ */
+static size_t bpf_comp_in_tree(struct sock_filter *filter, size_t pos,
+		const unsigned int *v, size_t n, size_t match, size_t nomatch)
+{
+	size_t i, len, mid;
+
+	if (n <= BPF_IN_LINEAR_MAX) {
+		for (i = 0; i < n && filter; i++) {
+			size_t miss = i + 1 < n ? pos + i + 1 : nomatch;
+			set_bpf_jump(&filter[pos + i], BPF_JMP+BPF_JEQ+BPF_K,
+					v[i], match - (pos + i) - 1,
+					miss - (pos + i) - 1);
+		}
+		return n;
+	}
+
+	/* Values >= |v[mid]| live in the right half, after the left one. */
+	mid = n / 2;
+	len = bpf_comp_in_tree(NULL, 0, v, mid, 0, 0);
+	if (filter)
+		set_bpf_jump(&filter[pos], BPF_JMP+BPF_JGE+BPF_K, v[mid],
+				len, NEXT);
+	len = 1;
+	len += bpf_comp_in_tree(filter, pos + len, v, mid, match, nomatch);
+	len += bpf_comp_in_tree(filter, pos + len, v + mid, n - mid,
+			match, nomatch);
+	return len;
+}
+
+/*
+ * Emits the membership test for the sorted, distinct values in |set|,
+ * with the argument already loaded by bpf_load_arg().
+ * On 64 bits, values are grouped by their high word: each group checks
+ * the high word and then searches its low words.
+ */
+static size_t bpf_comp_in(struct sock_filter *filter,
+		const unsigned long *set, size_t n, size_t match, size_t nomatch)
+{
+	unsigned int lo[BPF_ARG_SET_MAX];
+	size_t i;
+#if defined(BITS32)
+	for (i = 0; i < n; i++)
+		lo[i] = (unsigned int)set[i];
+	return bpf_comp_in_tree(filter, 0, lo, n, match, nomatch);
+#elif defined(BITS64)
+	size_t pos = 0;
+
+	for (i = 0; i < n;) {
+		unsigned int hi = (unsigned int)((uint64_t)set[i] >> 32);
+		size_t m = 0, tree_len, next;
+
+		while (i < n && (unsigned int)((uint64_t)set[i] >> 32) == hi)
+			lo[m++] = (unsigned int)(set[i++] & 0xFFFFFFFF);
+		tree_len = bpf_comp_in_tree(NULL, 0, lo, m, 0, 0);
+		next = i < n ? pos + 2 + tree_len : nomatch;
+		if (filter) {
+			/* A still holds |hi| when a group misses. */
+			set_bpf_jump(&filter[pos], BPF_JMP+BPF_JEQ+BPF_K, hi,
+					NEXT, next - pos - 1);
+			set_bpf_stmt(&filter[pos + 1], BPF_LD+BPF_MEM, 0);
+		}
+		bpf_comp_in_tree(filter, pos + 2, lo, m, match, nomatch);
+		pos += 2 + tree_len;
+	}
+	return pos;
+#endif
+}
+
+static int compare_ulong(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a;
+	unsigned long y = *(const unsigned long *)b;
+	return (x > y) - (x < y);
+}
+
+/*
+ * Writes at most BPF_ARG_SET_MAX_LEN(|n|) instructions to |filter|,
+ * jumping to |label_id| when the argument is not in |set|.
+ * Returns 0 if |set| is empty or too large.
+ */
+size_t bpf_arg_comp_in(struct sock_filter *filter, int argidx,
+		const unsigned long *set, size_t n, unsigned int label_id)
+{
+	unsigned long sorted[BPF_ARG_SET_MAX];
+	struct sock_filter *curr_block = filter;
+	size_t i, m, len;
+
+	if (n == 0 || n > BPF_ARG_SET_MAX)
+		return 0;
+
+	memcpy(sorted, set, n * sizeof(*set));
+	qsort(sorted, n, sizeof(*sorted), compare_ulong);
+	for (i = 1, m = 1; i < n; i++) {
+		if (sorted[i] != sorted[m - 1])
+			sorted[m++] = sorted[i];
+	}
+
+	/*
+	 * As with bpf_arg_comp(), a miss falls through to the jump to
+	 * |label_id| and a match skips it.
+	 */
+	curr_block += bpf_load_arg(curr_block, argidx);
+	len = bpf_comp_in(NULL, sorted, m, 0, 0);
+	if (len + 1 > 0xff)
+		return 0;
+	curr_block += bpf_comp_in(curr_block, sorted, m, len + 1, len);
+	curr_block += set_bpf_jump_lbl(curr_block, label_id);
+
 	return curr_block - filter;
 }
 
@@ -184,88 +373,543 @@ void dump_bpf_prog(struct sock_fprog *fprog)
 	dump_bpf_filter(filter, len);
 }
 
+static void print_label(const char *msg, const struct __bpf_label *label)
+{
+	fprintf(stderr, "%s: nr %u, kind %u, group %u\n", msg,
+		(unsigned int)(label->key >> 32),
+		(unsigned int)((label->key >> 24) & 0xff),
+		(unsigned int)(label->key & 0xffffff));
+}
+
 int bpf_resolve_jumps(struct bpf_labels *labels,
 		struct sock_filter *filter, size_t count)
 {
-	struct sock_filter *begin = filter;
-	__u8 insn = count - 1;
+	size_t insn;
 
 	if (count < 1)
 		return -1;
 	/*
 	 * Walk it once, backwards, to build the label table and do fixups.
 	 * Since backward jumps are disallowed by BPF, this is easy.
+	 * Label jumps are always JA, whose 32-bit |k| reaches anywhere in
+	 * the program; conditional jumps only ever target a nearby JA.
 	 */
-	for (filter += insn; filter >= begin; --insn, --filter) {
-		if (filter->code != (BPF_JMP+BPF_JA))
+	for (insn = count; insn-- > 0;) {
+		struct sock_filter *instr = &filter[insn];
+		struct __bpf_label *label;
+
+		if (instr->code != (BPF_JMP+BPF_JA))
 			continue;
-		switch ((filter->jt<<8)|filter->jf) {
+		switch ((instr->jt<<8)|instr->jf) {
 		case (JUMP_JT<<8)|JUMP_JF:
-			if (labels->labels[filter->k].location == 0xffffffff) {
-				fprintf(stderr, "Unresolved label: '%s'\n",
-					labels->labels[filter->k].label);
-				return 1;
+		case (LABEL_JT<<8)|LABEL_JF:
+			if (instr->k >= (unsigned int)labels->count) {
+				fprintf(stderr, "Invalid label id: %u\n",
+					instr->k);
+				return -1;
 			}
-			filter->k = labels->labels[filter->k].location -
-					(insn + 1);
-			filter->jt = 0;
-			filter->jf = 0;
+			break;
+		default:
 			continue;
-		case (LABEL_JT<<8)|LABEL_JF:
-			if (labels->labels[filter->k].location != 0xffffffff) {
-				fprintf(stderr, "Duplicate label use: '%s'\n",
-					labels->labels[filter->k].label);
-				return 1;
+		}
+		label = &labels->labels[instr->k];
+		if (instr->jt == JUMP_JT) {
+			if (label->location == BPF_LABEL_UNRESOLVED) {
+				print_label("Unresolved label", label);
+				return -1;
+			}
+			instr->k = label->location - (insn + 1);
+		} else {
+			if (label->location != BPF_LABEL_UNRESOLVED) {
+				print_label("Duplicate label use", label);
+				return -1;
 			}
-			labels->labels[filter->k].location = insn;
-			filter->k = 0; /* fall through */
-			filter->jt = 0;
-			filter->jf = 0;
+			label->location = insn;
+			instr->k = 0; /* fall through */
+		}
+		instr->jt = 0;
+		instr->jf = 0;
+	}
+	return bpf_check_jumps(filter, count);
+}
+
+int bpf_check_jumps(const struct sock_filter *filter, size_t count)
+{
+	size_t insn;
+
+	for (insn = 0; insn < count; insn++) {
+		const struct sock_filter *instr = &filter[insn];
+		size_t remaining = count - insn - 1;
+
+		if (BPF_CLASS(instr->code) != BPF_JMP)
 			continue;
+		if (instr->code == (BPF_JMP+BPF_JA)) {
+			if (instr->k >= remaining)
+				goto bad_jump;
+		} else if (instr->jt >= remaining || instr->jf >= remaining) {
+			goto bad_jump;
 		}
 	}
+	if (count < 1 || BPF_CLASS(filter[count - 1].code) != BPF_RET) {
+		fprintf(stderr, "BPF program does not end in a return\n");
+		return -1;
+	}
 	return 0;
+
+bad_jump:
+	fprintf(stderr, "BPF jump out of range at instruction %zu\n", insn);
+	return -1;
 }
 
-/* Simple lookup table for labels. */
-int bpf_label_id(struct bpf_labels *labels, const char *label)
+static size_t label_hash(uint64_t key, size_t hash_cap)
 {
-	struct __bpf_label *begin = labels->labels, *end;
+	/* Fibonacci hashing; |hash_cap| is always a power of two. */
+	return (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & (hash_cap - 1);
+}
+
+/* Finds the hash slot for |key|: either its id or an empty (-1) slot. */
+static int *label_slot(struct bpf_labels *labels, uint64_t key)
+{
+	size_t i = label_hash(key, labels->hash_cap);
+	for (;;) {
+		int *slot = &labels->hash[i];
+		if (*slot < 0 || labels->labels[*slot].key == key)
+			return slot;
+		i = (i + 1) & (labels->hash_cap - 1);
+	}
+}
+
+/* Doubles both the id array and the hash table, rehashing every key. */
+static int grow_labels(struct bpf_labels *labels)
+{
+	size_t cap = labels->cap ? 2 * labels->cap : BPF_LABELS_INITIAL_CAP;
+	size_t hash_cap = 2 * cap;
+	struct __bpf_label *new_labels;
+	int *new_hash;
+	int id;
+
+	new_labels = realloc(labels->labels, cap * sizeof(*new_labels));
+	if (!new_labels)
+		return -1;
+	labels->labels = new_labels;
+
+	new_hash = malloc(hash_cap * sizeof(*new_hash));
+	if (!new_hash)
+		return -1;
+	memset(new_hash, 0xff, hash_cap * sizeof(*new_hash));
+
+	free(labels->hash);
+	labels->hash = new_hash;
+	labels->hash_cap = hash_cap;
+	labels->cap = cap;
+
+	for (id = 0; id < labels->count; ++id)
+		*label_slot(labels, labels->labels[id].key) = id;
+	return 0;
+}
+
+/* Hashed lookup table for labels, keyed by bpf_label_key(). */
+int bpf_label_id(struct bpf_labels *labels, uint64_t key)
+{
+	int *slot;
 	int id;
-	if (labels->count == 0) {
-		begin->label = strndup(label, MAX_BPF_LABEL_LEN);
-		if (!begin->label) {
-			return -1;
+
+	/* Keep the hash table at most half full. */
+	if ((size_t)labels->count >= labels->cap && grow_labels(labels))
+		return -1;
+
+	slot = label_slot(labels, key);
+	if (*slot >= 0)
+		return *slot;
+
+	id = labels->count++;
+	labels->labels[id].key = key;
+	labels->labels[id].location = BPF_LABEL_UNRESOLVED;
+	*slot = id;
+	return id;
+}
+
+/* Free the label table. */
+void free_labels(struct bpf_labels *labels)
+{
+	free(labels->labels);
+	free(labels->hash);
+	labels->labels = NULL;
+	labels->hash = NULL;
+	labels->count = 0;
+	labels->cap = 0;
+	labels->hash_cap = 0;
+}
+
+/*
+ * Peephole optimizer.
+ *
+ * Runs on a program whose jumps have already been resolved. Since BPF
+ * only allows forward jumps, every pass is a single walk over the program.
+ */
+#define BPF_OPT_MAX_PASSES 8
+#define BPF_OPT_MAX_RETS 16
+#define BPF_OPT_UNKNOWN (-1)
+#define BPF_OPT_LIVE_A (1U << BPF_MEMWORDS)
+
+#define is_bpf_ja(_instr) ((_instr)->code == (BPF_JMP+BPF_JA))
+#define is_bpf_cond_jump(_instr) \
+	(BPF_CLASS((_instr)->code) == BPF_JMP && !is_bpf_ja(_instr))
+#define is_bpf_ret(_instr) (BPF_CLASS((_instr)->code) == BPF_RET)
+
+/*
+ * Known contents of A and M[] on entry to an instruction, and the set of
+ * M[] words (plus A, as BPF_OPT_LIVE_A) that may still be read from it on.
+ */
+struct bpf_opt_state {
+	int seen;
+	int a;
+	int mem[BPF_MEMWORDS];
+	unsigned int live;
+};
+
+/*
+ * Retargets jumps that land on a JA to that JA's destination, turns JAs
+ * that land on a RET into a copy of that RET, and turns conditional jumps
+ * whose branches agree into a JA. Walking backwards means every jump
+ * target has already been threaded, so a single hop is enough.
+ */
+static void bpf_thread_jumps(struct sock_filter *filter, size_t len)
+{
+	size_t i, t;
+
+	for (i = len; i-- > 0;) {
+		struct sock_filter *instr = &filter[i];
+
+		if (is_bpf_ja(instr)) {
+			t = i + 1 + instr->k;
+			if (t >= len)
+				continue;
+			if (is_bpf_ja(&filter[t]))
+				t += 1 + filter[t].k;
+			if (t >= len)
+				continue;
+			if (is_bpf_ret(&filter[t]))
+				*instr = filter[t];
+			else
+				instr->k = t - i - 1;
+		} else if (is_bpf_cond_jump(instr)) {
+			t = i + 1 + instr->jt;
+			if (t < len && is_bpf_ja(&filter[t]) &&
+			    t + filter[t].k - i <= 0xff)
+				instr->jt = t + filter[t].k - i;
+			t = i + 1 + instr->jf;
+			if (t < len && is_bpf_ja(&filter[t]) &&
+			    t + filter[t].k - i <= 0xff)
+				instr->jf = t + filter[t].k - i;
+			if (instr->jt == instr->jf)
+				set_bpf_jump(instr, BPF_JMP+BPF_JA,
+					     instr->jt, 0, 0);
 		}
-		begin->location = 0xffffffff;
-		labels->count++;
-		return 0;
-	}
-	end = begin + labels->count;
-	for (id = 0; begin < end; ++begin, ++id) {
-		if (!strcmp(label, begin->label))
-			return id;
 	}
-	begin->label = strndup(label, MAX_BPF_LABEL_LEN);
-	if (!begin->label) {
-		return -1;
+}
+
+/*
+ * Points conditional jumps that land on a RET at the last identical RET
+ * in the program, when it is within reach, so that duplicated RET blocks
+ * become unreachable.
+ */
+static void bpf_merge_returns(struct sock_filter *filter, size_t len)
+{
+	struct sock_filter rets[BPF_OPT_MAX_RETS];
+	size_t last[BPF_OPT_MAX_RETS];
+	size_t nrets = 0;
+	size_t i, r;
+
+	for (i = len; i-- > 0;) {
+		struct sock_filter *instr = &filter[i];
+		unsigned char *branches[2] = { &instr->jt, &instr->jf };
+		size_t b;
+
+		if (is_bpf_ret(instr)) {
+			for (r = 0; r < nrets; r++) {
+				if (rets[r].code == instr->code &&
+				    rets[r].k == instr->k)
+					break;
+			}
+			if (r == nrets && nrets < BPF_OPT_MAX_RETS) {
+				rets[nrets] = *instr;
+				last[nrets++] = i;
+			}
+			continue;
+		}
+		if (!is_bpf_cond_jump(instr))
+			continue;
+
+		for (b = 0; b < 2; b++) {
+			size_t t = i + 1 + *branches[b];
+			if (t >= len || !is_bpf_ret(&filter[t]))
+				continue;
+			for (r = 0; r < nrets; r++) {
+				if (rets[r].code == filter[t].code &&
+				    rets[r].k == filter[t].k)
+					break;
+			}
+			if (r < nrets && last[r] - i - 1 <= 0xff)
+				*branches[b] = last[r] - i - 1;
+		}
 	}
-	begin->location = 0xffffffff;
-	labels->count++;
-	return id;
 }
 
-/* Free label strings. */
-void free_label_strings(struct bpf_labels *labels)
+static void bpf_opt_merge_state(struct bpf_opt_state *dst,
+				const struct bpf_opt_state *src)
 {
-	if (labels->count == 0)
+	size_t m;
+
+	if (!dst->seen) {
+		*dst = *src;
 		return;
+	}
+	if (dst->a != src->a)
+		dst->a = BPF_OPT_UNKNOWN;
+	for (m = 0; m < BPF_MEMWORDS; m++) {
+		if (dst->mem[m] != src->mem[m])
+			dst->mem[m] = BPF_OPT_UNKNOWN;
+	}
+}
+
+/*
+ * Marks in |dead| every instruction that is unreachable, is a JA 0,
+ * reloads a value A or M[] is already known to hold, or writes A or an
+ * M[] word that is never read afterwards.
+ * Returns -1 if the program is malformed.
+ */
+static int bpf_find_dead(const struct sock_filter *filter, size_t len,
+			 struct bpf_opt_state *states, unsigned char *dead)
+{
+	size_t i, m;
+
+	memset(states, 0, len * sizeof(*states));
+	states[0].seen = 1;
+	states[0].a = BPF_OPT_UNKNOWN;
+	for (m = 0; m < BPF_MEMWORDS; m++)
+		states[0].mem[m] = BPF_OPT_UNKNOWN;
+
+	for (i = 0; i < len; i++) {
+		const struct sock_filter *instr = &filter[i];
+		struct bpf_opt_state state = states[i];
+		size_t succ[2];
+		size_t nsucc = 0, s;
+
+		dead[i] = !state.seen;
+		if (!state.seen)
+			continue;
+
+		switch (BPF_CLASS(instr->code)) {
+		case BPF_LD:
+			if (instr->code == (BPF_LD+BPF_W+BPF_ABS) &&
+			    instr->k < sizeof(struct seccomp_data)) {
+				if (state.a == (int)instr->k)
+					dead[i] = 1;
+				state.a = instr->k;
+			} else if (instr->code == (BPF_LD+BPF_MEM) &&
+				   instr->k < BPF_MEMWORDS) {
+				if (state.a != BPF_OPT_UNKNOWN &&
+				    state.a == state.mem[instr->k])
+					dead[i] = 1;
+				state.a = state.mem[instr->k];
+			} else {
+				state.a = BPF_OPT_UNKNOWN;
+			}
+			break;
+		case BPF_ST:
+			if (instr->k >= BPF_MEMWORDS)
+				return -1;
+			if (state.a != BPF_OPT_UNKNOWN &&
+			    state.mem[instr->k] == state.a)
+				dead[i] = 1;
+			state.mem[instr->k] = state.a;
+			break;
+		case BPF_STX:
+			if (instr->k >= BPF_MEMWORDS)
+				return -1;
+			state.mem[instr->k] = BPF_OPT_UNKNOWN;
+			break;
+		case BPF_LDX:
+		case BPF_JMP:
+		case BPF_RET:
+			break;
+		case BPF_MISC:
+			if (BPF_MISCOP(instr->code) != BPF_TAX)
+				state.a = BPF_OPT_UNKNOWN;
+			break;
+		default:
+			state.a = BPF_OPT_UNKNOWN;
+			break;
+		}
 
-	struct __bpf_label *begin = labels->labels, *end;
+		if (is_bpf_ret(instr)) {
+			continue;
+		} else if (is_bpf_ja(instr)) {
+			if (instr->k == 0)
+				dead[i] = 1;
+			succ[nsucc++] = i + 1 + instr->k;
+		} else if (is_bpf_cond_jump(instr)) {
+			succ[nsucc++] = i + 1 + instr->jt;
+			succ[nsucc++] = i + 1 + instr->jf;
+		} else {
+			succ[nsucc++] = i + 1;
+		}
 
-	end = begin + labels->count;
-	for (; begin < end; ++begin) {
-		if (begin->label)
-			free((void*)(begin->label));
+		for (s = 0; s < nsucc; s++) {
+			if (succ[s] >= len)
+				return -1;
+			bpf_opt_merge_state(&states[succ[s]], &state);
+		}
 	}
+
+	/*
+	 * Walk backwards to find what each instruction's successors may read.
+	 * Instructions already marked dead are skipped over, since they will
+	 * be removed.
+	 */
+	for (i = len; i-- > 0;) {
+		const struct sock_filter *instr = &filter[i];
+		unsigned int live;
+		unsigned int mem_bit = 1U << (instr->k & (BPF_MEMWORDS - 1));
+
+		if (!states[i].seen)
+			continue;
+
+		if (is_bpf_ret(instr)) {
+			live = 0;
+		} else if (is_bpf_ja(instr)) {
+			live = states[i + 1 + instr->k].live;
+		} else if (is_bpf_cond_jump(instr)) {
+			live = states[i + 1 + instr->jt].live |
+			       states[i + 1 + instr->jf].live;
+		} else {
+			live = states[i + 1].live;
+		}
+
+		if (dead[i]) {
+			states[i].live = live;
+			continue;
+		}
+
+		switch (BPF_CLASS(instr->code)) {
+		case BPF_LD:
+			if (!(live & BPF_OPT_LIVE_A)) {
+				dead[i] = 1;
+				break;
+			}
+			live &= ~BPF_OPT_LIVE_A;
+			if (BPF_MODE(instr->code) == BPF_MEM)
+				live |= mem_bit;
+			break;
+		case BPF_LDX:
+			if (BPF_MODE(instr->code) == BPF_MEM)
+				live |= mem_bit;
+			break;
+		case BPF_ST:
+			if (!(live & mem_bit)) {
+				dead[i] = 1;
+				break;
+			}
+			live = (live & ~mem_bit) | BPF_OPT_LIVE_A;
+			break;
+		case BPF_STX:
+			live &= ~mem_bit;
+			break;
+		case BPF_JMP:
+			if (!is_bpf_ja(instr))
+				live |= BPF_OPT_LIVE_A;
+			break;
+		case BPF_RET:
+			if (BPF_RVAL(instr->code) == BPF_A)
+				live |= BPF_OPT_LIVE_A;
+			break;
+		case BPF_MISC:
+			if (BPF_MISCOP(instr->code) == BPF_TAX)
+				live |= BPF_OPT_LIVE_A;
+			else
+				live &= ~BPF_OPT_LIVE_A;
+			break;
+		default:
+			/* ALU instructions read and write A. */
+			live |= BPF_OPT_LIVE_A;
+			break;
+		}
+		states[i].live = live;
+	}
+	return 0;
+}
+
+/*
+ * Drops the instructions marked in |dead| and fixes up jump offsets.
+ * Dead instructions either fall through or are never reached, so a jump
+ * to one of them lands on the next live instruction instead.
+ */
+static size_t bpf_compact(struct sock_filter *filter, size_t len,
+			  const unsigned char *dead, size_t *new_idx)
+{
+	size_t i, out = 0;
+
+	/* |new_idx[i]| is the new index of the first live instruction >= i. */
+	for (i = 0; i < len; i++)
+		if (!dead[i])
+			out++;
+	new_idx[len] = out;
+	for (i = len; i-- > 0;)
+		new_idx[i] = dead[i] ? new_idx[i + 1] : new_idx[i + 1] - 1;
+
+	out = 0;
+	for (i = 0; i < len; i++) {
+		struct sock_filter instr = filter[i];
+		if (dead[i])
+			continue;
+		if (is_bpf_ja(&instr)) {
+			instr.k = new_idx[i + 1 + instr.k] - out - 1;
+		} else if (is_bpf_cond_jump(&instr)) {
+			instr.jt = new_idx[i + 1 + instr.jt] - out - 1;
+			instr.jf = new_idx[i + 1 + instr.jf] - out - 1;
+		}
+		filter[out++] = instr;
+	}
+	return out;
+}
+
+/*
+ * Optimizes the resolved program in |filter| in place.
+ * Returns the new length, or |len| if the program was left untouched.
+ */
+size_t bpf_optimize(struct sock_filter *filter, size_t len)
+{
+	struct bpf_opt_state *states;
+	unsigned char *dead;
+	size_t *new_idx;
+	size_t pass;
+
+	if (len == 0)
+		return len;
+
+	states = malloc(len * sizeof(*states));
+	dead = malloc(len * sizeof(*dead));
+	new_idx = malloc((len + 1) * sizeof(*new_idx));
+	if (!states || !dead || !new_idx)
+		goto out;
+
+	for (pass = 0; pass < BPF_OPT_MAX_PASSES; pass++) {
+		size_t new_len;
+
+		bpf_thread_jumps(filter, len);
+		bpf_merge_returns(filter, len);
+		if (bpf_find_dead(filter, len, states, dead))
+			break;
+		new_len = bpf_compact(filter, len, dead, new_idx);
+		if (new_len == len)
+			break;
+		len = new_len;
+	}
+
+out:
+	free(states);
+	free(dead);
+	free(new_idx);
+	return len;
 }
@@ -13,6 +13,7 @@
 #include <linux/audit.h>
 #include <linux/filter.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <sys/user.h>
 
 #if __BITS_PER_LONG == 32 || defined(__ILP32__)
@@ -30,7 +31,8 @@ enum operator {
 	LE,
 	GT,
 	GE,
-	SET
+	SET,
+	IN
 };
 
 /*
@@ -104,9 +106,14 @@ struct seccomp_data {
 #define BPF_LOAD_ARG_LEN	1U
 #define BPF_COMP_LEN		1U
 #define BPF_ARG_COMP_LEN (BPF_LOAD_ARG_LEN + BPF_COMP_LEN)
+/* Ordered comparisons are a single instruction too. */
+#define BPF_ORD_COMP_LEN	1U
+#define BPF_ARG_COMP_MAX_LEN (BPF_LOAD_ARG_LEN + BPF_ORD_COMP_LEN)
 
 #define bpf_comp_jeq bpf_comp_jeq32
 #define bpf_comp_jset bpf_comp_jset32
+#define bpf_comp_jgt bpf_comp_jgt32
+#define bpf_comp_jge bpf_comp_jge32
 
 #define LO_ARG(idx) offsetof(struct seccomp_data, args[(idx)])
 
@@ -118,9 +125,17 @@ struct seccomp_data {
 #define BPF_LOAD_ARG_LEN	4U
 #define BPF_COMP_LEN		3U
 #define BPF_ARG_COMP_LEN (BPF_LOAD_ARG_LEN + BPF_COMP_LEN)
+/*
+ * Ordered comparisons take 4: the high words decide unless they are equal,
+ * which takes both a JGT and a JEQ.
+ */
+#define BPF_ORD_COMP_LEN	4U
+#define BPF_ARG_COMP_MAX_LEN (BPF_LOAD_ARG_LEN + BPF_ORD_COMP_LEN)
 
 #define bpf_comp_jeq bpf_comp_jeq64
 #define bpf_comp_jset bpf_comp_jset64
+#define bpf_comp_jgt bpf_comp_jgt64
+#define bpf_comp_jge bpf_comp_jge64
 
 /* Ensure that we load the logically correct offset. */
 #if defined(__LITTLE_ENDIAN)
@@ -138,6 +153,13 @@ struct seccomp_data {
 
 #endif
 
+/*
+ * Set membership ("arg0 in {1,2,3}") compiles to a jump tree of at most
+ * 4 instructions per element, plus the final jump to the failure label.
+ */
+#define BPF_ARG_SET_MAX		32U
+#define BPF_ARG_SET_MAX_LEN(_n)	(BPF_LOAD_ARG_LEN + 4U * (_n) + 1U)
+
 /* Common jump targets. */
 #define NEXT 0
 #define SKIP 1
@@ -149,15 +171,36 @@ struct seccomp_data {
 #define LABEL_JT 0xfe
 #define LABEL_JF 0xfe
 
-#define MAX_BPF_LABEL_LEN 32
+/*
+ * Labels are identified by integer keys built from a
+ * (syscall number, label kind, AND group index) tuple.
+ */
+#define LABEL_KIND_ENTRY	0
+#define LABEL_KIND_SUCCESS	1
+#define LABEL_KIND_GROUP_END	2
+
+#define bpf_label_key(_nr, _kind, _group) \
+	(((uint64_t)(unsigned int)(_nr) << 32) | \
+	 ((uint64_t)((_kind) & 0xff) << 24) | \
+	 ((uint64_t)(_group) & 0xffffff))
+
+#define BPF_LABELS_INITIAL_CAP 64
+#define BPF_LABEL_UNRESOLVED 0xffffffff
 
-#define BPF_LABELS_MAX 256
+/*
+ * Label table. |labels| is indexed by label id, and |hash| maps label keys
+ * to ids using open addressing. Both grow on demand, so a zeroed struct
+ * is a valid empty table.
+ */
 struct bpf_labels {
 	int count;
+	size_t cap;
 	struct __bpf_label {
-		const char *label;
+		uint64_t key;
 		unsigned int location;
-	} labels[BPF_LABELS_MAX];
+	} *labels;
+	size_t hash_cap;
+	int *hash;
 };
 
 /* BPF instruction manipulation functions and macros. */
@@ -205,8 +248,10 @@ static inline size_t set_bpf_instr(struct sock_filter *instr,
 /* BPF label functions. */
 int bpf_resolve_jumps(struct bpf_labels *labels,
 		struct sock_filter *filter, size_t count);
-int bpf_label_id(struct bpf_labels *labels, const char *label);
-void free_label_strings(struct bpf_labels *labels);
+/* Checks that every jump lands inside the program and that it ends in a RET. */
+int bpf_check_jumps(const struct sock_filter *filter, size_t count);
+int bpf_label_id(struct bpf_labels *labels, uint64_t key);
+void free_labels(struct bpf_labels *labels);
 
 /* BPF helper functions. */
 size_t bpf_load_arg(struct sock_filter *filter, int argidx);
@@ -214,18 +259,27 @@ size_t bpf_comp_jeq(struct sock_filter *filter, unsigned long c,
 		unsigned char jt, unsigned char jf);
 size_t bpf_comp_jset(struct sock_filter *filter, unsigned long mask,
 		unsigned char jt, unsigned char jf);
+size_t bpf_comp_jgt(struct sock_filter *filter, unsigned long c,
+		unsigned char jt, unsigned char jf);
+size_t bpf_comp_jge(struct sock_filter *filter, unsigned long c,
+		unsigned char jt, unsigned char jf);
 
 /* Functions called by syscall_filter.c */
 #define ARCH_VALIDATION_LEN 3U
 #define ALLOW_SYSCALL_LEN 2U
 
-size_t bpf_arg_comp(struct sock_filter **pfilter,
+size_t bpf_arg_comp(struct sock_filter *filter,
 		int op, int argidx, unsigned long c, unsigned int label_id);
+size_t bpf_arg_comp_in(struct sock_filter *filter, int argidx,
+		const unsigned long *set, size_t n, unsigned int label_id);
 size_t bpf_validate_arch(struct sock_filter *filter);
 size_t bpf_allow_syscall(struct sock_filter *filter, int nr);
 size_t bpf_allow_syscall_args(struct sock_filter *filter,
 		int nr, unsigned int id);
 
+/* Optimization functions. */
+size_t bpf_optimize(struct sock_filter *filter, size_t len);
+
 /* Debug functions. */
 void dump_bpf_prog(struct sock_fprog *fprog);
 void dump_bpf_filter(struct sock_filter *filter, unsigned short len);
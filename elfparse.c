@@ -4,6 +4,13 @@
  * found in the LICENSE file.
  */
 
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include "elfparse.h"
 
 int is_elf_magic (const uint8_t *buf)
@@ -14,99 +21,342 @@ int is_elf_magic (const uint8_t *buf)
 	       (buf[EI_MAG3] == ELFMAG3);
 }
 
+/*
+ * Walks the program headers straight out of the mapped file, so that the
+ * whole table is decoded in one pass without any further I/O.
+ */
 #define parseElftemplate(bit)                                                \
-ElfType parseElf ## bit(FILE *elf_file, uint8_t *pHead, int little_endian)   \
+ElfType parseElf ## bit(const uint8_t *image, size_t size,                   \
+			int little_endian)                                   \
 {                                                                            \
-	ElfType                      ret          = ELFSTATIC;               \
-	Minijail_Elf ## bit ## _Ehdr *pHeader     = NULL;                    \
-	Minijail_Elf ## bit ## _Phdr pheader      = { 0 };                   \
+	const Minijail_Elf ## bit ## _Ehdr *pHeader = NULL;                  \
+	const Minijail_Elf ## bit ## _Phdr *pheaders = NULL;                 \
+	uint64_t                     phoff        = 0;                       \
+	uint16_t                     phentsize    = 0;                       \
+	uint16_t                     phnum        = 0;                       \
+	uint32_t                     type         = 0;                       \
 	uint32_t                     i            = 0;                       \
 	                                                                     \
-	if (!elf_file || !pHead)                                             \
+	if (!image || size < sizeof(*pHeader))                               \
 		return ELFERROR;                                             \
 	                                                                     \
-	pHeader = (Minijail_Elf ## bit ## _Ehdr *)pHead;                     \
+	pHeader = (const Minijail_Elf ## bit ## _Ehdr *)image;               \
 	if (little_endian) {                                                 \
-		pHeader->e_phoff = le ## bit ## toh(pHeader->e_phoff);       \
-		pHeader->e_phentsize = le16toh(pHeader->e_phentsize);        \
-		pHeader->e_phnum = le16toh(pHeader->e_phnum);                \
+		phoff = le ## bit ## toh(pHeader->e_phoff);                  \
+		phentsize = le16toh(pHeader->e_phentsize);                   \
+		phnum = le16toh(pHeader->e_phnum);                           \
 	} else {                                                             \
-		pHeader->e_phoff = be ## bit ## toh(pHeader->e_phoff);       \
-		pHeader->e_phentsize = be16toh(pHeader->e_phentsize);        \
-		pHeader->e_phnum = be16toh(pHeader->e_phnum);                \
+		phoff = be ## bit ## toh(pHeader->e_phoff);                  \
+		phentsize = be16toh(pHeader->e_phentsize);                   \
+		phnum = be16toh(pHeader->e_phnum);                           \
 	}                                                                    \
-	if (pHeader->e_phentsize != sizeof(Minijail_Elf ## bit ## _Phdr))    \
+	if (phentsize != sizeof(*pheaders))                                  \
 		return ELFERROR;                                             \
-	                                                                     \
-	if (fseek(elf_file, pHeader->e_phoff, SEEK_SET) != 0)                \
+	if (phoff > size || phnum > (size - phoff) / sizeof(*pheaders))      \
 		return ELFERROR;                                             \
 	                                                                     \
-	for (i = 0; i < pHeader->e_phnum; i++) {                             \
-		if (fread(&pheader, sizeof(pheader), 1, elf_file) == 1) {    \
-			if (pheader.p_type == PT_INTERP) {                   \
-				ret = ELFDYNAMIC;                            \
-				break;                                       \
-			}                                                    \
-		} else {                                                     \
-			ret = ELFERROR;                                      \
-			break;                                               \
-		}                                                            \
+	pheaders = (const Minijail_Elf ## bit ## _Phdr *)(image + phoff);    \
+	for (i = 0; i < phnum; i++) {                                        \
+		if (little_endian)                                           \
+			type = le32toh(pheaders[i].p_type);                  \
+		else                                                         \
+			type = be32toh(pheaders[i].p_type);                  \
+		if (type == PT_INTERP)                                       \
+			return ELFDYNAMIC;                                   \
 	}                                                                    \
-	return ret;                                                          \
+	return ELFSTATIC;                                                    \
 }
 parseElftemplate(64)
 parseElftemplate(32)
 
+static ElfType parse_elf(const uint8_t *image, size_t size)
+{
+	if (!is_elf_magic(image)) {
+		/*
+		 * The binary is not an ELF. We assume it's a
+		 * script, and let execve decide if this is valid.
+		 * get_program_linkage() checks the interpreter
+		 * of #! scripts to guard against static
+		 * interpreters escaping the sandbox.
+		 */
+		return ELFDYNAMIC;
+	}
+	if ((image[EI_DATA] == ELFDATA2LSB) &&
+	    (image[EI_CLASS] == ELFCLASS64)) {
+		/* 64 bit little endian */
+		return parseElf64(image, size, 1);
+	} else if ((image[EI_DATA] == ELFDATA2MSB) &&
+		   (image[EI_CLASS] == ELFCLASS64)) {
+		/* 64 bit big endian */
+		return parseElf64(image, size, 0);
+	} else if ((image[EI_DATA] == ELFDATA2LSB) &&
+		   (image[EI_CLASS] == ELFCLASS32)) {
+		/* 32 bit little endian */
+		return parseElf32(image, size, 1);
+	} else if ((image[EI_DATA] == ELFDATA2MSB) &&
+		   (image[EI_CLASS] == ELFCLASS32)) {
+		/* 32 bit big endian */
+		return parseElf32(image, size, 0);
+	}
+	return ELFERROR;
+}
+
+static ElfType get_elf_linkage_fd(int fd, const struct stat *st)
+{
+	ElfType ret;
+	void *image;
+
+	if (!S_ISREG(st->st_mode))
+		return ELFERROR;
+	if (st->st_size < HEADERSIZE) {
+		/*
+		 * The file is smaller than |HEADERSIZE| bytes.
+		 * We assume it's a short script. See parse_elf() for
+		 * reasoning on scripts.
+		 */
+		return ELFDYNAMIC;
+	}
+	/* Only the pages holding the headers are ever faulted in. */
+	image = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (image == MAP_FAILED)
+		return ELFERROR;
+	ret = parse_elf(image, st->st_size);
+	munmap(image, st->st_size);
+	return ret;
+}
+
 /* Public function to determine the linkage of an ELF. */
 ElfType get_elf_linkage(const char *path)
 {
 	ElfType ret = ELFERROR;
-	FILE *elf_file = NULL;
-	uint8_t pHeader[HEADERSIZE] = "";
-
-	elf_file = fopen(path, "r");
-	if (elf_file) {
-		if (fread(pHeader, 1, HEADERSIZE, elf_file) == HEADERSIZE) {
-			if (is_elf_magic(pHeader)) {
-				if ((pHeader[EI_DATA] == ELFDATA2LSB) &&
-				    (pHeader[EI_CLASS] == ELFCLASS64)) {
-					/* 64 bit little endian */
-					ret = parseElf64(elf_file, pHeader, 1);
-				} else if ((pHeader[EI_DATA] == ELFDATA2MSB) &&
-					  (pHeader[EI_CLASS] == ELFCLASS64)) {
-					/* 64 bit big endian */
-					ret = parseElf64(elf_file, pHeader, 0);
-				} else if ((pHeader[EI_DATA] == ELFDATA2LSB) &&
-					  (pHeader[EI_CLASS] == ELFCLASS32)) {
-					/* 32 bit little endian */
-					ret = parseElf32(elf_file, pHeader, 1);
-				} else if ((pHeader[EI_DATA] == ELFDATA2MSB) &&
-					  (pHeader[EI_CLASS] == ELFCLASS32)) {
-					/* 32 bit big endian */
-					ret = parseElf32(elf_file, pHeader, 0);
-				}
-			} else {
-				/*
-				 * The binary is not an ELF. We assume it's a
-				 * script. We should parse the #! line and
-				 * check the interpreter to guard against
-				 * static interpreters escaping the sandbox.
-				 * As minijail is only called from rootfs
-				 * it was deemed not necessary to check this.
-				 * So we will just let execve decided if this
-				 * is valid.
-				 */
-				ret = ELFDYNAMIC;
-			}
-		} else {
-			/*
-			 * The file is smaller than |HEADERSIZE| bytes.
-			 * We assume it's a short script. See above for
-			 * reasoning on scripts.
-			 */
-			ret = ELFDYNAMIC;
-		}
-		fclose(elf_file);
+	struct stat st;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0)
+		return ELFERROR;
+	if (!fstat(fd, &st))
+		ret = get_elf_linkage_fd(fd, &st);
+	close(fd);
+	return ret;
+}
+
+/*
+ * The cache is a header followed by a fixed table of ELF_CACHE_SLOTS entries,
+ * indexed by a hash of the file's identity and the kind of fact recorded about
+ * it. Colliding entries just evict each other. Entries are read and written
+ * whole with pread/pwrite, and carry a checksum so that a torn or stale entry
+ * is simply a miss. The identity includes the ctime, which unlike the mtime
+ * can't be set back after rewriting a file.
+ */
+#define ELF_CACHE_SLOTS 256
+#define ELF_CACHE_VERSION 4
+#define ELF_CACHE_MAGIC "minijail ELF cache\n"
+#define ELF_CACHE_HEADER_SIZE 64
+
+struct elf_cache_entry {
+	uint32_t dev_major;
+	uint32_t dev_minor;
+	uint64_t ino;
+	int64_t btime_sec;
+	int64_t btime_nsec;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	int64_t ctime_sec;
+	int64_t ctime_nsec;
+	int64_t size;
+	uint32_t kind;
+	uint32_t version;
+	int32_t value;
+	uint32_t pad;
+	uint64_t check;
+};
+
+/* FNV-1a. */
+static uint64_t elf_cache_hash(const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ULL;
 	}
+	return hash;
+}
+
+/*
+ * Fills in the key for the file open as |fd| and returns its slot, or -1.
+ * Inode numbers get reused and timestamps are coarse, so the birth time,
+ * which nothing can set, is what tells a new file in an old inode apart.
+ * Files on filesystems that don't record one are never cached.
+ */
+static off_t elf_cache_key(struct elf_cache_entry *e, int fd, int kind)
+{
+	struct statx stx;
+	uint64_t hash;
+
+	if (statx(fd, "", AT_EMPTY_PATH, STATX_BASIC_STATS | STATX_BTIME,
+		  &stx) || !(stx.stx_mask & STATX_BTIME))
+		return -1;
+	memset(e, 0, sizeof(*e));
+	e->dev_major = stx.stx_dev_major;
+	e->dev_minor = stx.stx_dev_minor;
+	e->ino = stx.stx_ino;
+	e->btime_sec = stx.stx_btime.tv_sec;
+	e->btime_nsec = stx.stx_btime.tv_nsec;
+	e->mtime_sec = stx.stx_mtime.tv_sec;
+	e->mtime_nsec = stx.stx_mtime.tv_nsec;
+	e->ctime_sec = stx.stx_ctime.tv_sec;
+	e->ctime_nsec = stx.stx_ctime.tv_nsec;
+	e->size = stx.stx_size;
+	e->kind = kind;
+	e->version = ELF_CACHE_VERSION;
+	hash = elf_cache_hash(e, offsetof(struct elf_cache_entry, value));
+	return ELF_CACHE_HEADER_SIZE + (hash % ELF_CACHE_SLOTS) * sizeof(*e);
+}
+
+int elf_cache_open(const char *cache_path)
+{
+	char header[ELF_CACHE_HEADER_SIZE] = ELF_CACHE_MAGIC;
+	char found[ELF_CACHE_HEADER_SIZE];
+	struct stat st;
+	int fd;
+
+	if (geteuid() != 0)
+		return -1;
+	/* Never block on, or take over, something that isn't a file. */
+	fd = open(cache_path, O_RDWR | O_CLOEXEC | O_NOFOLLOW | O_NOCTTY |
+		  O_NONBLOCK);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_uid != 0 ||
+	    (st.st_mode & (S_IWGRP | S_IWOTH)))
+		goto bad;
+	if (st.st_size == 0) {
+		if (pwrite(fd, header, sizeof(header), 0) != sizeof(header))
+			goto bad;
+	} else if (pread(fd, found, sizeof(found), 0) != sizeof(found) ||
+		   memcmp(found, header, sizeof(header))) {
+		/* Some other file root owns; leave it alone. */
+		goto bad;
+	}
+	return fd;
+
+bad:
+	close(fd);
+	return -1;
+}
+
+int elf_cache_lookup(int cache_fd, int fd, int kind, int *value)
+{
+	struct elf_cache_entry key, entry;
+	off_t slot;
+
+	if (cache_fd < 0)
+		return -1;
+	slot = elf_cache_key(&key, fd, kind);
+	if (slot < 0)
+		return -1;
+	if (pread(cache_fd, &entry, sizeof(entry), slot) != sizeof(entry) ||
+	    memcmp(&entry, &key, offsetof(struct elf_cache_entry, value)) ||
+	    entry.check != elf_cache_hash(&entry,
+					  offsetof(struct elf_cache_entry,
+						   check)))
+		return -1;
+	*value = entry.value;
+	return 0;
+}
+
+int elf_cache_store(int cache_fd, int fd, int kind, int value)
+{
+	struct elf_cache_entry entry;
+	off_t slot;
+
+	if (cache_fd < 0)
+		return -1;
+	slot = elf_cache_key(&entry, fd, kind);
+	if (slot < 0)
+		return -1;
+	entry.value = value;
+	entry.check = elf_cache_hash(&entry,
+				     offsetof(struct elf_cache_entry, check));
+	if (pwrite(cache_fd, &entry, sizeof(entry), slot) != sizeof(entry))
+		return -1;
+	return 0;
+}
+
+ElfType get_elf_linkage_cached(const char *path, int cache_fd)
+{
+	ElfType ret = ELFERROR;
+	struct stat st;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0)
+		return ELFERROR;
+	if (fstat(fd, &st)) {
+		close(fd);
+		return ELFERROR;
+	}
+	if (elf_cache_lookup(cache_fd, fd, ELF_CACHE_LINKAGE, &ret)) {
+		ret = get_elf_linkage_fd(fd, &st);
+		/* Best effort: a failed store is just another miss later. */
+		if (ret != ELFERROR)
+			elf_cache_store(cache_fd, fd, ELF_CACHE_LINKAGE, ret);
+	}
+	close(fd);
 	return ret;
 }
+
+int get_script_interpreter(const char *path, char *interp, size_t len)
+{
+	char buf[SHEBANGSIZE + 1];
+	char *start, *end;
+	ssize_t bytes;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0)
+		return -1;
+	bytes = pread(fd, buf, SHEBANGSIZE, 0);
+	close(fd);
+	if (bytes < 2 || buf[0] != '#' || buf[1] != '!')
+		return -1;
+	buf[bytes] = '\0';
+
+	/* Same parsing as the kernel's binfmt_script. */
+	start = buf + 2;
+	start += strspn(start, " \t");
+	end = start + strcspn(start, " \t\n");
+	if (end == start || (size_t)(end - start) >= len)
+		return -1;
+	memcpy(interp, start, end - start);
+	interp[end - start] = '\0';
+	return 0;
+}
+
+ElfType get_program_linkage(const char *path, elf_resolve_path_t resolve,
+			    void *data, int cache_fd)
+{
+	char resolved[PATH_MAX + 1];
+	char interp[PATH_MAX + 1];
+	int depth;
+
+	if (strlen(path) >= sizeof(resolved))
+		return ELFERROR;
+	strcpy(resolved, path);
+	for (depth = 0; !get_script_interpreter(resolved, interp,
+						sizeof(interp)); depth++) {
+		/* execve(2) gives up past this many levels as well. */
+		if (depth == MAX_INTERP_DEPTH)
+			return ELFERROR;
+		if (!resolve) {
+			strcpy(resolved, interp);
+		} else if (resolve(data, resolved, sizeof(resolved),
+				   interp)) {
+			return ELFERROR;
+		}
+	}
+	if (cache_fd >= 0)
+		return get_elf_linkage_cached(resolved, cache_fd);
+	return get_elf_linkage(resolved);
+}
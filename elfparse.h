@@ -16,6 +16,7 @@
 #include <stdint.h>
 #include <endian.h>
 #include <string.h>
+#include <linux/limits.h>
 
 /*
  * These structs come from elf.h
@@ -100,10 +101,71 @@ typedef struct
  */
 #define HEADERSIZE  128
 
+/*
+ * How much of a script execve(2) looks at for its #! line (BINPRM_BUF_SIZE),
+ * and how many levels of scripts it follows to find a binary.
+ */
+#define SHEBANGSIZE       256
+#define MAX_INTERP_DEPTH  4
+
 typedef int ElfType;
 
 ElfType get_elf_linkage(const char *path);
 
+/*
+ * Opens the cache file at |cache_path| for the functions below, and returns
+ * its fd, or -1. What the cache records decides how programs get jailed, so
+ * only root can open one, and only if root owns it, nobody else can write it,
+ * and it is either empty or already a cache. It is never created here: make
+ * it with e.g. "install -m 600 /dev/null <file>". The fd can be used after
+ * dropping privileges. Root writes to the file, so |cache_path| must not come
+ * from an unprivileged caller.
+ */
+int elf_cache_open(const char *cache_path);
+
+/*
+ * Same as get_elf_linkage(), but remembers results in the cache |cache_fd|,
+ * keyed by device, inode, birth time, mtime, ctime and size, so that running
+ * the same binary again skips parsing it. Files whose filesystem doesn't
+ * record a birth time are parsed every time.
+ */
+ElfType get_elf_linkage_cached(const char *path, int cache_fd);
+
+/*
+ * The cache file used by get_elf_linkage_cached() can record other facts
+ * about a file as well, each of a different |kind|. elf_cache_lookup()
+ * returns 0 and fills in |value| if one was recorded for the file open as
+ * |fd| as it is now; otherwise, or if the cache is unusable, it returns -1.
+ * elf_cache_store() returns 0 on success or -1.
+ */
+#define ELF_CACHE_LINKAGE  0
+#define ELF_CACHE_PRELOAD  1
+
+int elf_cache_lookup(int cache_fd, int fd, int kind, int *value);
+int elf_cache_store(int cache_fd, int fd, int kind, int value);
+
+/*
+ * If |path| is a #! script, copies the path of its interpreter into |interp|,
+ * of size |len|, and returns 0. Otherwise returns -1.
+ */
+int get_script_interpreter(const char *path, char *interp, size_t len);
+
+/*
+ * Maps |path| to where it is found from outside the jail, into |buf| of size
+ * |len|. Returns 0 on success.
+ */
+typedef int (*elf_resolve_path_t)(void *data, char *buf, size_t len,
+				  const char *path);
+
+/*
+ * Determines the linkage of the program execve(2) would actually load for
+ * |path|: for #! scripts, that of the interpreter, followed through scripts
+ * interpreted by scripts. Interpreter paths are passed through |resolve|
+ * along with |data|, if given. Uses the cache |cache_fd|, unless it is -1.
+ */
+ElfType get_program_linkage(const char *path, elf_resolve_path_t resolve,
+			    void *data, int cache_fd);
+
 
 
 #endif /* _ELFPARSE_H_ */
\ No newline at end of file
@@ -10,6 +10,8 @@
 #ifndef LIBMINIJAIL_PRIVATE_H
 #define LIBMINIJAIL_PRIVATE_H
 
+#include <stdint.h>
+
 /* Explicitly declare exported functions so that -fvisibility tricks
  * can be used for testing and minimal symbol leakage occurs.
  */
@@ -20,6 +22,58 @@ static const char *kLdPreloadEnvVar = "LD_PRELOAD";
 
 struct minijail;
 
+/*
+ * Marshalled jails start with a struct marshal_header, followed by records
+ * made of a struct marshal_record and |length| bytes of value, padded to
+ * MARSHAL_ALIGN. Values use the sender's byte order and are only decoded by
+ * a library built from the same sources, but every record is bounds-checked.
+ *
+ * New fields get new tags without bumping MARSHAL_VERSION: decoders skip the
+ * tags they don't know, unless they have MARSHAL_REQUIRED set, which tags that
+ * restrict the jail further must. MARSHAL_VERSION only changes when existing
+ * records change meaning.
+ */
+#define MARSHAL_MAGIC 0x4c4a4d6d	/* "mMJL" */
+#define MARSHAL_VERSION 1
+#define MARSHAL_ALIGN 8
+#define MARSHAL_REQUIRED 0x8000
+
+struct marshal_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t reserved;
+	uint64_t length;	/* Of the whole buffer, header included. */
+};
+
+struct marshal_record {
+	uint16_t tag;
+	uint16_t reserved;
+	uint32_t length;
+};
+
+/* Fields that are zero are left out. */
+enum marshal_tag {
+	MARSHAL_TAG_FLAGS = 1,		/* uint64_t, see MARSHAL_FLAGS */
+	MARSHAL_TAG_UID,		/* uint32_t */
+	MARSHAL_TAG_GID,		/* uint32_t */
+	MARSHAL_TAG_USERGID,		/* uint32_t */
+	MARSHAL_TAG_USER,		/* NUL-terminated string */
+	MARSHAL_TAG_CAPS,		/* uint64_t */
+	MARSHAL_TAG_CHROOTDIR,		/* NUL-terminated string */
+	MARSHAL_TAG_CHDIR,		/* NUL-terminated string */
+	MARSHAL_TAG_FILTER,		/* struct sock_filter[] */
+	MARSHAL_TAG_BINDING,		/* uint32_t writeable, src, dest */
+	MARSHAL_TAG_TMP_SIZE,		/* uint64_t */
+	MARSHAL_TAG_SCRATCH_DIR,	/* NUL-terminated string */
+	MARSHAL_TAG_SCRATCH_SIZE,	/* uint64_t */
+	MARSHAL_TAG_PROC_OPTIONS,	/* uint32_t */
+	MARSHAL_TAG_STACK_LIMIT,	/* uint32_t */
+	MARSHAL_TAG_TIME_LIMIT,		/* uint32_t */
+	MARSHAL_TAG_EXTRA_WALL_TIME,	/* uint32_t */
+	MARSHAL_TAG_MEMORY_LIMIT,	/* uint32_t */
+	MARSHAL_TAG_OUTPUT_LIMIT,	/* uint32_t */
+};
+
 /* minijail_size: returns the size (in bytes) of @j if marshalled
  * @j jail to compute size of
  *
@@ -34,10 +88,10 @@ extern size_t minijail_size(const struct minijail *j);
  *
  * Returns 0 on success.
  *
- * Writes |j| to |buf| such that it can be reparsed by the same
- * library on the same architecture.  This is meant to be used
- * by minijail0.c and libminijailpreload.c.  minijail flags that
- * require minijail_run() will be excluded.
+ * Writes |j| to |buf| in the format described above, such that it can be
+ * reparsed by the same library on the same architecture.  This is meant to
+ * be used by minijail0.c and libminijailpreload.c.  File descriptors and
+ * other state that only means something in the parent are left out.
  *
  * The marshalled data is not robust to differences between the child
  * and parent process (personality, etc).
@@ -57,6 +111,20 @@ extern int minijail_unmarshal(struct minijail *j,
                               char *serialized,
                               size_t length);
 
+/* minijail_unmarshal_inplace: initializes @j from @serialized without copying
+ * @j          minijail to initialize
+ * @serialized serialized jail buffer, from malloc(3)
+ * @length     length of buffer
+ *
+ * Returns 0 on success.
+ *
+ * Like minijail_unmarshal(), but @j takes over @serialized, even on failure,
+ * and points its strings and seccomp filter into it instead of copying them.
+ */
+extern int minijail_unmarshal_inplace(struct minijail *j,
+                                      char *serialized,
+                                      size_t length);
+
 /* minijail_from_fd: builds @j from @fd
  * @j  minijail to initialize
  * @fd fd to initialize from
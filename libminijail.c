@@ -9,7 +9,9 @@
 
 #include <asm/unistd.h>
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <grp.h>
 #include <inttypes.h>
 #include <limits.h>
@@ -24,13 +26,19 @@
 #include <string.h>
 #include <syscall.h>
 #include <sys/capability.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
 #include <sys/mount.h>
 #include <sys/param.h>
 #include <sys/prctl.h>
 #include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/user.h>
+#include <sys/vfs.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
@@ -54,6 +62,11 @@
 # define PR_SET_SECCOMP 22
 #endif
 
+#ifndef PR_CAP_AMBIENT
+# define PR_CAP_AMBIENT 47
+# define PR_CAP_AMBIENT_RAISE 2
+#endif
+
 /* For seccomp_filter using BPF. */
 #ifndef PR_SET_NO_NEW_PRIVS
 # define PR_SET_NO_NEW_PRIVS 38
@@ -62,6 +75,43 @@
 # define SECCOMP_MODE_FILTER 2 /* uses user-supplied filter. */
 #endif
 
+#ifndef __NR_pidfd_open
+# define __NR_pidfd_open 434
+#endif
+
+#ifndef __NR_close_range
+# define __NR_close_range 436
+#endif
+#ifndef CLOSE_RANGE_CLOEXEC
+# define CLOSE_RANGE_CLOEXEC (1U << 2)
+#endif
+
+/* For mount templates using the new mount API. */
+#ifndef __NR_open_tree
+# define __NR_open_tree 428
+#endif
+#ifndef __NR_move_mount
+# define __NR_move_mount 429
+#endif
+#ifndef __NR_mount_setattr
+# define __NR_mount_setattr 442
+#endif
+#ifndef OPEN_TREE_CLONE
+# define OPEN_TREE_CLONE 1
+#endif
+#ifndef OPEN_TREE_CLOEXEC
+# define OPEN_TREE_CLOEXEC O_CLOEXEC
+#endif
+#ifndef MOVE_MOUNT_F_EMPTY_PATH
+# define MOVE_MOUNT_F_EMPTY_PATH 0x00000004
+#endif
+#ifndef AT_RECURSIVE
+# define AT_RECURSIVE 0x8000
+#endif
+#ifndef MOUNT_ATTR_RDONLY
+# define MOUNT_ATTR_RDONLY 0x00000001
+#endif
+
 struct binding {
 	char *src;
 	char *dest;
@@ -69,10 +119,39 @@ struct binding {
 	struct binding *next;
 };
 
+/*
+ * Where minijail_get_path() looks paths up: every binding, plus the root of
+ * the jail, sorted by decreasing length of |dest| so that the first match is
+ * the longest.
+ */
+struct path_prefix {
+	const char *dest;
+	size_t dest_len;
+	const char *src;
+	size_t src_len;
+	size_t order;
+};
+
+/* Recently resolved paths, by absolute path inside the jail. */
+#define PATH_CACHE_SIZE 16
+
+struct path_cache_entry {
+	char *path;
+	char *resolved;
+};
+
+/* Fds given to the child of each run, see minijail_preserve_fd(). */
+#define MAX_PRESERVED_FDS 32
+
+struct preserved_fd {
+	int parent_fd;
+	int child_fd;
+};
+
 struct minijail {
 	/*
 	 * WARNING: if you add a flag here you need to make sure it's
-	 * accounted for in minijail_pre{enter|exec}() below.
+	 * accounted for in minijail_pre{enter|exec}() and MARSHAL_FLAGS below.
 	 */
 	struct {
 		int uid:1;
@@ -90,7 +169,12 @@ struct minijail {
 		int log_seccomp_filter:1;
 		int chroot:1;
 		int mount_tmp:1;
+		int mount_template:1;
+		int scratch:1;
 		int chdir:1;
+		int no_preload:1;
+		int ambient_caps:1;
+		int close_open_fds:1;
 		/* The following are only used for omegaUp */
 		int stack_limit:1;
 		int time_limit:1;
@@ -104,6 +188,8 @@ struct minijail {
 	char *user;
 	uint64_t caps;
 	pid_t initpid;
+	int pidfd;
+	int stdin_fd;
 	int filter_len;
 	int binding_count;
 	char *chrootdir;
@@ -111,6 +197,20 @@ struct minijail {
 	struct sock_fprog *filter_prog;
 	struct binding *bindings_head;
 	struct binding *bindings_tail;
+	int mount_template_fd;
+	/* How many of the bindings are already in the mount template. */
+	int template_binding_count;
+	size_t tmp_size;
+	char *scratch_dir;
+	size_t scratch_size;
+	int proc_options;
+	struct preserved_fd preserved_fds[MAX_PRESERVED_FDS];
+	size_t preserved_fd_count;
+	/* Built by minijail_get_path() as needed. */
+	struct path_prefix *path_table;
+	size_t path_table_len;
+	struct path_cache_entry *path_cache;
+	size_t path_cache_next;
 
 	/* The following fields are only used for omegaUp */
 	int stack_limit;
@@ -119,8 +219,61 @@ struct minijail {
 	int memory_limit;
 	int output_limit;
 	FILE *meta_file;
+
+	/* Per-run state of init() inside the pid namespace. */
+	pid_t rootpid;
+	int init_exitstatus;
+	int signal_override;
+	/*
+	 * The /tmp and scratch filesystems mounted for this run, kept so that
+	 * init() can report how much of them the jail used.
+	 */
+	int tmp_fd;
+	int scratch_fd;
+
+	/*
+	 * A jail made by minijail_dup() borrows the bindings, strings, filter
+	 * and mount template of |tmpl| until it changes them, and keeps it
+	 * alive until then. |dups| counts the jails borrowing from this one,
+	 * which can't be reconfigured meanwhile.
+	 */
+	struct minijail *tmpl;
+	int dups;
+	int destroyed;
+
+	/*
+	 * The buffer minijail_unmarshal_inplace() decoded this jail from,
+	 * which its strings, bindings and filter may point into.
+	 */
+	char *wire;
+	size_t wire_len;
 };
 
+/* Whether |j| still shares |field| with the jail it was duplicated from. */
+#define BORROWED(j, field) ((j)->tmpl && (j)->field == (j)->tmpl->field)
+
+/* Whether |p| points into the buffer |j| was decoded from in place. */
+#define IN_WIRE(j, p) \
+	((j)->wire && (const char *)(p) >= (j)->wire && \
+	 (const char *)(p) < (j)->wire + (j)->wire_len)
+
+/* Whether |j| has to free |field| itself. */
+#define OWNED(j, field) \
+	((j)->field && !BORROWED(j, field) && !IN_WIRE(j, (j)->field))
+
+/*
+ * Bits of MARSHAL_TAG_FLAGS. Bits are never reused; the mount template is left
+ * out since its fd only means something in the parent, and so is the fd map.
+ */
+#define MARSHAL_FLAGS(X) \
+	X(uid, 0) X(gid, 1) X(caps, 2) X(vfs, 3) X(pids, 4) X(net, 5) \
+	X(seccomp, 6) X(readonly, 7) X(usergroups, 8) X(ptrace, 9) \
+	X(no_new_privs, 10) X(seccomp_filter, 11) X(log_seccomp_filter, 12) \
+	X(chroot, 13) X(mount_tmp, 14) X(scratch, 15) X(chdir, 16) \
+	X(no_preload, 17) X(ambient_caps, 18) X(stack_limit, 19) \
+	X(time_limit, 20) X(output_limit, 21) X(memory_limit, 22) \
+	X(meta_file, 23) X(close_open_fds, 24)
+
 /*
  * Strip out flags meant for the parent.
  * We keep things that are not inherited across execve(2) (e.g. capabilities),
@@ -132,6 +285,8 @@ void minijail_preenter(struct minijail *j)
 	j->flags.readonly = 0;
 	j->flags.pids = 0;
 	j->flags.chroot = 0;
+	j->flags.mount_tmp = 0;
+	j->flags.scratch = 0;
 }
 
 /*
@@ -142,18 +297,24 @@ void minijail_preexec(struct minijail *j)
 {
 	int vfs = j->flags.vfs;
 	int readonly = j->flags.readonly;
+	int mount_template = j->flags.mount_template;
+	int mount_tmp = j->flags.mount_tmp;
+	int scratch = j->flags.scratch;
 	int stack_limit = j->flags.stack_limit;
 	int time_limit = j->flags.time_limit;
 	int memory_limit = j->flags.memory_limit;
 	int output_limit = j->flags.output_limit;
 	int meta_file = j->flags.meta_file;
-	if (j->user)
+	if (OWNED(j, user))
 		free(j->user);
 	j->user = NULL;
 	memset(&j->flags, 0, sizeof(j->flags));
 	/* Now restore anything we meant to keep. */
 	j->flags.vfs = vfs;
 	j->flags.readonly = readonly;
+	j->flags.mount_template = mount_template;
+	j->flags.mount_tmp = mount_tmp;
+	j->flags.scratch = scratch;
 	/* Note, |pids| will already have been used before this call. */
 	j->flags.stack_limit = stack_limit;
 	j->flags.time_limit = time_limit;
@@ -162,11 +323,114 @@ void minijail_preexec(struct minijail *j)
 	j->flags.meta_file = meta_file;
 }
 
+/* Drops what minijail_get_path() built, when it might no longer apply. */
+static void reset_path_lookup(struct minijail *j)
+{
+	size_t i;
+
+	if (!BORROWED(j, path_table))
+		free(j->path_table);
+	j->path_table = NULL;
+	j->path_table_len = 0;
+	if (!j->path_cache)
+		return;
+	for (i = 0; i < PATH_CACHE_SIZE; i++) {
+		free(j->path_cache[i].path);
+		free(j->path_cache[i].resolved);
+	}
+	free(j->path_cache);
+	j->path_cache = NULL;
+	j->path_cache_next = 0;
+}
+
+/* Keeps the parts duplicates borrow from |j| from changing under them. */
+static void check_no_dups(const struct minijail *j)
+{
+	if (j->dups)
+		die("tried to reconfigure a jail that has duplicates");
+}
+
+/* Gives |j| bindings of its own, before it changes them. */
+static int own_bindings(struct minijail *j)
+{
+	struct binding *b, *copy, *head = NULL, *tail = NULL;
+
+	if (!j->bindings_head || !BORROWED(j, bindings_head))
+		return 0;
+	for (b = j->bindings_head; b; b = b->next) {
+		copy = calloc(1, sizeof(*copy));
+		if (!copy)
+			goto error;
+		if (tail)
+			tail->next = copy;
+		else
+			head = copy;
+		tail = copy;
+		copy->src = strdup(b->src);
+		copy->dest = strdup(b->dest);
+		copy->writeable = b->writeable;
+		if (!copy->src || !copy->dest)
+			goto error;
+	}
+	j->bindings_head = head;
+	j->bindings_tail = tail;
+	return 0;
+
+error:
+	while (head) {
+		b = head;
+		head = head->next;
+		free(b->src);
+		free(b->dest);
+		free(b);
+	}
+	return -ENOMEM;
+}
+
+/* Frees what |j| owns of its configuration, but not |j| itself. */
+static void free_config(struct minijail *j)
+{
+	if (j->flags.mount_template && !BORROWED(j, mount_template_fd))
+		close(j->mount_template_fd);
+	if (j->filter_prog && !BORROWED(j, filter_prog)) {
+		if (!IN_WIRE(j, j->filter_prog->filter))
+			free(j->filter_prog->filter);
+		free(j->filter_prog);
+	}
+	while (j->bindings_head && !BORROWED(j, bindings_head)) {
+		struct binding *b = j->bindings_head;
+		j->bindings_head = j->bindings_head->next;
+		if (!IN_WIRE(j, b->dest))
+			free(b->dest);
+		if (!IN_WIRE(j, b->src))
+			free(b->src);
+		free(b);
+	}
+	j->bindings_tail = NULL;
+	if (OWNED(j, user))
+		free(j->user);
+	if (OWNED(j, chrootdir))
+		free(j->chrootdir);
+	if (OWNED(j, chdir))
+		free(j->chdir);
+	if (OWNED(j, scratch_dir))
+		free(j->scratch_dir);
+	reset_path_lookup(j);
+	free(j->wire);
+}
+
 /* Minijail API. */
 
 struct minijail API *minijail_new(void)
 {
-	return calloc(1, sizeof(struct minijail));
+	struct minijail *j = calloc(1, sizeof(struct minijail));
+	if (j) {
+		j->pidfd = -1;
+		j->stdin_fd = -1;
+		j->tmp_fd = -1;
+		j->scratch_fd = -1;
+	}
+	return j;
 }
 
 void API minijail_change_uid(struct minijail *j, uid_t uid)
@@ -194,6 +458,7 @@ int API minijail_change_user(struct minijail *j, const char *user)
 	if (sz == -1)
 		sz = 65536;	/* your guess is as good as mine... */
 
+	check_no_dups(j);
 	/*
 	 * sysconf(_SC_GETPW_R_SIZE_MAX), under glibc, is documented to return
 	 * the maximum needed size of the buffer, so we don't have to search.
@@ -259,6 +524,11 @@ void API minijail_no_new_privs(struct minijail *j)
 	j->flags.no_new_privs = 1;
 }
 
+void API minijail_no_preload(struct minijail *j)
+{
+	j->flags.no_preload = 1;
+}
+
 void API minijail_use_seccomp_filter(struct minijail *j)
 {
 	j->flags.seccomp_filter = 1;
@@ -298,6 +568,11 @@ void API minijail_remount_readonly(struct minijail *j)
 	j->flags.readonly = 1;
 }
 
+void API minijail_proc_options(struct minijail *j, int options)
+{
+	j->proc_options = options;
+}
+
 void API minijail_inherit_usergroups(struct minijail *j)
 {
 	j->flags.usergroups = 1;
@@ -310,21 +585,47 @@ void API minijail_disable_ptrace(struct minijail *j)
 
 int API minijail_enter_chroot(struct minijail *j, const char *dir)
 {
+	check_no_dups(j);
 	if (j->chrootdir)
 		return -EINVAL;
 	j->chrootdir = strdup(dir);
 	if (!j->chrootdir)
 		return -ENOMEM;
 	j->flags.chroot = 1;
+	reset_path_lookup(j);
 	return 0;
 }
 
 void API minijail_mount_tmp(struct minijail *j)
 {
+	minijail_mount_tmp_size(j, 0);
+}
+
+void API minijail_mount_tmp_size(struct minijail *j, size_t size)
+{
+	j->tmp_size = size;
+	j->flags.vfs = 1;
 	j->flags.mount_tmp = 1;
 }
 
+int API minijail_scratch(struct minijail *j, const char *dir, size_t size)
+{
+	check_no_dups(j);
+	if (j->scratch_dir)
+		return -EINVAL;
+	if (!dir || dir[0] != '/' || size == 0)
+		return -EINVAL;
+	j->scratch_dir = strdup(dir);
+	if (!j->scratch_dir)
+		return -ENOMEM;
+	j->scratch_size = size;
+	j->flags.vfs = 1;
+	j->flags.scratch = 1;
+	return 0;
+}
+
 int API minijail_chroot_chdir(struct minijail *j, const char *dir) {
+	check_no_dups(j);
 	if (!j->chrootdir)
 		return -EINVAL;
 	if (j->chdir)
@@ -335,16 +636,99 @@ int API minijail_chroot_chdir(struct minijail *j, const char *dir) {
 	if (!j->chdir)
 		return -ENOMEM;
 	j->flags.chdir = 1;
+	reset_path_lookup(j);
+	return 0;
+}
+
+int API minijail_preserve_fd(struct minijail *j, int parent_fd, int child_fd)
+{
+	size_t i;
+
+	if (parent_fd < 0 || child_fd < 0)
+		return -EINVAL;
+	for (i = 0; i < j->preserved_fd_count; i++) {
+		if (j->preserved_fds[i].child_fd == child_fd)
+			return -EINVAL;
+	}
+	if (j->preserved_fd_count == MAX_PRESERVED_FDS)
+		return -ENOMEM;
+	j->preserved_fds[i].parent_fd = parent_fd;
+	j->preserved_fds[i].child_fd = child_fd;
+	j->preserved_fd_count++;
+	j->flags.close_open_fds = 1;
+	return 0;
+}
+
+void API minijail_close_open_fds(struct minijail *j)
+{
+	j->flags.close_open_fds = 1;
+}
+
+int API minijail_stdin_fd(struct minijail *j, int fd)
+{
+	struct stat st;
+
+	if (fstat(fd, &st))
+		return -errno;
+	/* Pipes and sockets can't be reopened with an offset of their own. */
+	if (!S_ISREG(st.st_mode))
+		return -EINVAL;
+	j->stdin_fd = fd;
 	return 0;
 }
 
+int API minijail_prefetch_input(int fd)
+{
+	/* posix_fadvise(2) returns the error instead of setting errno. */
+	return -posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+}
+
+int API minijail_input_memfd(int fd)
+{
+	struct stat st;
+	off_t offset = 0;
+	ssize_t copied;
+	int memfd;
+	const int seals = F_SEAL_SEAL | F_SEAL_SHRINK | F_SEAL_GROW |
+			  F_SEAL_WRITE;
+
+	if (fstat(fd, &st))
+		return -errno;
+	if (!S_ISREG(st.st_mode))
+		return -EINVAL;
+	memfd = memfd_create("minijail-input", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (memfd < 0)
+		return -errno;
+	/* sendfile(2) copies within the kernel, without a userspace buffer. */
+	while (offset < st.st_size) {
+		copied = sendfile(memfd, fd, &offset, st.st_size - offset);
+		if (copied < 0 && errno == EINTR)
+			continue;
+		if (copied == 0)
+			errno = EIO;	/* The file shrank under us. */
+		if (copied <= 0)
+			goto error;
+	}
+	if (fcntl(memfd, F_ADD_SEALS, seals))
+		goto error;
+	return memfd;
+
+error:
+	copied = -errno;
+	close(memfd);
+	return copied;
+}
+
 int API minijail_bind(struct minijail *j, const char *src, const char *dest,
 		      int writeable)
 {
 	struct binding *b;
 
+	check_no_dups(j);
 	if (*dest != '/')
 		return -EINVAL;
+	if (own_bindings(j))
+		return -ENOMEM;
 	b = calloc(1, sizeof(*b));
 	if (!b)
 		return -ENOMEM;
@@ -370,6 +754,7 @@ int API minijail_bind(struct minijail *j, const char *src, const char *dest,
 		j->bindings_head = b;
 	j->bindings_tail = b;
 	j->binding_count++;
+	reset_path_lookup(j);
 
 	return 0;
 
@@ -380,9 +765,104 @@ error:
 	return -ENOMEM;
 }
 
+/* The mount API has no glibc wrappers on older systems. */
+static int sys_open_tree(int dfd, const char *path, unsigned int flags)
+{
+	return syscall(__NR_open_tree, dfd, path, flags);
+}
+
+static int sys_move_mount(int from_dfd, const char *from_path,
+			  int to_dfd, const char *to_path, unsigned int flags)
+{
+	return syscall(__NR_move_mount, from_dfd, from_path, to_dfd, to_path,
+		       flags);
+}
+
+/* Like MS_BIND | MS_REMOUNT | MS_RDONLY, this leaves submounts alone. */
+static int set_mount_readonly(int fd)
+{
+	struct {
+		uint64_t attr_set;
+		uint64_t attr_clr;
+		uint64_t propagation;
+		uint64_t userns_fd;
+	} attr = { .attr_set = MOUNT_ATTR_RDONLY };
+
+	return syscall(__NR_mount_setattr, fd, "", AT_EMPTY_PATH, &attr,
+		       sizeof(attr));
+}
+
+/* Returns a fresh detached copy of the mount tree behind |fd|. */
+static int clone_tree(int fd)
+{
+	return sys_open_tree(fd, "", OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC |
+			     AT_RECURSIVE | AT_EMPTY_PATH);
+}
+
+int API minijail_build_mount_template(struct minijail *j)
+{
+	struct binding *b;
+	int tree_fd, fd;
+	int ret;
+
+	check_no_dups(j);
+	if (!j->flags.chroot || j->flags.mount_template)
+		return -EINVAL;
+
+	tree_fd = sys_open_tree(AT_FDCWD, j->chrootdir, OPEN_TREE_CLONE |
+				OPEN_TREE_CLOEXEC | AT_RECURSIVE);
+	if (tree_fd < 0)
+		return -errno;
+
+	/*
+	 * Bindings are not recursive, as with the plain MS_BIND of bind_one(),
+	 * so that mounts under a source stay out of the jail either way.
+	 */
+	for (b = j->bindings_head; b; b = b->next) {
+		fd = sys_open_tree(AT_FDCWD, b->src, OPEN_TREE_CLONE |
+				   OPEN_TREE_CLOEXEC);
+		if (fd < 0)
+			goto error;
+		/* dest has a leading "/" */
+		if ((!b->writeable && set_mount_readonly(fd)) ||
+		    sys_move_mount(fd, "", tree_fd,
+				   b->dest[1] ? b->dest + 1 : ".",
+				   MOVE_MOUNT_F_EMPTY_PATH)) {
+			ret = -errno;
+			close(fd);
+			close(tree_fd);
+			return ret;
+		}
+		close(fd);
+	}
+
+	/*
+	 * Kernels before 6.15 can neither attach mounts to nor clone a
+	 * detached tree, so check now rather than failing in every run.
+	 */
+	fd = clone_tree(tree_fd);
+	if (fd < 0)
+		goto error;
+	close(fd);
+
+	j->mount_template_fd = tree_fd;
+	j->template_binding_count = j->binding_count;
+	j->flags.mount_template = 1;
+	minijail_namespace_vfs(j);
+	return 0;
+
+error:
+	ret = -errno;
+	close(tree_fd);
+	return ret;
+}
+
 void API minijail_parse_seccomp_filters(struct minijail *j, const char *path)
 {
-	FILE *file = fopen(path, "r");
+	FILE *file;
+
+	check_no_dups(j);
+	file = fopen(path, "r");
 	if (!file) {
 		pdie("failed to open seccomp filter file '%s'", path);
 	}
@@ -414,7 +894,7 @@ void marshal_state_init(struct marshal_state *state,
 }
 
 void marshal_append(struct marshal_state *state,
-		    char *src, size_t length)
+		    const char *src, size_t length)
 {
 	size_t copy_len = MIN(state->available, length);
 
@@ -428,28 +908,107 @@ void marshal_append(struct marshal_state *state,
 	state->total += length;
 }
 
+static const char marshal_padding[MARSHAL_ALIGN];
+
+/* Bytes of padding after a record value of |length| bytes. */
+static size_t marshal_pad(size_t length)
+{
+	return (MARSHAL_ALIGN - length % MARSHAL_ALIGN) % MARSHAL_ALIGN;
+}
+
+static void marshal_record(struct marshal_state *state, uint16_t tag,
+			   const void *value, size_t length)
+{
+	struct marshal_record rec = { .tag = tag, .length = length };
+
+	marshal_append(state, (const char *)&rec, sizeof(rec));
+	marshal_append(state, value, length);
+	marshal_append(state, marshal_padding, marshal_pad(length));
+}
+
+static void marshal_u32(struct marshal_state *state, uint16_t tag,
+			uint32_t value)
+{
+	if (value)
+		marshal_record(state, tag, &value, sizeof(value));
+}
+
+static void marshal_u64(struct marshal_state *state, uint16_t tag,
+			uint64_t value)
+{
+	if (value)
+		marshal_record(state, tag, &value, sizeof(value));
+}
+
+static void marshal_str(struct marshal_state *state, uint16_t tag,
+			const char *str)
+{
+	if (str)
+		marshal_record(state, tag, str, strlen(str) + 1);
+}
+
+static void marshal_binding(struct marshal_state *state,
+			    const struct binding *b)
+{
+	uint32_t writeable = b->writeable;
+	size_t src_len = strlen(b->src) + 1;
+	size_t dest_len = strlen(b->dest) + 1;
+	size_t length = sizeof(writeable) + src_len + dest_len;
+	struct marshal_record rec = {
+		.tag = MARSHAL_TAG_BINDING,
+		.length = length,
+	};
+
+	marshal_append(state, (const char *)&rec, sizeof(rec));
+	marshal_append(state, (const char *)&writeable, sizeof(writeable));
+	marshal_append(state, b->src, src_len);
+	marshal_append(state, b->dest, dest_len);
+	marshal_append(state, marshal_padding, marshal_pad(length));
+}
+
 void minijail_marshal_helper(struct marshal_state *state,
 			     const struct minijail *j)
 {
+	struct marshal_header hdr = {
+		.magic = MARSHAL_MAGIC,
+		.version = MARSHAL_VERSION,
+	};
 	struct binding *b = NULL;
-	marshal_append(state, (char *)j, sizeof(*j));
-	if (j->user)
-		marshal_append(state, j->user, strlen(j->user) + 1);
-	if (j->chrootdir)
-		marshal_append(state, j->chrootdir, strlen(j->chrootdir) + 1);
-	if (j->chdir)
-		marshal_append(state, j->chdir, strlen(j->chdir) + 1);
-	if (j->flags.seccomp_filter && j->filter_prog) {
+	uint64_t flags = 0;
+
+#define X(name, bit) \
+	if (j->flags.name) \
+		flags |= UINT64_C(1) << (bit);
+	MARSHAL_FLAGS(X)
+#undef X
+
+	/* minijail_marshal() fills in the length once it is known. */
+	marshal_append(state, (const char *)&hdr, sizeof(hdr));
+	marshal_u64(state, MARSHAL_TAG_FLAGS, flags);
+	marshal_u32(state, MARSHAL_TAG_UID, j->uid);
+	marshal_u32(state, MARSHAL_TAG_GID, j->gid);
+	marshal_u32(state, MARSHAL_TAG_USERGID, j->usergid);
+	marshal_str(state, MARSHAL_TAG_USER, j->user);
+	marshal_u64(state, MARSHAL_TAG_CAPS, j->caps);
+	marshal_str(state, MARSHAL_TAG_CHROOTDIR, j->chrootdir);
+	marshal_str(state, MARSHAL_TAG_CHDIR, j->chdir);
+	if (j->flags.seccomp_filter && j->filter_prog &&
+	    j->filter_prog->len) {
 		struct sock_fprog *fp = j->filter_prog;
-		marshal_append(state, (char *)fp->filter,
-				fp->len * sizeof(struct sock_filter));
-	}
-	for (b = j->bindings_head; b; b = b->next) {
-		marshal_append(state, b->src, strlen(b->src) + 1);
-		marshal_append(state, b->dest, strlen(b->dest) + 1);
-		marshal_append(state, (char *)&b->writeable,
-				sizeof(b->writeable));
-	}
+		marshal_record(state, MARSHAL_TAG_FILTER, fp->filter,
+			       fp->len * sizeof(struct sock_filter));
+	}
+	for (b = j->bindings_head; b; b = b->next)
+		marshal_binding(state, b);
+	marshal_u64(state, MARSHAL_TAG_TMP_SIZE, j->tmp_size);
+	marshal_str(state, MARSHAL_TAG_SCRATCH_DIR, j->scratch_dir);
+	marshal_u64(state, MARSHAL_TAG_SCRATCH_SIZE, j->scratch_size);
+	marshal_u32(state, MARSHAL_TAG_PROC_OPTIONS, j->proc_options);
+	marshal_u32(state, MARSHAL_TAG_STACK_LIMIT, j->stack_limit);
+	marshal_u32(state, MARSHAL_TAG_TIME_LIMIT, j->time_limit);
+	marshal_u32(state, MARSHAL_TAG_EXTRA_WALL_TIME, j->extra_wall_time);
+	marshal_u32(state, MARSHAL_TAG_MEMORY_LIMIT, j->memory_limit);
+	marshal_u32(state, MARSHAL_TAG_OUTPUT_LIMIT, j->output_limit);
 }
 
 size_t API minijail_size(const struct minijail *j)
@@ -463,9 +1022,16 @@ size_t API minijail_size(const struct minijail *j)
 int minijail_marshal(const struct minijail *j, char *buf, size_t available)
 {
 	struct marshal_state state;
+	uint64_t length;
+
 	marshal_state_init(&state, buf, available);
 	minijail_marshal_helper(&state, j);
-	return (state.total > available);
+	if (state.total > available)
+		return 1;
+	length = state.total;
+	memcpy(buf + offsetof(struct marshal_header, length), &length,
+	       sizeof(length));
+	return 0;
 }
 
 /* consumebytes: consumes @length bytes from a buffer @buf of length @buflength
@@ -500,147 +1066,302 @@ char *consumestr(char **buf, size_t *buflength)
 	return consumebytes(len + 1, buf, buflength);
 }
 
-int minijail_unmarshal(struct minijail *j, char *serialized, size_t length)
+static int unmarshal_u32(const char *value, size_t length, uint32_t *out)
 {
-	int i;
-	int count;
-	int ret = -EINVAL;
-
-	if (length < sizeof(*j))
-		goto out;
-	memcpy((void *)j, serialized, sizeof(*j));
-	serialized += sizeof(*j);
-	length -= sizeof(*j);
-
-	/* Potentially stale pointers not used as signals. */
-	j->bindings_head = NULL;
-	j->bindings_tail = NULL;
-	j->filter_prog = NULL;
-
-	if (j->user) {		/* stale pointer */
-		char *user = consumestr(&serialized, &length);
-		if (!user)
-			goto clear_pointers;
-		j->user = strdup(user);
-		if (!j->user)
-			goto clear_pointers;
-	}
-
-	if (j->chrootdir) {	/* stale pointer */
-		char *chrootdir = consumestr(&serialized, &length);
-		if (!chrootdir)
-			goto bad_chrootdir;
-		j->chrootdir = strdup(chrootdir);
-		if (!j->chrootdir)
-			goto bad_chrootdir;
-	}
-
-	if (j->chdir) {	/* stale pointer */
-		char *chdirstr = consumestr(&serialized, &length);
-		if (!chdirstr)
-			goto bad_chdir;
-		j->chdir = strdup(chdirstr);
-		if (!j->chdir)
-			goto bad_chdir;
-	}
-
-	if (j->flags.seccomp_filter && j->filter_len > 0) {
-		size_t ninstrs = j->filter_len;
-		if (ninstrs > (SIZE_MAX / sizeof(struct sock_filter)) ||
-		    ninstrs > USHRT_MAX)
-			goto bad_filters;
-
-		size_t program_len = ninstrs * sizeof(struct sock_filter);
-		void *program = consumebytes(program_len, &serialized, &length);
-		if (!program)
-			goto bad_filters;
-
-		j->filter_prog = malloc(sizeof(struct sock_fprog));
-		j->filter_prog->len = ninstrs;
-		j->filter_prog->filter = malloc(program_len);
-		memcpy(j->filter_prog->filter, program, program_len);
-	}
-
-	if (j->meta_file) {
-		j->meta_file = NULL;
-	}
-
-	count = j->binding_count;
-	j->binding_count = 0;
-	for (i = 0; i < count; ++i) {
-		int *writeable;
-		const char *dest;
-		const char *src = consumestr(&serialized, &length);
-		if (!src)
-			goto bad_bindings;
-		dest = consumestr(&serialized, &length);
-		if (!dest)
-			goto bad_bindings;
-		writeable = consumebytes(sizeof(*writeable), &serialized, &length);
-		if (!writeable)
-			goto bad_bindings;
-		if (minijail_bind(j, src, dest, *writeable))
-			goto bad_bindings;
-	}
+	if (length != sizeof(*out))
+		return -EINVAL;
+	memcpy(out, value, sizeof(*out));
+	return 0;
+}
 
+static int unmarshal_u64(const char *value, size_t length, uint64_t *out)
+{
+	if (length != sizeof(*out))
+		return -EINVAL;
+	memcpy(out, value, sizeof(*out));
 	return 0;
+}
 
-bad_bindings:
-	if (j->flags.seccomp_filter && j->filter_len > 0) {
-		free(j->filter_prog->filter);
-		free(j->filter_prog);
-	}
-bad_filters:
-	if (j->chrootdir)
-		free(j->chrootdir);
-bad_chdir:
-	if (j->chdir)
-		free(j->chdir);
-bad_chrootdir:
-	if (j->user)
-		free(j->user);
-clear_pointers:
-	j->user = NULL;
-	j->chrootdir = NULL;
-	j->chdir = NULL;
-out:
-	return ret;
+/* Sets |*field| from a string record, which may only appear once. */
+static int unmarshal_str(struct minijail *j, char **field,
+			 char *value, size_t length)
+{
+	if (*field || !length || strnlen(value, length) != length - 1)
+		return -EINVAL;
+	*field = j->wire ? value : strdup(value);
+	return *field ? 0 : -ENOMEM;
 }
 
-/* bind_one: Applies bindings from @b for @j, recursing as needed.
- * @j Minijail these bindings are for
- * @b Head of list of bindings
- *
- * Returns 0 for success.
- */
-int bind_one(const struct minijail *j, struct binding *b)
+static int unmarshal_filter(struct minijail *j, char *value, size_t length)
 {
-	int ret = 0;
-	char *dest = NULL;
-	if (ret)
-		return ret;
-	/* dest has a leading "/" */
-	if (asprintf(&dest, "%s%s", j->chrootdir, b->dest) < 0)
+	size_t ninstrs = length / sizeof(struct sock_filter);
+
+	if (j->filter_prog || !ninstrs || ninstrs > USHRT_MAX ||
+	    length % sizeof(struct sock_filter))
+		return -EINVAL;
+	j->filter_prog = calloc(1, sizeof(*j->filter_prog));
+	if (!j->filter_prog)
 		return -ENOMEM;
-	ret = mount(b->src, dest, NULL, MS_BIND, NULL);
-	if (ret)
-		pdie("bind: %s -> %s", b->src, dest);
-	if (!b->writeable) {
-		ret = mount(b->src, dest, NULL,
-			    MS_BIND | MS_REMOUNT | MS_RDONLY, NULL);
-		if (ret)
-			pdie("bind ro: %s -> %s", b->src, dest);
+	/* Records are aligned for this, as long as the buffer itself is. */
+	if (j->wire &&
+	    (uintptr_t)value % __alignof__(struct sock_filter) == 0) {
+		j->filter_prog->filter = (struct sock_filter *)value;
+	} else {
+		j->filter_prog->filter = malloc(length);
+		if (!j->filter_prog->filter)
+			return -ENOMEM;
+		memcpy(j->filter_prog->filter, value, length);
 	}
-	free(dest);
-	if (b->next)
-		return bind_one(j, b->next);
-	return ret;
+	j->filter_prog->len = ninstrs;
+	j->filter_len = ninstrs;
+	return 0;
 }
 
-int enter_chroot(const struct minijail *j)
+static int unmarshal_binding(struct minijail *j, char *value, size_t length)
 {
+	uint32_t writeable;
+	struct binding *b;
+	char *src, *dest;
+	char *p = consumebytes(sizeof(writeable), &value, &length);
+
+	if (!p)
+		return -EINVAL;
+	memcpy(&writeable, p, sizeof(writeable));
+	src = consumestr(&value, &length);
+	dest = src ? consumestr(&value, &length) : NULL;
+	if (!dest || length || *dest != '/')
+		return -EINVAL;
+
+	b = calloc(1, sizeof(*b));
+	if (!b)
+		return -ENOMEM;
+	if (j->bindings_tail)
+		j->bindings_tail->next = b;
+	else
+		j->bindings_head = b;
+	j->bindings_tail = b;
+	j->binding_count++;
+	b->src = j->wire ? src : strdup(src);
+	b->dest = j->wire ? dest : strdup(dest);
+	b->writeable = writeable;
+	return (b->src && b->dest) ? 0 : -ENOMEM;
+}
+
+static int unmarshal_record(struct minijail *j, uint16_t tag,
+			    char *value, size_t length)
+{
+	uint64_t u64 = 0, known = 0;
+	uint32_t u32 = 0;
+	int ret;
+
+	switch (tag) {
+	case MARSHAL_TAG_FLAGS:
+		ret = unmarshal_u64(value, length, &u64);
+#define X(name, bit) \
+		known |= UINT64_C(1) << (bit); \
+		j->flags.name = !!(u64 & (UINT64_C(1) << (bit)));
+		MARSHAL_FLAGS(X)
+#undef X
+		/* Restrictions this library doesn't know how to apply. */
+		if (u64 & ~known)
+			ret = -EINVAL;
+		break;
+	case MARSHAL_TAG_UID:
+		ret = unmarshal_u32(value, length, &u32);
+		j->uid = u32;
+		break;
+	case MARSHAL_TAG_GID:
+		ret = unmarshal_u32(value, length, &u32);
+		j->gid = u32;
+		break;
+	case MARSHAL_TAG_USERGID:
+		ret = unmarshal_u32(value, length, &u32);
+		j->usergid = u32;
+		break;
+	case MARSHAL_TAG_USER:
+		ret = unmarshal_str(j, &j->user, value, length);
+		break;
+	case MARSHAL_TAG_CAPS:
+		ret = unmarshal_u64(value, length, &j->caps);
+		break;
+	case MARSHAL_TAG_CHROOTDIR:
+		ret = unmarshal_str(j, &j->chrootdir, value, length);
+		break;
+	case MARSHAL_TAG_CHDIR:
+		ret = unmarshal_str(j, &j->chdir, value, length);
+		break;
+	case MARSHAL_TAG_FILTER:
+		ret = unmarshal_filter(j, value, length);
+		break;
+	case MARSHAL_TAG_BINDING:
+		ret = unmarshal_binding(j, value, length);
+		break;
+	case MARSHAL_TAG_TMP_SIZE:
+		ret = unmarshal_u64(value, length, &u64);
+		j->tmp_size = u64;
+		break;
+	case MARSHAL_TAG_SCRATCH_DIR:
+		ret = unmarshal_str(j, &j->scratch_dir, value, length);
+		break;
+	case MARSHAL_TAG_SCRATCH_SIZE:
+		ret = unmarshal_u64(value, length, &u64);
+		j->scratch_size = u64;
+		break;
+	case MARSHAL_TAG_PROC_OPTIONS:
+		ret = unmarshal_u32(value, length, &u32);
+		j->proc_options = u32;
+		break;
+	case MARSHAL_TAG_STACK_LIMIT:
+		ret = unmarshal_u32(value, length, &u32);
+		j->stack_limit = u32;
+		break;
+	case MARSHAL_TAG_TIME_LIMIT:
+		ret = unmarshal_u32(value, length, &u32);
+		j->time_limit = u32;
+		break;
+	case MARSHAL_TAG_EXTRA_WALL_TIME:
+		ret = unmarshal_u32(value, length, &u32);
+		j->extra_wall_time = u32;
+		break;
+	case MARSHAL_TAG_MEMORY_LIMIT:
+		ret = unmarshal_u32(value, length, &u32);
+		j->memory_limit = u32;
+		break;
+	case MARSHAL_TAG_OUTPUT_LIMIT:
+		ret = unmarshal_u32(value, length, &u32);
+		j->output_limit = u32;
+		break;
+	default:
+		/* Added by a newer library; see MARSHAL_REQUIRED. */
+		ret = (tag & MARSHAL_REQUIRED) ? -EINVAL : 0;
+		break;
+	}
+	return ret;
+}
+
+static void clear_jail(struct minijail *j)
+{
+	memset(j, 0, sizeof(*j));
+	j->pidfd = -1;
+	j->stdin_fd = -1;
+	j->tmp_fd = -1;
+	j->scratch_fd = -1;
+}
+
+static int unmarshal_jail(struct minijail *j, char *serialized, size_t length)
+{
+	struct marshal_header hdr;
+	struct marshal_record rec;
+	size_t total = length;
+	char *p, *value;
+	int ret;
+
+	p = consumebytes(sizeof(hdr), &serialized, &length);
+	if (!p)
+		goto invalid;
+	memcpy(&hdr, p, sizeof(hdr));
+	if (hdr.magic != MARSHAL_MAGIC || hdr.version != MARSHAL_VERSION ||
+	    hdr.length != total)
+		goto invalid;
+
+	while (length) {
+		p = consumebytes(sizeof(rec), &serialized, &length);
+		if (!p)
+			goto invalid;
+		memcpy(&rec, p, sizeof(rec));
+		value = consumebytes(rec.length, &serialized, &length);
+		if (!value ||
+		    !consumebytes(marshal_pad(rec.length), &serialized, &length))
+			goto invalid;
+		ret = unmarshal_record(j, rec.tag, value, rec.length);
+		if (ret)
+			goto error;
+	}
+	return 0;
+
+invalid:
+	ret = -EINVAL;
+error:
+	free_config(j);
+	clear_jail(j);
+	return ret;
+}
+
+int minijail_unmarshal(struct minijail *j, char *serialized, size_t length)
+{
+	clear_jail(j);
+	return unmarshal_jail(j, serialized, length);
+}
+
+int minijail_unmarshal_inplace(struct minijail *j, char *serialized,
+			       size_t length)
+{
+	clear_jail(j);
+	j->wire = serialized;
+	j->wire_len = length;
+	return unmarshal_jail(j, serialized, length);
+}
+
+/* bind_one: Applies bindings from @b for @j, recursing as needed.
+ * @j Minijail these bindings are for
+ * @b Head of list of bindings
+ *
+ * Returns 0 for success.
+ */
+int bind_one(const struct minijail *j, struct binding *b)
+{
+	int ret = 0;
+	char *dest = NULL;
+	if (ret)
+		return ret;
+	/* dest has a leading "/" */
+	if (asprintf(&dest, "%s%s", j->chrootdir, b->dest) < 0)
+		return -ENOMEM;
+	ret = mount(b->src, dest, NULL, MS_BIND, NULL);
+	if (ret)
+		pdie("bind: %s -> %s", b->src, dest);
+	if (!b->writeable) {
+		ret = mount(b->src, dest, NULL,
+			    MS_BIND | MS_REMOUNT | MS_RDONLY, NULL);
+		if (ret)
+			pdie("bind ro: %s -> %s", b->src, dest);
+	}
+	free(dest);
+	if (b->next)
+		return bind_one(j, b->next);
+	return ret;
+}
+
+/*
+ * Mounts |tree_fd|, a copy of the prebuilt template, over the chroot
+ * directory. Together with clone_tree() that is one open_tree() and one
+ * move_mount() instead of two mounts per binding.
+ */
+int attach_mount_template(const struct minijail *j, int tree_fd)
+{
+	int ret = 0;
+	if (sys_move_mount(tree_fd, "", AT_FDCWD, j->chrootdir,
+			   MOVE_MOUNT_F_EMPTY_PATH))
+		ret = -errno;
+	close(tree_fd);
+	return ret;
+}
+
+int enter_chroot(const struct minijail *j)
+{
+	struct binding *b = j->bindings_head;
 	int ret;
-	if (j->bindings_head && (ret = bind_one(j, j->bindings_head)))
+	int i;
+
+	/*
+	 * With a mount template, the bindings it was built with are already in
+	 * place, and only those added since are mounted on top.
+	 */
+	if (j->flags.mount_template) {
+		for (i = 0; b && i < j->template_binding_count; i++)
+			b = b->next;
+	}
+	if (b && (ret = bind_one(j, b)))
 		return ret;
 
 	if (chroot(j->chrootdir))
@@ -652,31 +1373,130 @@ int enter_chroot(const struct minijail *j)
 	return 0;
 }
 
-int mount_tmp(void)
+#define DEFAULT_TMP_SIZE (128U << 20)
+
+/*
+ * Mounts a tmpfs on the chroot's /tmp. This runs before chroot(2) so that
+ * the filesystem is also visible to init() when running pid-namespaced.
+ */
+int mount_tmp(struct minijail *j)
+{
+	int ret = 0;
+	char *path = NULL;
+	char opts[64];
+	size_t size = j->tmp_size ? j->tmp_size : DEFAULT_TMP_SIZE;
+
+	if (asprintf(&path, "%s/tmp", j->chrootdir ? j->chrootdir : "") < 0)
+		return -ENOMEM;
+	snprintf(opts, sizeof(opts), "size=%zu,mode=777", size);
+	if (mount("none", path, "tmpfs", MS_NOSUID | MS_NODEV, opts))
+		ret = -errno;
+	else
+		j->tmp_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	free(path);
+	return ret;
+}
+
+/*
+ * Makes |scratch_dir| writable by stacking an overlayfs on top of it, with
+ * the upper layer on a tmpfs of |scratch_size| bytes. The tmpfs is mounted
+ * over the directory itself, so it is hidden once the overlay is in place.
+ * The original contents stay reachable as the lower layer through our
+ * working directory, which is why this chdir()s into it first.
+ */
+int mount_scratch(struct minijail *j)
+{
+	int ret = -ENOMEM;
+	int cwd_fd = -1;
+	char *target = NULL;
+	char *upper = NULL;
+	char *work = NULL;
+	char *opts = NULL;
+
+	if (asprintf(&target, "%s%s", j->chrootdir ? j->chrootdir : "",
+		     j->scratch_dir) < 0)
+		return -ENOMEM;
+	if (asprintf(&upper, "%s/upper", target) < 0)
+		goto out;
+	if (asprintf(&work, "%s/work", target) < 0)
+		goto out;
+
+	cwd_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (cwd_fd < 0 || chdir(target)) {
+		ret = -errno;
+		goto out;
+	}
+	if (asprintf(&opts, "size=%zu,mode=755", j->scratch_size) < 0)
+		goto restore_cwd;
+	if (mount("none", target, "tmpfs", MS_NOSUID | MS_NODEV, opts) ||
+	    mkdir(upper, 0755) || mkdir(work, 0700)) {
+		ret = -errno;
+		goto restore_cwd;
+	}
+	free(opts);
+	if (asprintf(&opts, "lowerdir=.,upperdir=%s,workdir=%s",
+		     upper, work) < 0) {
+		opts = NULL;
+		goto restore_cwd;
+	}
+	if (mount("overlay", target, "overlay", MS_NOSUID | MS_NODEV, opts)) {
+		ret = -errno;
+		goto restore_cwd;
+	}
+	j->scratch_fd = open(target, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	ret = 0;
+
+restore_cwd:
+	if (fchdir(cwd_fd) && !ret)
+		ret = -errno;
+out:
+	if (cwd_fd >= 0)
+		close(cwd_fd);
+	free(opts);
+	free(work);
+	free(upper);
+	free(target);
+	return ret;
+}
+
+/* Returns the number of bytes in use on the filesystem behind |fd|. */
+static long long mount_usage(int fd)
 {
-	return mount("none", "/tmp", "tmpfs", 0, "size=128M,mode=777");
+	struct statfs st;
+	if (fd < 0 || fstatfs(fd, &st))
+		return -1;
+	return (long long)(st.f_blocks - st.f_bfree) * st.f_bsize;
 }
 
 int remount_readonly(const struct minijail *j)
 {
 	int ret = 0;
 	char *procPath = NULL;
+	char opts[32] = "";
 	const unsigned int kSafeFlags = MS_NODEV | MS_NOEXEC | MS_NOSUID;
-	if (asprintf(&procPath, "%s/proc", j->chrootdir ? j->chrootdir : "") < 0)
-		return -ENOMEM;
 	/*
 	 * Right now, we're holding a reference to our parent's old mount of
 	 * /proc in our namespace, which means using MS_REMOUNT here would
 	 * mutate our parent's mount as well, even though we're in a VFS
 	 * namespace (!). Instead, remove their mount from our namespace
-	 * and make our own.
+	 * and make our own. Inside a chroot it is out of reach anyway, so
+	 * leave it alone. MNT_DETACH also takes care of anything mounted
+	 * below it, such as the binfmt_misc some distros have the JDK mount.
 	 */
-	/* Some distros have JDK mount this. Unmount it without erroring out */
-	umount("/proc/sys/fs/binfmt_misc");
-	errno = 0;
-	if (umount("/proc"))
-		ret = -errno;
-	else if (mount("", procPath, "proc", kSafeFlags | MS_RDONLY, ""))
+	if (!j->chrootdir && umount2("/proc", MNT_DETACH))
+		return -errno;
+	if (j->proc_options & MINIJAIL_PROC_NONE)
+		return 0;
+
+	if (j->proc_options & MINIJAIL_PROC_HIDEPID)
+		strcat(opts, "hidepid=invisible,");
+	if (j->proc_options & MINIJAIL_PROC_SUBSET_PID)
+		strcat(opts, "subset=pid,");
+	if (opts[0])
+		opts[strlen(opts) - 1] = '\0';
+	if (asprintf(&procPath, "%s/proc", j->chrootdir ? j->chrootdir : "") < 0)
+		return -ENOMEM;
+	if (mount("proc", procPath, "proc", kSafeFlags | MS_RDONLY, opts))
 		ret = -errno;
 	free(procPath);
 	return ret;
@@ -715,9 +1535,18 @@ static int run_cap_valid(unsigned int cap)
 	if (!last_cap) {
 		const char cap_file[] = "/proc/sys/kernel/cap_last_cap";
 		FILE *fp = fopen(cap_file, "re");
-		if (fscanf(fp, "%u", &last_cap) != 1)
-			pdie("fscanf(%s)", cap_file);
-		fclose(fp);
+		if (fp) {
+			if (fscanf(fp, "%u", &last_cap) != 1)
+				pdie("fscanf(%s)", cap_file);
+			fclose(fp);
+		} else {
+			/*
+			 * The jail may have no /proc, or only its pid
+			 * subset. Ask the kernel about the bounding set.
+			 */
+			while (prctl(PR_CAPBSET_READ, last_cap + 1) >= 0)
+				last_cap++;
+		}
 	}
 
 	return cap <= last_cap;
@@ -780,6 +1609,19 @@ void drop_caps(const struct minijail *j)
 		die("can't apply final cleaned capset");
 
 	cap_free(caps);
+
+	/*
+	 * Entered right before execve(2), which clears the permitted set of
+	 * anything but a privileged binary: carry the caps over as ambient.
+	 */
+	if (!j->flags.ambient_caps)
+		return;
+	for (i = 0; i < sizeof(j->caps) * 8 && run_cap_valid(i); ++i) {
+		if (!(j->caps & (one << i)))
+			continue;
+		if (prctl(PR_CAP_AMBIENT, PR_CAP_AMBIENT_RAISE, i, 0, 0))
+			pdie("prctl(PR_CAP_AMBIENT_RAISE)");
+	}
 }
 
 void set_seccomp_filter(const struct minijail *j)
@@ -812,7 +1654,7 @@ void set_seccomp_filter(const struct minijail *j)
 	}
 }
 
-void API minijail_enter(const struct minijail *j)
+void API minijail_enter(struct minijail *j)
 {
 	if (j->flags.pids)
 		die("tried to enter a pid-namespaced jail;"
@@ -826,18 +1668,48 @@ void API minijail_enter(const struct minijail *j)
 	 * so we don't even try. If any of our operations fail, we abort() the
 	 * entire process.
 	 */
+
+	/*
+	 * A detached mount tree can only be cloned from the mount namespace
+	 * that created it, so copy the template before unsharing.
+	 */
+	int template_fd = -1;
+	if (j->flags.mount_template) {
+		template_fd = clone_tree(j->mount_template_fd);
+		if (template_fd < 0)
+			pdie("clone mount template");
+	}
+
 	if (j->flags.vfs && unshare(CLONE_NEWNS))
 		pdie("unshare(vfs)");
 
+	/*
+	 * The mounts below are made on every run. With shared propagation
+	 * they would show up in the caller's namespace and pile up there.
+	 */
+	if (j->flags.vfs && mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL))
+		pdie("mount(/, private)");
+
 	if (j->flags.net && unshare(CLONE_NEWNET))
 		pdie("unshare(net)");
 
-	if (j->flags.chroot && enter_chroot(j))
-		pdie("chroot");
+	/* This has to happen before /proc is mounted inside the chroot. */
+	if (template_fd >= 0 && attach_mount_template(j, template_fd))
+		pdie("mount template: %s", j->chrootdir);
 
-	if (j->flags.chroot && j->flags.mount_tmp && mount_tmp())
+	/*
+	 * Scratch filesystems are mounted by path from outside the chroot,
+	 * so that they are in place before bindings are made in the child.
+	 */
+	if (j->flags.vfs && j->flags.mount_tmp && mount_tmp(j))
 		pdie("mount_tmp");
 
+	if (j->flags.vfs && j->flags.scratch && mount_scratch(j))
+		pdie("scratch: %s", j->scratch_dir);
+
+	if (j->flags.chroot && enter_chroot(j))
+		pdie("chroot");
+
 	if (j->flags.readonly && remount_readonly(j))
 		pdie("remount");
 
@@ -848,10 +1720,15 @@ void API minijail_enter(const struct minijail *j)
 		 * below will fail. Hang on to root caps across setuid(), then
 		 * lock securebits.
 		 */
+		unsigned long securebits = SECURE_ALL_BITS | SECURE_ALL_LOCKS;
+#ifdef SECBIT_NO_CAP_AMBIENT_RAISE
+		if (j->flags.ambient_caps)
+			securebits &= ~(SECBIT_NO_CAP_AMBIENT_RAISE |
+					SECBIT_NO_CAP_AMBIENT_RAISE_LOCKED);
+#endif
 		if (prctl(PR_SET_KEEPCAPS, 1))
 			pdie("prctl(PR_SET_KEEPCAPS)");
-		if (prctl
-		    (PR_SET_SECUREBITS, SECURE_ALL_BITS | SECURE_ALL_LOCKS))
+		if (prctl(PR_SET_SECUREBITS, securebits))
 			pdie("prctl(PR_SET_SECUREBITS)");
 	}
 
@@ -889,21 +1766,22 @@ void API minijail_enter(const struct minijail *j)
 		pdie("prctl(PR_SET_SECCOMP)");
 }
 
-/* TODO(wad) will visibility affect this variable? */
-static int init_exitstatus = 0;
-static pid_t child_pid = 0;
-static int signal_override = 0;
+/*
+ * The jail being run by init(), for its signal handlers. init() has a
+ * process of its own, so this is never shared between runs.
+ */
+static struct minijail *init_jail;
 
 void init_term(int __attribute__ ((unused)) sig)
 {
-	_exit(init_exitstatus);
+	_exit(init_jail->init_exitstatus);
 }
 
 void timeout(int __attribute__ ((unused)) sig)
 {
 	/* Something went wrong or the child ignored SIGALRM. */
-	signal_override = SIGXCPU;
-	kill(-child_pid, SIGKILL);
+	init_jail->signal_override = SIGXCPU;
+	kill(-init_jail->rootpid, SIGKILL);
 }
 
 int init(struct minijail *j, pid_t rootpid)
@@ -914,13 +1792,16 @@ int init(struct minijail *j, pid_t rootpid)
 	int status;
 	struct rusage usage;
 	struct timespec t0, t1;
+	init_jail = j;
+	j->rootpid = rootpid;
+	j->init_exitstatus = 0;
+	j->signal_override = 0;
 	/* Measure wall-time when outputting metadata information */
 	if (j->flags.meta_file) {
 		clock_gettime(CLOCK_REALTIME, &t0);
 	}
 	/* Backup for timeouts */
 	if (j->flags.time_limit) {
-		child_pid = rootpid;
 		signal(SIGALRM, timeout);
 		alarm((j->time_limit + j->extra_wall_time + 1999) / 1000);
 	}
@@ -933,7 +1814,7 @@ int init(struct minijail *j, pid_t rootpid)
 		 * left inside our pid namespace or we get a signal.
 		 */
 		if (pid == rootpid)
-			init_exitstatus = status;
+			j->init_exitstatus = status;
 	}
 	if (j->flags.meta_file) {
 		clock_gettime(CLOCK_REALTIME, &t1);
@@ -949,20 +1830,30 @@ int init(struct minijail *j, pid_t rootpid)
 				1000000 * usage.ru_utime.tv_sec + usage.ru_utime.tv_usec,
 				(1000000000L * t1.tv_sec + t1.tv_nsec) / 1000L,
 				usage.ru_maxrss * 1024);
+		/*
+		 * tmpfs does not track its high-water mark, so this is what
+		 * was left once the last process exited.
+		 */
+		if (j->tmp_fd >= 0)
+			fprintf(j->meta_file, "tmp:%lld\n",
+				mount_usage(j->tmp_fd));
+		if (j->scratch_fd >= 0)
+			fprintf(j->meta_file, "scratch:%lld\n",
+				mount_usage(j->scratch_fd));
 	}
 
 	exit_signal = 0;
-	if (signal_override) {
-		exit_signal = signal_override;
+	if (j->signal_override) {
+		exit_signal = j->signal_override;
 		exit_status = MINIJAIL_ERR_INIT;
-	} else if (!WIFEXITED(init_exitstatus)) {
+	} else if (!WIFEXITED(j->init_exitstatus)) {
 		exit_signal = -1;
-		if (WIFSIGNALED(init_exitstatus)) {
-			exit_signal = WTERMSIG(init_exitstatus);
+		if (WIFSIGNALED(j->init_exitstatus)) {
+			exit_signal = WTERMSIG(j->init_exitstatus);
 		}
 		exit_status = MINIJAIL_ERR_INIT;
 	} else {
-		exit_status = WEXITSTATUS(init_exitstatus);
+		exit_status = WEXITSTATUS(j->init_exitstatus);
 	}
 	if (j->flags.meta_file) {
 		if (exit_signal != 0) {
@@ -985,7 +1876,6 @@ int API minijail_from_fd(int fd, struct minijail *j)
 	size_t sz = 0;
 	size_t bytes = read(fd, &sz, sizeof(sz));
 	char *buf;
-	int r;
 	if (sizeof(sz) != bytes)
 		return -EINVAL;
 	if (sz > USHRT_MAX)	/* Arbitrary sanity check */
@@ -998,9 +1888,8 @@ int API minijail_from_fd(int fd, struct minijail *j)
 		free(buf);
 		return -EINVAL;
 	}
-	r = minijail_unmarshal(j, buf, sz);
-	free(buf);
-	return r;
+	/* |j| keeps |buf| rather than copying everything out of it. */
+	return minijail_unmarshal_inplace(j, buf, sz);
 }
 
 int API minijail_to_fd(struct minijail *j, int fd)
@@ -1033,82 +1922,632 @@ int API minijail_to_fd(struct minijail *j, int fd)
 	return 0;
 }
 
-int setup_preload(void)
+struct minijail API *minijail_clone_template(const struct minijail *j)
 {
-	char *oldenv = getenv(kLdPreloadEnvVar) ? : "";
-	char *newenv = malloc(strlen(oldenv) + 2 + strlen(PRELOADPATH));
-	if (!newenv)
-		return -ENOMEM;
+	size_t sz = minijail_size(j);
+	struct minijail *copy = minijail_new();
+	char *buf = malloc(sz);
 
-	/* Only insert a separating space if we have something to separate... */
-	sprintf(newenv, "%s%s%s", oldenv, strlen(oldenv) ? " " : "",
-		PRELOADPATH);
+	if (!copy || !buf || minijail_marshal(j, buf, sz) ||
+	    minijail_unmarshal(copy, buf, sz)) {
+		/* A failed unmarshal has already freed what it allocated. */
+		free(buf);
+		free(copy);
+		return NULL;
+	}
+	free(buf);
 
-	/* setenv() makes a copy of the string we give it */
-	setenv(kLdPreloadEnvVar, newenv, 1);
-	free(newenv);
-	return 0;
+	/* Share the prebuilt mount tree, which unmarshalling leaves out. */
+	if (j->flags.mount_template) {
+		copy->mount_template_fd = fcntl(j->mount_template_fd,
+						F_DUPFD_CLOEXEC, 0);
+		if (copy->mount_template_fd < 0) {
+			minijail_destroy(copy);
+			return NULL;
+		}
+		copy->template_binding_count = j->template_binding_count;
+		copy->flags.mount_template = 1;
+	}
+	return copy;
 }
 
-int setup_pipe(int fds[2])
+struct minijail API *minijail_dup(struct minijail *j)
 {
-	int r = pipe(fds);
-	char fd_buf[11];
-	if (r)
-		return r;
-	r = snprintf(fd_buf, sizeof(fd_buf), "%d", fds[0]);
-	if (r <= 0)
+	struct minijail *copy = malloc(sizeof(*copy));
+
+	if (!copy)
+		return NULL;
+	*copy = *j;
+	copy->tmpl = j;
+	copy->dups = 0;
+	copy->destroyed = 0;
+	j->dups++;
+
+	/* Per-run state is the caller's to set up again. */
+	copy->pidfd = -1;
+	copy->stdin_fd = -1;
+	copy->initpid = 0;
+	copy->rootpid = 0;
+	copy->tmp_fd = -1;
+	copy->scratch_fd = -1;
+	copy->flags.meta_file = 0;
+	copy->meta_file = NULL;
+	copy->preserved_fd_count = 0;
+	copy->path_cache = NULL;
+	copy->path_cache_next = 0;
+	/* Whatever points into |j|'s wire buffer is borrowed along with it. */
+	copy->wire = NULL;
+	copy->wire_len = 0;
+	return copy;
+}
+
+static int parse_profile_number(const char *value, long long max,
+				long long *number)
+{
+	char *end;
+
+	if (!value || !*value)
+		return -EINVAL;
+	errno = 0;
+	*number = strtoll(value, &end, 0);
+	if (errno || *end || *number < 0 || *number > max)
 		return -EINVAL;
-	setenv(kFdEnvVar, fd_buf, 1);
 	return 0;
 }
 
-int setup_pipe_end(int fds[2], size_t index)
+/* Parses a capability mask, which can use all 64 bits. */
+static int parse_profile_mask(const char *value, uint64_t *mask)
 {
-	if (index > 1)
-		return -1;
+	unsigned long long n;
+	char *end;
 
-	close(fds[1 - index]);
-	return fds[index];
+	if (!value || !*value || *value == '-')
+		return -EINVAL;
+	errno = 0;
+	n = strtoull(value, &end, 0);
+	if (errno || *end)
+		return -EINVAL;
+	*mask = n;
+	return 0;
 }
 
-int setup_and_dupe_pipe_end(int fds[2], size_t index, int fd)
+/*
+ * Like minijail_parse_seccomp_filters(), but a policy that can't be read or
+ * compiled is an error in the profile rather than a reason to die.
+ */
+static int parse_profile_policy(struct minijail *j, const char *path)
 {
-	if (index > 1)
-		return -1;
+	struct sock_fprog *fprog;
+	FILE *file;
+	int ret = 0;
 
-	close(fds[1 - index]);
-	/* dup2(2) the corresponding end of the pipe into |fd|. */
-	return dup2(fds[index], fd);
+	/* A second policy would leave the first one to the duplicates. */
+	if (j->filter_prog)
+		return -EINVAL;
+	file = fopen(path, "re");
+	if (!file)
+		return -EINVAL;
+	fprog = malloc(sizeof(*fprog));
+	if (!fprog) {
+		ret = -ENOMEM;
+	} else if (compile_filter(file, fprog, j->flags.log_seccomp_filter)) {
+		free(fprog);
+		ret = -EINVAL;
+	} else {
+		j->filter_len = fprog->len;
+		j->filter_prog = fprog;
+		minijail_use_seccomp_filter(j);
+	}
+	fclose(file);
+	return ret;
 }
 
-int setup_limits(struct minijail *j) {
-	struct rlimit limit;
-
-	if (j->flags.memory_limit) {
-		limit.rlim_cur = limit.rlim_max = j->memory_limit;
-		if (setrlimit(RLIMIT_AS, &limit)) {
-			return -1;
-		}
+/*
+ * Applies one "key" or "key=value" line of a profile to |j|. The keys mirror
+ * the minijail0 options.
+ */
+static int apply_profile_key(struct minijail *j, const char *key,
+			     char *value)
+{
+	char *second, *third;
+	uint64_t mask;
+	long long n;
+
+	if (!strcmp(key, "pids") && !value) {
+		minijail_namespace_pids(j);
+	} else if (!strcmp(key, "vfs") && !value) {
+		minijail_namespace_vfs(j);
+	} else if (!strcmp(key, "net") && !value) {
+		minijail_namespace_net(j);
+	} else if (!strcmp(key, "readonly") && !value) {
+		minijail_remount_readonly(j);
+	} else if (!strcmp(key, "no-new-privs") && !value) {
+		minijail_no_new_privs(j);
+	} else if (!strcmp(key, "no-preload") && !value) {
+		minijail_no_preload(j);
+	} else if (!value) {
+		return -EINVAL;
+	} else if (!strcmp(key, "chroot")) {
+		return minijail_enter_chroot(j, value);
+	} else if (!strcmp(key, "chdir")) {
+		return minijail_chroot_chdir(j, value);
+	} else if (!strcmp(key, "bind")) {
+		second = strchr(value, ',');
+		if (!second)
+			return -EINVAL;
+		*second++ = '\0';
+		third = strchr(second, ',');
+		if (third)
+			*third++ = '\0';
+		return minijail_bind(j, value, second, third ? atoi(third) : 0);
+	} else if (!strcmp(key, "scratch")) {
+		second = strchr(value, ',');
+		if (!second)
+			return -EINVAL;
+		*second++ = '\0';
+		if (parse_profile_number(second, LLONG_MAX, &n))
+			return -EINVAL;
+		return minijail_scratch(j, value, n);
+	} else if (!strcmp(key, "policy")) {
+		return parse_profile_policy(j, value);
+	} else if (!strcmp(key, "caps")) {
+		if (parse_profile_mask(value, &mask))
+			return -EINVAL;
+		minijail_use_caps(j, mask);
+	} else if (parse_profile_number(value, INT_MAX, &n)) {
+		return -EINVAL;
+	} else if ((!strcmp(key, "uid") || !strcmp(key, "gid")) && n == 0) {
+		/* minijail_change_uid() and minijail_change_gid() die on 0. */
+		return -EINVAL;
+	} else if (!strcmp(key, "uid")) {
+		minijail_change_uid(j, n);
+	} else if (!strcmp(key, "gid")) {
+		minijail_change_gid(j, n);
+	} else if (!strcmp(key, "tmp")) {
+		minijail_mount_tmp_size(j, n);
+	} else if (!strcmp(key, "stack")) {
+		minijail_stack_limit(j, n);
+	} else if (!strcmp(key, "time")) {
+		minijail_time_limit(j, n);
+	} else if (!strcmp(key, "wall-time")) {
+		minijail_extra_wall_time(j, n);
+	} else if (!strcmp(key, "output")) {
+		minijail_output_limit(j, n);
+	} else if (!strcmp(key, "memory")) {
+		minijail_memory_limit(j, n);
+	} else {
+		return -EINVAL;
 	}
+	return 0;
+}
 
-	if (j->flags.output_limit) {
-		limit.rlim_cur = limit.rlim_max = j->output_limit;
-		if (setrlimit(RLIMIT_FSIZE, &limit)) {
-			return -1;
-		}
+/*
+ * Keys that change who the program runs as, which a profile chosen by an
+ * unprivileged caller must not set.
+ */
+static int profile_key_is_privileged(const char *key)
+{
+	return !strcmp(key, "uid") || !strcmp(key, "gid") ||
+	       !strcmp(key, "caps");
+}
 
-		/* Diable core dumping if there is an output limit. */
-		limit.rlim_cur = limit.rlim_max = 0;
-		if (setrlimit(RLIMIT_CORE, &limit)) {
-			return -1;
+int API minijail_parse_profile(struct minijail *j, const char *path,
+			       const char *name, int flags)
+{
+	FILE *file = fopen(path, "re");
+	char *line = NULL;
+	size_t len = 0;
+	int lineno = 0;
+	int found = 0;
+	int in_section = 0;
+	int mount_template = 0;
+	int ret = 0;
+
+	if (!file)
+		return -errno;
+	while (getline(&line, &len, file) != -1) {
+		char *key = line, *value, *end;
+
+		lineno++;
+		key[strcspn(key, "#;\n")] = '\0';
+		key += strspn(key, " \t");
+		end = key + strlen(key);
+		while (end > key && isspace(end[-1]))
+			*--end = '\0';
+		if (!*key)
+			continue;
+
+		if (*key == '[') {
+			if (end[-1] != ']') {
+				ret = -EINVAL;
+				break;
+			}
+			end[-1] = '\0';
+			in_section = !strcmp(key + 1, name);
+			found |= in_section;
+			continue;
+		}
+		if (!in_section)
+			continue;
+		/* Built last, once all bindings are known. */
+		if (!strcmp(key, "mount-template")) {
+			mount_template = 1;
+			continue;
 		}
-	}
 
-	if (j->flags.stack_limit) {
-		limit.rlim_cur = limit.rlim_max = j->stack_limit;
-		if (setrlimit(RLIMIT_STACK, &limit)) {
-			return -1;
+		value = strchr(key, '=');
+		if (value) {
+			end = value;
+			*value++ = '\0';
+			value += strspn(value, " \t");
+			while (end > key && isspace(end[-1]))
+				*--end = '\0';
+		}
+		if ((flags & MINIJAIL_PROFILE_UNPRIVILEGED) &&
+		    profile_key_is_privileged(key)) {
+			ret = -EPERM;
+			break;
+		}
+		ret = apply_profile_key(j, key, value);
+		if (ret)
+			break;
+	}
+	if (ret)
+		warn("%s:%d: bad profile line", path, lineno);
+	else if (!found)
+		ret = -ENOENT;
+	free(line);
+	fclose(file);
+
+	/* Without the template, bindings are just mounted one by one. */
+	if (!ret && mount_template) {
+		int err = minijail_build_mount_template(j);
+		if (err)
+			warn("%s: no mount template for %s: %s", path, name,
+			     strerror(-err));
+	}
+	return ret;
+}
+
+/*
+ * Opens a new, read-only file description for |fd|, so that each run reads
+ * its input from the start, straight from the page cache, and concurrent
+ * runs don't share an offset. This works for memfds too.
+ */
+static int reopen_readonly(int fd)
+{
+	char path[32];
+	int ret;
+
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	ret = open(path, O_RDONLY | O_CLOEXEC);
+	if (ret < 0)
+		return -errno;
+	return ret;
+}
+
+/* Returns whether the environment entry |entry| sets |name|. */
+static int env_is(const char *entry, const char *name)
+{
+	size_t len = strlen(name);
+	return !strncmp(entry, name, len) && entry[len] == '=';
+}
+
+/*
+ * Builds the environment for the jailed program: ours, with the preload
+ * library appended to LD_PRELOAD and the read end of the marshalling pipe
+ * in kFdEnvVar. This is passed straight to execve(2) rather than set up
+ * with setenv(3), so launches from several threads don't race on environ.
+ *
+ * The last two entries are owned by the array; see free_child_env().
+ */
+static char **build_child_env(int fd)
+{
+	const char *preload = getenv(kLdPreloadEnvVar) ? : "";
+	char **envp;
+	char **e;
+	size_t n = 0;
+
+	for (e = environ; *e; e++)
+		n++;
+	envp = calloc(n + 3, sizeof(*envp));
+	if (!envp)
+		return NULL;
+	n = 0;
+	for (e = environ; *e; e++) {
+		if (!env_is(*e, kLdPreloadEnvVar) && !env_is(*e, kFdEnvVar))
+			envp[n++] = *e;
+	}
+	/* Only insert a separating space if we have something to separate... */
+	if (asprintf(&envp[n], "%s=%s%s%s", kLdPreloadEnvVar, preload,
+		     preload[0] ? " " : "", PRELOADPATH) < 0)
+		goto error;
+	if (asprintf(&envp[n + 1], "%s=%d", kFdEnvVar, fd) < 0) {
+		free(envp[n]);
+		goto error;
+	}
+	return envp;
+
+error:
+	free(envp);
+	return NULL;
+}
+
+static void free_child_env(char **envp)
+{
+	size_t n = 0;
+	while (envp[n])
+		n++;
+	free(envp[n - 1]);
+	free(envp[n - 2]);
+	free(envp);
+}
+
+/*
+ * Copies @j to enter right before execve(2), for launches without the preload
+ * library. It goes through the same marshalling as the copy sent to the
+ * preload library, so both ways end up in exactly the same jail. Only called
+ * in the child, which dies on failure just like the preload library would.
+ */
+static struct minijail *exec_jail(const struct minijail *j)
+{
+	size_t sz = minijail_size(j);
+	struct minijail *copy = minijail_new();
+	char *buf = malloc(sz);
+
+	if (!copy || !buf || minijail_marshal(j, buf, sz) ||
+	    minijail_unmarshal_inplace(copy, buf, sz))
+		die("failed to copy minijail for execve");
+	/* Strip out flags meant for the parent. */
+	minijail_preenter(copy);
+	copy->flags.ambient_caps = copy->flags.caps;
+	return copy;
+}
+
+/*
+ * Opens a pidfd for the jail's init, so callers can poll for its exit.
+ * It stays valid until the next run; on kernels without pidfd_open(2),
+ * minijail_pidfd() just reports the error.
+ */
+static void open_pidfd(struct minijail *j)
+{
+	if (j->pidfd >= 0)
+		close(j->pidfd);
+	j->pidfd = syscall(__NR_pidfd_open, j->initpid, 0);
+	if (j->pidfd < 0)
+		j->pidfd = -errno;
+}
+
+/*
+ * Starts a child in a new pid namespace, fork(2)-style.
+ *
+ * Calling clone(2) directly from a multithreaded process leaves the child
+ * with whatever libc locks other threads were holding at the time, and
+ * init() has to malloc() and fork() again before exec. So fork(2) first,
+ * which takes care of those locks, and clone(2) from that single-threaded
+ * helper. CLONE_PARENT makes the new init our child rather than the
+ * helper's, so it can still be waited for and killed as before.
+ */
+static pid_t fork_pid_namespace(void)
+{
+	int fds[2];
+	pid_t helper;
+	pid_t child = -1;
+	int status;
+
+	if (pipe2(fds, O_CLOEXEC))
+		return -1;
+	helper = fork();
+	if (helper < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+	if (helper == 0) {
+		close(fds[0]);
+		child = syscall(SYS_clone,
+				CLONE_NEWPID | CLONE_PARENT | SIGCHLD, NULL);
+		if (child == 0) {
+			close(fds[1]);
+			return 0;
+		}
+		if (write(fds[1], &child, sizeof(child)) != sizeof(child))
+			_exit(1);
+		_exit(child < 0);
+	}
+	close(fds[1]);
+	if (read(fds[0], &child, sizeof(child)) != sizeof(child))
+		child = -1;
+	close(fds[0]);
+	while (waitpid(helper, &status, 0) < 0 && errno == EINTR)
+		;
+	return child;
+}
+
+int setup_pipe_end(int fds[2], size_t index)
+{
+	if (index > 1)
+		return -1;
+
+	close(fds[1 - index]);
+	return fds[index];
+}
+
+/* Closes whichever ends of |fds| were opened. */
+static void close_pipe(int fds[2])
+{
+	if (fds[0] >= 0)
+		close(fds[0]);
+	if (fds[1] >= 0)
+		close(fds[1]);
+}
+
+int setup_and_dupe_pipe_end(int fds[2], size_t index, int fd)
+{
+	if (index > 1)
+		return -1;
+
+	close(fds[1 - index]);
+	/* Already there, but still close-on-exec. */
+	if (fds[index] == fd)
+		return fcntl(fd, F_SETFD, 0) ? -1 : fd;
+	/* dup2(2) the corresponding end of the pipe into |fd|. */
+	return dup2(fds[index], fd);
+}
+
+/* Returns the highest fd in the fd map of |j|, or -1 if it is empty. */
+static int highest_child_fd(const struct minijail *j)
+{
+	int highest = -1;
+	size_t i;
+
+	for (i = 0; i < j->preserved_fd_count; i++)
+		highest = MAX(highest, j->preserved_fds[i].child_fd);
+	return highest;
+}
+
+/* Marks fds |first| through |last| close-on-exec. */
+static int cloexec_range(unsigned int first, unsigned int last)
+{
+	DIR *dir;
+	struct dirent *entry;
+
+	if (!syscall(__NR_close_range, first, last, CLOSE_RANGE_CLOEXEC))
+		return 0;
+	if (errno != ENOSYS && errno != EINVAL)
+		return -errno;
+
+	/* Kernels before 5.11 need it done one fd at a time. */
+	dir = opendir("/proc/self/fd");
+	if (!dir)
+		return -errno;
+	while ((entry = readdir(dir))) {
+		char *end;
+		unsigned long fd = strtoul(entry->d_name, &end, 10);
+		if (*end || end == entry->d_name || fd < first || fd > last ||
+		    (int)fd == dirfd(dir))
+			continue;
+		fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+	}
+	closedir(dir);
+	return 0;
+}
+
+static int compare_fds(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+/*
+ * Moves the fds that |j| itself still uses after the fork to |limit| or above,
+ * so that the fd map cannot dup2(2) over them.
+ */
+static int move_jail_fds(struct minijail *j, int limit)
+{
+	FILE *meta_file;
+	int fd;
+
+	if (j->flags.mount_template && j->mount_template_fd < limit) {
+		fd = fcntl(j->mount_template_fd, F_DUPFD_CLOEXEC, limit);
+		if (fd < 0)
+			return -errno;
+		close(j->mount_template_fd);
+		j->mount_template_fd = fd;
+	}
+	if (j->flags.meta_file && j->meta_file &&
+	    fileno(j->meta_file) < limit) {
+		fd = fcntl(fileno(j->meta_file), F_DUPFD_CLOEXEC, limit);
+		if (fd < 0)
+			return -errno;
+		meta_file = fdopen(fd, "w+");
+		if (!meta_file) {
+			close(fd);
+			return -ENOMEM;
+		}
+		/* Nothing is written to it before the fork, so nothing is lost. */
+		fclose(j->meta_file);
+		j->meta_file = meta_file;
+	}
+	return 0;
+}
+
+/*
+ * Gives the child of a run the fds in the fd map of |j|, and marks everything
+ * else but stdio and |keep_fd| close-on-exec, so the program starts with
+ * nothing the caller happened to have open. Marking them rather than closing
+ * them takes a close_range(2) per gap between kept fds, and leaves init the
+ * meta file it still needs.
+ */
+static int setup_child_fds(struct minijail *j, int keep_fd)
+{
+	int moved[MAX_PRESERVED_FDS];
+	int keep[MAX_PRESERVED_FDS + 4];
+	int limit = MAX(MAX(STDERR_FILENO, keep_fd), highest_child_fd(j)) + 1;
+	size_t i, nkeep = 0;
+	unsigned int next = 0;
+	int ret;
+
+	/* A parent fd might be another one's child fd, so move them all first. */
+	for (i = 0; i < j->preserved_fd_count; i++) {
+		moved[i] = fcntl(j->preserved_fds[i].parent_fd, F_DUPFD_CLOEXEC,
+				 limit);
+		if (moved[i] < 0)
+			return -errno;
+	}
+	ret = move_jail_fds(j, limit);
+	if (ret)
+		return ret;
+	for (i = 0; i < j->preserved_fd_count; i++) {
+		if (dup2(moved[i], j->preserved_fds[i].child_fd) < 0)
+			return -errno;
+		close(moved[i]);
+		keep[nkeep++] = j->preserved_fds[i].child_fd;
+	}
+
+	keep[nkeep++] = STDIN_FILENO;
+	keep[nkeep++] = STDOUT_FILENO;
+	keep[nkeep++] = STDERR_FILENO;
+	if (keep_fd >= 0)
+		keep[nkeep++] = keep_fd;
+	qsort(keep, nkeep, sizeof(keep[0]), compare_fds);
+	for (i = 0; i < nkeep; i++) {
+		if ((unsigned int)keep[i] > next) {
+			ret = cloexec_range(next, keep[i] - 1);
+			if (ret)
+				return ret;
+		}
+		next = MAX(next, (unsigned int)keep[i] + 1);
+	}
+	return cloexec_range(next, ~0U);
+}
+
+int setup_limits(struct minijail *j) {
+	struct rlimit limit;
+
+	if (j->flags.memory_limit) {
+		limit.rlim_cur = limit.rlim_max = j->memory_limit;
+		if (setrlimit(RLIMIT_AS, &limit)) {
+			return -1;
+		}
+	}
+
+	if (j->flags.output_limit) {
+		limit.rlim_cur = limit.rlim_max = j->output_limit;
+		if (setrlimit(RLIMIT_FSIZE, &limit)) {
+			return -1;
+		}
+
+		/* Diable core dumping if there is an output limit. */
+		limit.rlim_cur = limit.rlim_max = 0;
+		if (setrlimit(RLIMIT_CORE, &limit)) {
+			return -1;
+		}
+	}
+
+	if (j->flags.stack_limit) {
+		limit.rlim_cur = limit.rlim_max = j->stack_limit;
+		if (setrlimit(RLIMIT_STACK, &limit)) {
+			return -1;
 		}
 	}
 
@@ -1158,41 +2597,64 @@ int API minijail_run_pid_pipes(struct minijail *j, const char *filename,
 			       char *const argv[], pid_t *pchild_pid,
 			       int *pstdin_fd, int *pstdout_fd, int *pstderr_fd)
 {
-	char *oldenv, *oldenv_copy = NULL;
+	char **envp = environ;
+	struct minijail *inner = NULL;
 	pid_t child_pid;
-	int pipe_fds[2];
-	int stdin_fds[2];
-	int stdout_fds[2];
-	int stderr_fds[2];
+	int input_fd = -1;
+	int pipe_fds[2] = { -1, -1 };
+	int stdin_fds[2] = { -1, -1 };
+	int stdout_fds[2] = { -1, -1 };
+	int stderr_fds[2] = { -1, -1 };
 	int ret;
 	/* We need to remember this across the minijail_preexec() call. */
 	int pid_namespace = j->flags.pids;
 	int chroot = j->flags.chroot;
+	int use_preload = !j->flags.no_preload;
 
-	oldenv = getenv(kLdPreloadEnvVar);
-	if (oldenv) {
-		oldenv_copy = strdup(oldenv);
-		if (!oldenv_copy)
-			return -ENOMEM;
+	if (j->stdin_fd >= 0) {
+		if (pstdin_fd)
+			return -EINVAL;
+		input_fd = reopen_readonly(j->stdin_fd);
+		if (input_fd < 0)
+			return input_fd;
 	}
 
-	if (setup_preload())
-		return -EFAULT;
-
 	/*
 	 * Before we fork(2) and execve(2) the child process, we need to open
-	 * a pipe(2) to send the minijail configuration over.
+	 * a pipe(2) to send the minijail configuration over to the preload
+	 * library. Like the stdio pipes below, it is close-on-exec, so that
+	 * jails launched meanwhile by other threads don't inherit it.
 	 */
-	if (setup_pipe(pipe_fds))
-		return -EFAULT;
+	ret = -EFAULT;
+	if (use_preload) {
+		if (pipe2(pipe_fds, O_CLOEXEC))
+			goto error;
+
+		/* Keep the preload library's end clear of the fd map. */
+		if (pipe_fds[0] <= highest_child_fd(j)) {
+			int fd = fcntl(pipe_fds[0], F_DUPFD_CLOEXEC,
+				       highest_child_fd(j) + 1);
+			close(pipe_fds[0]);
+			pipe_fds[0] = fd;
+			if (fd < 0)
+				goto error;
+		}
+
+		envp = build_child_env(pipe_fds[0]);
+		if (!envp) {
+			envp = environ;
+			ret = -ENOMEM;
+			goto error;
+		}
+	}
 
 	/*
 	 * If we want to write to the child process' standard input,
 	 * create the pipe(2) now.
 	 */
 	if (pstdin_fd) {
-		if (pipe(stdin_fds))
-			return -EFAULT;
+		if (pipe2(stdin_fds, O_CLOEXEC))
+			goto error;
 	}
 
 	/*
@@ -1200,8 +2662,8 @@ int API minijail_run_pid_pipes(struct minijail *j, const char *filename,
 	 * create the pipe(2) now.
 	 */
 	if (pstdout_fd) {
-		if (pipe(stdout_fds))
-			return -EFAULT;
+		if (pipe2(stdout_fds, O_CLOEXEC))
+			goto error;
 	}
 
 	/*
@@ -1209,79 +2671,40 @@ int API minijail_run_pid_pipes(struct minijail *j, const char *filename,
 	 * create the pipe(2) now.
 	 */
 	if (pstderr_fd) {
-		if (pipe(stderr_fds))
-			return -EFAULT;
-	}
-
-	/* Use sys_clone() if and only if we're creating a pid namespace.
-	 *
-	 * tl;dr: WARNING: do not mix pid namespaces and multithreading.
-	 *
-	 * In multithreaded programs, there are a bunch of locks inside libc,
-	 * some of which may be held by other threads at the time that we call
-	 * minijail_run_pid(). If we call fork(), glibc does its level best to
-	 * ensure that we hold all of these locks before it calls clone()
-	 * internally and drop them after clone() returns, but when we call
-	 * sys_clone(2) directly, all that gets bypassed and we end up with a
-	 * child address space where some of libc's important locks are held by
-	 * other threads (which did not get cloned, and hence will never release
-	 * those locks). This is okay so long as we call exec() immediately
-	 * after, but a bunch of seemingly-innocent libc functions like setenv()
-	 * take locks.
-	 *
-	 * Hence, only call sys_clone() if we need to, in order to get at pid
-	 * namespacing. If we follow this path, the child's address space might
-	 * have broken locks; you may only call functions that do not acquire
-	 * any locks.
-	 *
-	 * Unfortunately, fork() acquires every lock it can get its hands on, as
-	 * previously detailed, so this function is highly likely to deadlock
-	 * later on (see "deadlock here") if we're multithreaded.
-	 *
-	 * We might hack around this by having the clone()d child (init of the
-	 * pid namespace) return directly, rather than leaving the clone()d
-	 * process hanging around to be init for the new namespace (and having
-	 * its fork()ed child return in turn), but that process would be crippled
-	 * with its libc locks potentially broken. We might try fork()ing in the
-	 * parent before we clone() to ensure that we own all the locks, but
-	 * then we have to have the forked child hanging around consuming
-	 * resources (and possibly having file descriptors / shared memory
-	 * regions / etc attached). We'd need to keep the child around to avoid
-	 * having its children get reparented to init.
-	 *
-	 * TODO(ellyjones): figure out if the "forked child hanging around"
-	 * problem is fixable or not. It would be nice if we worked in this
-	 * case.
+		if (pipe2(stderr_fds, O_CLOEXEC))
+			goto error;
+	}
+
+	/*
+	 * Nothing below touches process-wide state before the fork, so
+	 * several threads can launch jails at once, as long as each uses
+	 * its own struct minijail.
 	 */
 	if (pid_namespace)
-		child_pid = syscall(SYS_clone, CLONE_NEWPID | SIGCHLD, NULL);
+		child_pid = fork_pid_namespace();
 	else
 		child_pid = fork();
 
-	if (child_pid < 0) {
-		free(oldenv_copy);
+	if (child_pid < 0)
 		die("failed to fork child");
-	}
 
 	if (child_pid) {
-		/* Restore parent's LD_PRELOAD. */
-		if (oldenv_copy) {
-			setenv(kLdPreloadEnvVar, oldenv_copy, 1);
-			free(oldenv_copy);
-		} else {
-			unsetenv(kLdPreloadEnvVar);
-		}
-		unsetenv(kFdEnvVar);
+		if (input_fd >= 0)
+			close(input_fd);
 
 		j->initpid = child_pid;
+		open_pidfd(j);
 
 		/* Send marshalled minijail. */
-		close(pipe_fds[0]);	/* read endpoint */
-		ret = minijail_to_fd(j, pipe_fds[1]);
-		close(pipe_fds[1]);	/* write endpoint */
-		if (ret) {
-			kill(j->initpid, SIGKILL);
-			die("failed to send marshalled minijail");
+		if (use_preload) {
+			free_child_env(envp);
+			close(pipe_fds[0]);	/* read endpoint */
+			ret = minijail_to_fd(j, pipe_fds[1]);
+			close(pipe_fds[1]);	/* write endpoint */
+			if (ret) {
+				kill(j->initpid, SIGKILL);
+				die("failed to send marshalled minijail");
+			}
 		}
 
 		if (pchild_pid)
@@ -1313,7 +2736,10 @@ int API minijail_run_pid_pipes(struct minijail *j, const char *filename,
 
 		return 0;
 	}
-	free(oldenv_copy);
+
+	/* Feed standard input from the file given to minijail_stdin_fd(). */
+	if (input_fd >= 0 && dup2(input_fd, STDIN_FILENO) < 0)
+		die("failed to set up stdin");
 
 	/*
 	 * If we want to write to the jailed process' standard input,
@@ -1345,6 +2771,27 @@ int API minijail_run_pid_pipes(struct minijail *j, const char *filename,
 			die("failed to set up stderr pipe");
 	}
 
+	/*
+	 * Only the parent sends the marshalled minijail, which the preload
+	 * library reads after execve(2).
+	 */
+	if (use_preload) {
+		close(pipe_fds[1]);
+		if (fcntl(pipe_fds[0], F_SETFD, 0))
+			die("failed to pass on the preload pipe");
+	}
+
+	if (j->flags.close_open_fds &&
+	    setup_child_fds(j, use_preload ? pipe_fds[0] : -1))
+		die("failed to set up the child's fds");
+
+	/*
+	 * Without the preload library, the part of the jail that is not
+	 * inherited across execve is entered right before it instead.
+	 */
+	if (!use_preload)
+		inner = exec_jail(j);
+
 	/* Strip out flags that cannot be inherited across execve. */
 	minijail_preexec(j);
 	/* Jail this process and its descendants... */
@@ -1356,9 +2803,6 @@ int API minijail_run_pid_pipes(struct minijail *j, const char *filename,
 		 * namespace, so fork off a child to actually run the program
 		 * (we don't want all programs we might exec to have to know
 		 * how to be init).
-		 *
-		 * If we're multithreaded, we'll probably deadlock here. See
-		 * WARNING above.
 		 */
 		child_pid = fork();
 		if (child_pid < 0)
@@ -1391,70 +2835,118 @@ int API minijail_run_pid_pipes(struct minijail *j, const char *filename,
 		die("failed to set execution limits");
 	}
 
+	/*
+	 * ...and drop privileges. The seccomp filter is in force from here
+	 * on, so its policy has to allow the execve(2) below, and for
+	 * dynamically-linked programs whatever the loader needs.
+	 */
+	if (inner)
+		minijail_enter(inner);
+
+	_exit(execve(filename, argv, envp));
 
-	_exit(execve(filename, argv, environ));
+error:
+	if (envp != environ)
+		free_child_env(envp);
+	close_pipe(pipe_fds);
+	close_pipe(stdin_fds);
+	close_pipe(stdout_fds);
+	close_pipe(stderr_fds);
+	if (input_fd >= 0)
+		close(input_fd);
+	return ret;
 }
 
 int API minijail_run_static(struct minijail *j, const char *filename,
 			    char *const argv[])
 {
-	pid_t child_pid;
-	int pid_namespace = j->flags.pids;
-
-	if (j->flags.caps)
-		die("caps not supported with static targets");
-
-	if (pid_namespace)
-		child_pid = syscall(SYS_clone, CLONE_NEWPID | SIGCHLD, NULL);
-	else
-		child_pid = fork();
-
-	if (child_pid < 0) {
-		die("failed to fork child");
-	}
-	if (child_pid > 0 ) {
-		j->initpid = child_pid;
-		return 0;
-	}
+	int no_preload = j->flags.no_preload;
+	int ret;
 
 	/*
-	 * We can now drop this child into the sandbox
-	 * then execve the target.
+	 * Static binaries can't be injected with the preload library. That is
+	 * a property of this run, not of |j|, so put the flag back afterwards.
 	 */
+	j->flags.no_preload = 1;
+	ret = minijail_run_pid_pipes(j, filename, argv, NULL, NULL, NULL,
+				     NULL);
+	j->flags.no_preload = no_preload;
+	return ret;
+}
 
-	j->flags.pids = 0;
-	minijail_enter(j);
-
-	if (pid_namespace) {
-		/*
-		 * pid namespace: this process will become init inside the new
-		 * namespace, so fork off a child to actually run the program
-		 * (we don't want all programs we might exec to have to know
-		 * how to be init).
-		 *
-		 * If we're multithreaded, we'll probably deadlock here. See
-		 * WARNING above.
-		 */
-		child_pid = fork();
-		if (child_pid < 0)
-			_exit(child_pid);
-		else if (child_pid > 0)
-			init(j, child_pid);	/* never returns */
-	}
+int API minijail_run_fds(struct minijail *j, const char *filename,
+			 char *const argv[], pid_t *pchild_pid,
+			 struct minijail_fd *fds, size_t nfds)
+{
+	/* The caller's end and the child's end of each of |fds|. */
+	int ends[MAX_PRESERVED_FDS][2];
+	size_t preserved_fd_count = j->preserved_fd_count;
+	int close_open_fds = j->flags.close_open_fds;
+	size_t i, made;
+	int pair[2];
+	int ret = 0;
 
-	if (j->flags.chroot && enter_chroot(j)) {
-		pdie("chroot");
+	if (nfds > MAX_PRESERVED_FDS - preserved_fd_count)
+		return -ENOMEM;
+	for (made = 0; made < nfds && !ret; made++) {
+		ends[made][0] = ends[made][1] = -1;
+		switch (fds[made].type) {
+		case MINIJAIL_FD_INHERIT:
+			ends[made][1] = fds[made].parent_fd;
+			break;
+		case MINIJAIL_FD_PIPE_IN:
+			if (pipe2(pair, O_CLOEXEC)) {
+				ret = -errno;
+				continue;
+			}
+			ends[made][0] = pair[1];
+			ends[made][1] = pair[0];
+			break;
+		case MINIJAIL_FD_PIPE_OUT:
+			if (pipe2(pair, O_CLOEXEC)) {
+				ret = -errno;
+				continue;
+			}
+			ends[made][0] = pair[0];
+			ends[made][1] = pair[1];
+			break;
+		case MINIJAIL_FD_SOCKETPAIR:
+			if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0,
+				       pair)) {
+				ret = -errno;
+				continue;
+			}
+			ends[made][0] = pair[0];
+			ends[made][1] = pair[1];
+			break;
+		default:
+			ret = -EINVAL;
+			continue;
+		}
+		ret = minijail_preserve_fd(j, ends[made][1],
+					   fds[made].child_fd);
 	}
 
-	if (setup_limits(j)) {
-		die("failed to set execution limits");
+	if (!ret) {
+		j->flags.close_open_fds = 1;
+		ret = minijail_run_pid_pipes(j, filename, argv, pchild_pid,
+					     NULL, NULL, NULL);
 	}
 
-	if (j->flags.meta_file) {
-		fclose(j->meta_file);
+	/* These fds are only for this run. */
+	j->preserved_fd_count = preserved_fd_count;
+	j->flags.close_open_fds = close_open_fds;
+	for (i = 0; i < made; i++) {
+		if (fds[i].type == MINIJAIL_FD_INHERIT)
+			continue;
+		if (ends[i][1] >= 0)
+			close(ends[i][1]);
+		if (ret && ends[i][0] >= 0)
+			close(ends[i][0]);
+		else if (!ret)
+			fds[i].parent_fd = ends[i][0];
 	}
-
-	_exit(execve(filename, argv, environ));
+	return ret;
 }
 
 int API minijail_kill(struct minijail *j)
@@ -1467,12 +2959,9 @@ int API minijail_kill(struct minijail *j)
 	return st;
 }
 
-int API minijail_wait(struct minijail *j)
+/* Turns the waitpid(2) status of |j|'s init into minijail_wait()'s result. */
+static int wait_result(const struct minijail *j, int st)
 {
-	int st;
-	if (waitpid(j->initpid, &st, 0) < 0)
-		return -errno;
-
 	if (!WIFEXITED(st)) {
 		int error_status = st;
 		if (WIFSIGNALED(st)) {
@@ -1503,27 +2992,732 @@ int API minijail_wait(struct minijail *j)
 	return exit_status;
 }
 
-void API minijail_destroy(struct minijail *j)
+/* Parses what init() wrote to the meta file of |j| into |meta|. */
+static int read_meta(const struct minijail *j, struct minijail_meta *meta)
 {
-	if (j->flags.seccomp_filter && j->filter_prog) {
-		free(j->filter_prog->filter);
-		free(j->filter_prog);
-	}
-	while (j->bindings_head) {
-		struct binding *b = j->bindings_head;
-		j->bindings_head = j->bindings_head->next;
-		free(b->dest);
-		free(b->src);
-		free(b);
+	char buf[512];
+	char *line, *saveptr = NULL;
+	ssize_t len;
+
+	memset(meta, 0, sizeof(*meta));
+	if (!j->flags.meta_file || !j->meta_file)
+		return -EINVAL;
+	len = pread(fileno(j->meta_file), buf, sizeof(buf) - 1, 0);
+	if (len < 0)
+		return -errno;
+	buf[len] = '\0';
+	for (line = strtok_r(buf, "\n", &saveptr); line;
+	     line = strtok_r(NULL, "\n", &saveptr)) {
+		char *value = strchr(line, ':');
+		if (!value)
+			continue;
+		*value++ = '\0';
+		if (!strcmp(line, "time"))
+			meta->time = strtoll(value, NULL, 10);
+		else if (!strcmp(line, "time-wall"))
+			meta->time_wall = strtoll(value, NULL, 10);
+		else if (!strcmp(line, "mem"))
+			meta->mem = strtoll(value, NULL, 10);
+		else if (!strcmp(line, "signal"))
+			meta->signal = atoi(value);
+		else if (!strcmp(line, "status"))
+			meta->status = atoi(value);
 	}
-	j->bindings_tail = NULL;
-	if (j->user)
-		free(j->user);
-	if (j->chrootdir)
-		free(j->chrootdir);
-	if (j->chdir)
-		free(j->chdir);
+	return 0;
+}
+
+int API minijail_wait(struct minijail *j)
+{
+	int st;
+	if (waitpid(j->initpid, &st, 0) < 0)
+		return -errno;
+	return wait_result(j, st);
+}
+
+int API minijail_pidfd(struct minijail *j)
+{
+	if (!j->initpid)
+		return -ECHILD;
+	return j->pidfd;
+}
+
+int API minijail_try_wait(struct minijail *j, int *status,
+			  struct minijail_meta *meta)
+{
+	int st;
+	pid_t pid = waitpid(j->initpid, &st, WNOHANG);
+	if (pid < 0)
+		return -errno;
+	if (pid == 0)
+		return 0;
+	if (status)
+		*status = wait_result(j, st);
+	if (meta)
+		read_meta(j, meta);
+	return 1;
+}
+
+/*
+ * Supervisor: one epoll instance watching the pidfd, wall-time timer and
+ * output pipes of each jail added to it.
+ */
+enum supervisor_source_kind {
+	SOURCE_EXIT,
+	SOURCE_TIMER,
+	SOURCE_OUTPUT,
+};
+
+struct minijail_capture {
+	int fd;
+	size_t limit;
+	size_t len;
+	int truncated;
+};
+
+struct minijail_compare {
+	const char *expected;
+	size_t expected_len;
+	int mode;
+	size_t pos;		/* next byte of |expected| to match */
+	size_t offset;		/* bytes of output seen */
+	int in_token;
+	int result;		/* 1: match, 0: mismatch, -1: not finished */
+};
+
+struct supervisor_source {
+	int fd;
+	enum supervisor_source_kind kind;
+	minijail_output_t output;
+	struct minijail_capture *capture;
+	struct minijail_compare *compare;
+	struct supervised_jail *owner;
+	struct supervisor_source *next;
+};
+
+struct supervised_jail {
+	struct minijail *j;
+	minijail_done_t done;
+	void *data;
+	struct timespec start;
+	int timed_out;
+	int output_exceeded;
+	int wrong_answer;
+	int finished;
+	struct supervisor_source exit_source;
+	struct supervisor_source timer_source;
+	struct supervisor_source *outputs;
+	struct supervised_jail *next;
+};
+
+struct minijail_supervisor {
+	int epfd;
+	size_t count;
+	struct supervised_jail *jails;
+};
+
+static int supervisor_watch(struct minijail_supervisor *s,
+			    struct supervisor_source *src)
+{
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = src;
+	if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, src->fd, &ev))
+		return -errno;
+	return 0;
+}
+
+static struct supervised_jail *supervisor_find(struct minijail_supervisor *s,
+					       const struct minijail *j)
+{
+	struct supervised_jail *sj;
+	for (sj = s->jails; sj; sj = sj->next) {
+		if (sj->j == j && !sj->finished)
+			return sj;
+	}
+	return NULL;
+}
+
+struct minijail_supervisor API *minijail_supervisor_new(void)
+{
+	struct minijail_supervisor *s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+	s->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (s->epfd < 0) {
+		free(s);
+		return NULL;
+	}
+	return s;
+}
+
+int API minijail_supervisor_fd(const struct minijail_supervisor *s)
+{
+	return s->epfd;
+}
+
+int API minijail_supervisor_add(struct minijail_supervisor *s,
+				struct minijail *j, minijail_done_t done,
+				void *data)
+{
+	struct supervised_jail *sj;
+	int pidfd = minijail_pidfd(j);
+	int ret;
+
+	if (pidfd < 0)
+		return pidfd;
+	if (supervisor_find(s, j))
+		return -EEXIST;
+	sj = calloc(1, sizeof(*sj));
+	if (!sj)
+		return -ENOMEM;
+	sj->j = j;
+	sj->done = done;
+	sj->data = data;
+	clock_gettime(CLOCK_MONOTONIC, &sj->start);
+	sj->exit_source.fd = pidfd;
+	sj->exit_source.kind = SOURCE_EXIT;
+	sj->exit_source.owner = sj;
+	sj->timer_source.fd = -1;
+	sj->timer_source.kind = SOURCE_TIMER;
+	sj->timer_source.owner = sj;
+
+	/*
+	 * Same deadline as init() uses, as a backstop for programs that
+	 * ignore the SIGALRM from setup_limits().
+	 */
+	if (j->flags.time_limit) {
+		struct itimerspec deadline;
+		long ms = j->time_limit + j->extra_wall_time + 1000L;
+		memset(&deadline, 0, sizeof(deadline));
+		deadline.it_value.tv_sec = ms / 1000;
+		deadline.it_value.tv_nsec = (ms % 1000) * 1000000L;
+		sj->timer_source.fd = timerfd_create(CLOCK_MONOTONIC,
+						     TFD_NONBLOCK | TFD_CLOEXEC);
+		if (sj->timer_source.fd < 0 ||
+		    timerfd_settime(sj->timer_source.fd, 0, &deadline, NULL)) {
+			ret = -errno;
+			goto error;
+		}
+		if ((ret = supervisor_watch(s, &sj->timer_source)))
+			goto error;
+	}
+	if ((ret = supervisor_watch(s, &sj->exit_source))) {
+		if (sj->timer_source.fd >= 0)
+			epoll_ctl(s->epfd, EPOLL_CTL_DEL, sj->timer_source.fd,
+				  NULL);
+		goto error;
+	}
+
+	sj->next = s->jails;
+	s->jails = sj;
+	s->count++;
+	return 0;
+
+error:
+	if (sj->timer_source.fd >= 0)
+		close(sj->timer_source.fd);
+	free(sj);
+	return ret;
+}
+
+static int supervisor_add_source(struct minijail_supervisor *s,
+				 struct minijail *j, int fd,
+				 minijail_output_t output,
+				 struct minijail_capture *capture,
+				 struct minijail_compare *compare)
+{
+	struct supervised_jail *sj = supervisor_find(s, j);
+	struct supervisor_source *src;
+	int flags;
+	int ret;
+
+	if (!sj)
+		return -ENOENT;
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK))
+		return -errno;
+	src = calloc(1, sizeof(*src));
+	if (!src)
+		return -ENOMEM;
+	src->fd = fd;
+	src->kind = SOURCE_OUTPUT;
+	src->output = output;
+	src->capture = capture;
+	src->compare = compare;
+	src->owner = sj;
+	if ((ret = supervisor_watch(s, src))) {
+		free(src);
+		return ret;
+	}
+	src->next = sj->outputs;
+	sj->outputs = src;
+	return 0;
+}
+
+int API minijail_supervisor_add_output(struct minijail_supervisor *s,
+				       struct minijail *j, int fd,
+				       minijail_output_t output)
+{
+	return supervisor_add_source(s, j, fd, output, NULL, NULL);
+}
+
+int API minijail_supervisor_add_capture(struct minijail_supervisor *s,
+					struct minijail *j, int fd,
+					struct minijail_capture *capture)
+{
+	return supervisor_add_source(s, j, fd, NULL, capture, NULL);
+}
+
+int API minijail_supervisor_add_compare(struct minijail_supervisor *s,
+					struct minijail *j, int fd,
+					struct minijail_compare *compare)
+{
+	return supervisor_add_source(s, j, fd, NULL, NULL, compare);
+}
+
+struct minijail_compare API *minijail_compare_new(int expected_fd, int mode)
+{
+	struct minijail_compare *c;
+	struct stat st;
+
+	if (mode != MINIJAIL_COMPARE_EXACT && mode != MINIJAIL_COMPARE_TOKENS)
+		return NULL;
+	if (fstat(expected_fd, &st))
+		return NULL;
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return NULL;
+	c->mode = mode;
+	c->result = -1;
+	c->expected_len = st.st_size;
+	/* mmap(2) refuses empty mappings; there is nothing to read anyway. */
+	if (c->expected_len) {
+		c->expected = mmap(NULL, c->expected_len, PROT_READ,
+				   MAP_PRIVATE, expected_fd, 0);
+		if (c->expected == MAP_FAILED) {
+			free(c);
+			return NULL;
+		}
+	}
+	return c;
+}
+
+int API minijail_compare_result(const struct minijail_compare *c,
+				size_t *offset)
+{
+	if (c->result == 0 && offset)
+		*offset = c->offset;
+	return c->result;
+}
+
+void API minijail_compare_destroy(struct minijail_compare *c)
+{
+	if (c->expected_len)
+		munmap((void *)c->expected, c->expected_len);
+	free(c);
+}
+
+/* Whether the expected output has a token character at |c->pos|. */
+static int compare_in_token(const struct minijail_compare *c)
+{
+	return c->pos < c->expected_len &&
+	       !isspace((unsigned char)c->expected[c->pos]);
+}
+
+/*
+ * Matches |len| more bytes of output. Returns 0 while they match, or -1
+ * once a mismatch is certain, with |c->offset| pointing at it.
+ */
+static int compare_feed(struct minijail_compare *c, const char *buf,
+			size_t len)
+{
+	size_t i;
+
+	if (c->result == 0)
+		return -1;
+	for (i = 0; i < len; i++, c->offset++) {
+		char ch = buf[i];
+		if (c->mode == MINIJAIL_COMPARE_EXACT) {
+			if (c->pos >= c->expected_len ||
+			    c->expected[c->pos] != ch)
+				goto mismatch;
+			c->pos++;
+			continue;
+		}
+		if (isspace((unsigned char)ch)) {
+			/* A token has to end where the expected one does. */
+			if (c->in_token && compare_in_token(c))
+				goto mismatch;
+			c->in_token = 0;
+			continue;
+		}
+		if (!c->in_token) {
+			while (c->pos < c->expected_len &&
+			       isspace((unsigned char)c->expected[c->pos]))
+				c->pos++;
+			c->in_token = 1;
+		}
+		if (!compare_in_token(c) || c->expected[c->pos] != ch)
+			goto mismatch;
+		c->pos++;
+	}
+	return 0;
+
+mismatch:
+	c->result = 0;
+	return -1;
+}
+
+/* Settles the result once the output is over. */
+static void compare_finish(struct minijail_compare *c)
+{
+	if (c->result != -1)
+		return;
+	if (c->mode == MINIJAIL_COMPARE_TOKENS) {
+		if (c->in_token && compare_in_token(c)) {
+			c->result = 0;
+			return;
+		}
+		while (c->pos < c->expected_len &&
+		       isspace((unsigned char)c->expected[c->pos]))
+			c->pos++;
+	}
+	c->result = c->pos == c->expected_len;
+}
+
+struct minijail_capture API *minijail_capture_new(size_t limit)
+{
+	struct minijail_capture *c = calloc(1, sizeof(*c));
+	if (!c)
+		return NULL;
+	c->fd = memfd_create("minijail-capture", MFD_CLOEXEC);
+	if (c->fd < 0) {
+		free(c);
+		return NULL;
+	}
+	c->limit = limit;
+	return c;
+}
+
+int API minijail_capture_fd(const struct minijail_capture *c)
+{
+	return c->fd;
+}
+
+size_t API minijail_capture_len(const struct minijail_capture *c)
+{
+	return c->len;
+}
+
+int API minijail_capture_truncated(const struct minijail_capture *c)
+{
+	return c->truncated;
+}
+
+void API minijail_capture_destroy(struct minijail_capture *c)
+{
+	close(c->fd);
+	free(c);
+}
+
+/*
+ * Kills a supervised jail. Runs without a pid namespace are in their own
+ * session, as set up before execve(2). Otherwise, killing init takes the
+ * rest with it.
+ */
+static void supervisor_kill(struct supervised_jail *sj)
+{
+	pid_t pid = sj->j->initpid;
+	if (kill(-pid, SIGKILL))
+		kill(pid, SIGKILL);
+}
+
+/*
+ * Appends |len| bytes to the capture of |src|. Going over the limit kills
+ * the jail, which is what RLIMIT_FSIZE does when writing to a file.
+ */
+static void capture_append(struct supervisor_source *src, const char *buf,
+			   size_t len)
+{
+	struct minijail_capture *c = src->capture;
+	ssize_t written;
+
+	if (c->truncated)
+		return;
+	if (len > c->limit - c->len) {
+		len = c->limit - c->len;
+		c->truncated = 1;
+		src->owner->output_exceeded = 1;
+		supervisor_kill(src->owner);
+	}
+	/* pwrite(2) leaves the offset at 0 for the reader. */
+	while (len > 0) {
+		written = pwrite(c->fd, buf, len, c->len);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			break;
+		buf += written;
+		len -= written;
+		c->len += written;
+	}
+}
+
+/* Feeds output to the comparator of |src|, killing the jail on a mismatch. */
+static void compare_append(struct supervisor_source *src, const char *buf,
+			   size_t len)
+{
+	struct supervised_jail *sj = src->owner;
+
+	/* Once the jail is being killed for something else, that is what sticks. */
+	if (sj->wrong_answer || sj->timed_out || sj->output_exceeded)
+		return;
+	if (compare_feed(src->compare, buf, len)) {
+		sj->wrong_answer = 1;
+		supervisor_kill(sj);
+	}
+}
+
+/*
+ * Closes |src|, which also ends the output for callbacks. Comparators are
+ * only settled by supervisor_finish(), once it is known whether the output
+ * ended because the program was done or because it was cut short.
+ */
+static void supervisor_close(struct minijail_supervisor *s,
+			     struct supervisor_source *src)
+{
+	struct supervised_jail *sj = src->owner;
+
+	if (src->output)
+		src->output(sj->j, src->fd, "", 0, sj->data);
+	/*
+	 * Closing is not enough: if another process still has the pipe open,
+	 * epoll would go on reporting it with |src| long freed.
+	 */
+	epoll_ctl(s->epfd, EPOLL_CTL_DEL, src->fd, NULL);
+	close(src->fd);
+	src->fd = -1;
+}
+
+/* Reads whatever is available on |src|, closing it at EOF. */
+static void supervisor_drain(struct minijail_supervisor *s,
+			     struct supervisor_source *src)
+{
+	struct supervised_jail *sj = src->owner;
+	char buf[4096];
+	ssize_t len;
+
+	while (src->fd >= 0) {
+		len = read(src->fd, buf, sizeof(buf));
+		if (len > 0) {
+			if (src->capture)
+				capture_append(src, buf, len);
+			else if (src->compare)
+				compare_append(src, buf, len);
+			else if (src->output)
+				src->output(sj->j, src->fd, buf, len, sj->data);
+			continue;
+		}
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0 && errno == EAGAIN)
+			return;
+		/* EOF or error: the caller sees a final zero-length read. */
+		supervisor_close(s, src);
+	}
+}
+
+static void supervisor_timeout(struct supervised_jail *sj)
+{
+	uint64_t expirations;
+
+	if (read(sj->timer_source.fd, &expirations, sizeof(expirations)) < 0)
+		return;
+	/* Already killed for a wrong answer, which is the verdict. */
+	if (sj->wrong_answer)
+		return;
+	sj->timed_out = 1;
+	supervisor_kill(sj);
+}
+
+static void supervisor_finish(struct minijail_supervisor *s,
+			      struct supervised_jail *sj)
+{
+	struct minijail *j = sj->j;
+	struct supervisor_source *src;
+	struct minijail_meta meta;
+	struct rusage usage;
+	struct timespec now;
+	int killed_for_wa;
+	int status;
+	int st;
+	pid_t pid;
+
+	pid = wait4(j->initpid, &st, WNOHANG, &usage);
+	if (pid == 0)
+		return;	/* Not exited after all. */
+	/* Draining what is left might still turn up a mismatch. */
+	killed_for_wa = sj->wrong_answer;
+
+	epoll_ctl(s->epfd, EPOLL_CTL_DEL, sj->exit_source.fd, NULL);
+	if (sj->timer_source.fd >= 0) {
+		epoll_ctl(s->epfd, EPOLL_CTL_DEL, sj->timer_source.fd, NULL);
+		close(sj->timer_source.fd);
+		sj->timer_source.fd = -1;
+	}
+	for (src = sj->outputs; src; src = src->next)
+		supervisor_drain(s, src);
+	for (src = sj->outputs; src; src = src->next) {
+		if (src->fd >= 0)
+			supervisor_close(s, src);
+	}
+
+	memset(&meta, 0, sizeof(meta));
+	if (pid < 0) {
+		status = -errno;
+	} else if (j->flags.pids && j->flags.meta_file) {
+		status = wait_result(j, st);
+		read_meta(j, &meta);
+	} else {
+		/* Without an init() of its own, account for the run here. */
+		status = wait_result(j, st);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		meta.time = 1000000LL * usage.ru_utime.tv_sec +
+			    usage.ru_utime.tv_usec;
+		meta.time_wall = 1000000LL * (now.tv_sec - sj->start.tv_sec) +
+				 (now.tv_nsec - sj->start.tv_nsec) / 1000;
+		meta.mem = usage.ru_maxrss * 1024LL;
+		if (sj->timed_out)
+			meta.signal = SIGXCPU;
+		else if (WIFSIGNALED(st))
+			meta.signal = WTERMSIG(st);
+		else
+			meta.status = WEXITSTATUS(st);
+	}
+	if (sj->output_exceeded && !sj->timed_out) {
+		meta.signal = SIGXFSZ;
+		meta.status = 0;
+	}
+	for (src = sj->outputs; src; src = src->next) {
+		if (!src->compare)
+			continue;
+		/*
+		 * Output that is merely missing its tail is only wrong if the
+		 * program got to finish it. Otherwise, a wrong answer is only
+		 * the verdict if it is what got the jail killed.
+		 */
+		if (pid > 0 && !meta.signal)
+			compare_finish(src->compare);
+		else if (!killed_for_wa)
+			continue;
+		if (src->compare->result == 0 && !meta.wrong_answer) {
+			meta.wrong_answer = 1;
+			meta.wrong_answer_offset = src->compare->offset;
+		}
+	}
+	if (meta.wrong_answer && j->meta_file) {
+		fseek(j->meta_file, 0, SEEK_END);
+		fprintf(j->meta_file, "verdict:WA\nwa-offset:%lld\n",
+			meta.wrong_answer_offset);
+		fflush(j->meta_file);
+	}
+
+	sj->finished = 1;
+	s->count--;
+	if (sj->done)
+		sj->done(j, status, &meta, sj->data);
+}
+
+static void supervisor_free(struct supervised_jail *sj)
+{
+	while (sj->outputs) {
+		struct supervisor_source *src = sj->outputs;
+		sj->outputs = src->next;
+		if (src->fd >= 0)
+			close(src->fd);
+		free(src);
+	}
+	if (sj->timer_source.fd >= 0)
+		close(sj->timer_source.fd);
+	free(sj);
+}
+
+int API minijail_supervisor_dispatch(struct minijail_supervisor *s,
+				     int timeout_ms)
+{
+	struct epoll_event events[32];
+	struct supervised_jail **pp;
+	int n, i;
+
+	if (!s->count)
+		return 0;
+	n = epoll_wait(s->epfd, events, sizeof(events) / sizeof(events[0]),
+		       timeout_ms);
+	if (n < 0)
+		return errno == EINTR ? (int)s->count : -errno;
+
+	for (i = 0; i < n; i++) {
+		struct supervisor_source *src = events[i].data.ptr;
+		/* Sources of jails finished earlier in this batch are gone. */
+		if (src->owner->finished || src->fd < 0)
+			continue;
+		switch (src->kind) {
+		case SOURCE_EXIT:
+			supervisor_finish(s, src->owner);
+			break;
+		case SOURCE_TIMER:
+			supervisor_timeout(src->owner);
+			break;
+		case SOURCE_OUTPUT:
+			supervisor_drain(s, src);
+			break;
+		}
+	}
+
+	/* Only free finished jails now that no event can refer to them. */
+	pp = &s->jails;
+	while (*pp) {
+		struct supervised_jail *sj = *pp;
+		if (sj->finished) {
+			*pp = sj->next;
+			supervisor_free(sj);
+		} else {
+			pp = &sj->next;
+		}
+	}
+	return s->count;
+}
+
+void API minijail_supervisor_destroy(struct minijail_supervisor *s)
+{
+	while (s->jails) {
+		struct supervised_jail *sj = s->jails;
+		s->jails = sj->next;
+		supervisor_free(sj);
+	}
+	close(s->epfd);
+	free(s);
+}
+
+void API minijail_destroy(struct minijail *j)
+{
+	struct minijail *tmpl = j->tmpl;
+
+	if (j->pidfd >= 0)
+		close(j->pidfd);
+	j->pidfd = -1;
+	/* The last of its duplicates to go frees it. */
+	if (j->dups) {
+		j->destroyed = 1;
+		return;
+	}
+
+	free_config(j);
 	free(j);
+
+	if (tmpl && --tmpl->dups == 0 && tmpl->destroyed)
+		minijail_destroy(tmpl);
 }
 
 int concat_path(char *buffer, size_t buffer_len, const char *path)
@@ -1548,12 +3742,101 @@ int concat_path(char *buffer, size_t buffer_len, const char *path)
 	return 0;
 }
 
-int API minijail_get_path(struct minijail *j, char *buffer, size_t buffer_len,
-			   const char *path)
+static int compare_path_prefix(const void *a, const void *b)
 {
-	struct stat st;
-	buffer[0] = '\0';
+	const struct path_prefix *pa = a, *pb = b;
+
+	if (pa->dest_len != pb->dest_len)
+		return pa->dest_len > pb->dest_len ? -1 : 1;
+	/* Same as walking the bindings: the first one added wins. */
+	return pa->order < pb->order ? -1 : 1;
+}
+
+static int build_path_table(struct minijail *j)
+{
+	struct path_prefix *table;
+	struct binding *b;
+	size_t i, n = 0;
+
+	table = calloc(j->binding_count + 1, sizeof(*table));
+	if (!table)
+		return -ENOMEM;
+	for (b = j->bindings_head; b; b = b->next, n++) {
+		table[n].dest = b->dest;
+		table[n].src = b->src;
+	}
+	/* Anything else is under the root of the jail. */
+	table[n].dest = "/";
+	table[n].src = j->flags.chroot ? j->chrootdir : "/";
+	n++;
+	for (i = 0; i < n; i++) {
+		table[i].dest_len = strlen(table[i].dest);
+		table[i].src_len = strlen(table[i].src);
+		/* Trim the trailing /, if any. */
+		if (table[i].src_len && table[i].src[table[i].src_len - 1] == '/')
+			table[i].src_len--;
+		table[i].order = i;
+	}
+	qsort(table, n, sizeof(*table), compare_path_prefix);
+	j->path_table = table;
+	j->path_table_len = n;
+	return 0;
+}
+
+/* Finds the longest binding |path| falls under, in a single pass. */
+static const struct path_prefix *find_path_prefix(const struct minijail *j,
+						  const char *path,
+						  size_t len)
+{
+	const struct path_prefix *p;
+	size_t i;
+
+	for (i = 0; i < j->path_table_len; i++) {
+		p = &j->path_table[i];
+		if (p->dest_len > len || memcmp(p->dest, path, p->dest_len))
+			continue;
+		/* Only match whole path components. */
+		if (p->dest_len == len || path[p->dest_len] == '/' ||
+		    p->dest[p->dest_len - 1] == '/')
+			return p;
+	}
+	return NULL;
+}
+
+/* Removes ".", ".." and repeated slashes from the absolute |path|. */
+static void normalize_path(char *path)
+{
+	const char *in = path;
+	char *out = path;
+
+	while (*in) {
+		const char *end;
+		size_t n;
+
+		while (*in == '/')
+			in++;
+		end = strchrnul(in, '/');
+		n = end - in;
+		if (n == 2 && in[0] == '.' && in[1] == '.') {
+			while (out > path && *--out != '/')
+				;
+		} else if (n && !(n == 1 && in[0] == '.')) {
+			*out++ = '/';
+			memmove(out, in, n);
+			out += n;
+		}
+		in = end;
+	}
+	if (out == path)
+		*out++ = '/';
+	*out = '\0';
+}
 
+/* Gets the absolute path of |path| as seen from inside the jail. */
+static int jail_path(struct minijail *j, char *buffer, size_t buffer_len,
+		     const char *path)
+{
+	buffer[0] = '\0';
 	// Get the absolute path of the file, including the chdir if this is a
 	// relative path.
 	if (path[0] != '/') {
@@ -1568,74 +3851,150 @@ int API minijail_get_path(struct minijail *j, char *buffer, size_t buffer_len,
 				return 1;
 		}
 	}
-	size_t len = strlen(buffer);
-	if (0 != concat_path(buffer, buffer_len - len, path))
+	if (0 != concat_path(buffer, buffer_len, path))
 		return 1;
-	len = strlen(buffer);
-
-	// Get the binding with the longest match.
-	struct binding *cur = j->bindings_head, *best = NULL;
-	size_t best_len = 0, mount_len = 0;
-	while (j->bindings_tail) {
-		mount_len = strlen(cur->dest);
-		if (strncmp(cur->dest, buffer, mount_len) == 0 && mount_len > best_len) {
-			best_len = mount_len;
-			best = cur;
-		}
-		if (cur == j->bindings_tail)
-			break;
-		cur = cur->next;
-	}
+	normalize_path(buffer);
+	return 0;
+}
 
-	const char* src_path = NULL;
-	if (best != NULL) {
-		src_path = best->src;
-	} else if (j->flags.chroot) {
-		src_path = j->chrootdir;
-		best_len = 1;
-	} else {
-		src_path = "/";
-		best_len = 1;
-	}
-	size_t src_len = strlen(src_path);
-	// Trim the trailing /, if any
-	if (src_path[src_len - 1] == '/') {
-		src_len--;
-	}
-	if (len - best_len + src_len + 2 >= buffer_len) {
+/* Maps the absolute path inside the jail |path| to the path outside. */
+static int host_path(struct minijail *j, char *buffer, size_t buffer_len,
+		     const char *path)
+{
+	const struct path_prefix *p;
+	const char *rest;
+	size_t rest_len;
+
+	if (!j->path_table && build_path_table(j))
+		return 1;
+	p = find_path_prefix(j, path, strlen(path));
+	if (!p)
+		return 1;
+	rest = path + p->dest_len;
+	while (*rest == '/')
+		rest++;
+	rest_len = strlen(rest);
+	if (p->src_len + rest_len + 2 > buffer_len) {
 		fprintf(stderr, "Not enough space\n");
 		return 1;
 	}
+	memcpy(buffer, p->src, p->src_len);
+	buffer[p->src_len] = '/';
+	memcpy(buffer + p->src_len + 1, rest, rest_len + 1);
+	return 0;
+}
 
-	memmove(buffer + src_len + 1, buffer + best_len, len - best_len);
-	strncpy(buffer, src_path, src_len);
-	buffer[src_len] = '/';
+static struct path_cache_entry *path_cache_find(const struct minijail *j,
+						 const char *path)
+{
+	size_t i;
 
-	if (lstat(buffer, &st) == -1) {
-		return 1;
+	if (!j->path_cache)
+		return NULL;
+	for (i = 0; i < PATH_CACHE_SIZE; i++) {
+		if (j->path_cache[i].path && !strcmp(j->path_cache[i].path, path))
+			return &j->path_cache[i];
 	}
+	return NULL;
+}
 
-	// Regular file. All is good.
-	if (S_ISREG(st.st_mode)) {
-		return 0;
-	}
+static void path_cache_drop(struct path_cache_entry *e)
+{
+	free(e->path);
+	free(e->resolved);
+	e->path = e->resolved = NULL;
+}
 
-	// Not a symbolic link. Disallowing.
-	if (!S_ISLNK(st.st_mode)) {
-		return 1;
+/* Best effort: running out of memory just means no caching. */
+static void path_cache_add(struct minijail *j, const char *path,
+			   const char *resolved)
+{
+	struct path_cache_entry *e;
+
+	if (!j->path_cache) {
+		j->path_cache = calloc(PATH_CACHE_SIZE, sizeof(*j->path_cache));
+		if (!j->path_cache)
+			return;
 	}
+	e = &j->path_cache[j->path_cache_next];
+	j->path_cache_next = (j->path_cache_next + 1) % PATH_CACHE_SIZE;
+	path_cache_drop(e);
+	e->path = strdup(path);
+	e->resolved = strdup(resolved);
+	if (!e->path || !e->resolved)
+		path_cache_drop(e);
+}
+
+/* Same limit as the kernel's, so that symlink loops end. */
+#define MAX_SYMLINK_HOPS 40
 
-	char linkpath[PATH_MAX+1];
+int API minijail_get_path(struct minijail *j, char *buffer, size_t buffer_len,
+			   const char *path)
+{
+	char key[PATH_MAX + 1];
+	char current[PATH_MAX + 1];
+	char linkpath[PATH_MAX + 1];
+	struct path_cache_entry *cached;
 	ssize_t linklen;
-	linklen = readlink(buffer, linkpath, sizeof(linkpath) - 1);
-	if (linklen == -1) {
-		fprintf(stderr, "Invalid symlink\n");
+	struct stat st;
+	int hops;
+
+	if (jail_path(j, key, sizeof(key), path))
 		return 1;
+	/*
+	 * The host path may have been replaced, say by a symlink that the host
+	 * would follow outside of the bindings, since it was cached.
+	 */
+	cached = path_cache_find(j, key);
+	if (cached && !lstat(cached->resolved, &st) && S_ISREG(st.st_mode)) {
+		if (strlen(cached->resolved) >= buffer_len)
+			return 1;
+		strcpy(buffer, cached->resolved);
+		return 0;
 	}
-	linkpath[linklen] = '\0';
+	if (cached)
+		path_cache_drop(cached);
+
+	strcpy(current, key);
+	for (hops = 0; hops < MAX_SYMLINK_HOPS; hops++) {
+		if (host_path(j, buffer, buffer_len, current))
+			return 1;
+
+		if (lstat(buffer, &st) == -1) {
+			return 1;
+		}
 
-	// Recursively try to figure out the real path.
-	return minijail_get_path(j, buffer, buffer_len, linkpath);
+		// Regular file. All is good.
+		if (S_ISREG(st.st_mode)) {
+			path_cache_add(j, key, buffer);
+			return 0;
+		}
+
+		// Not a symbolic link. Disallowing.
+		if (!S_ISLNK(st.st_mode)) {
+			return 1;
+		}
+
+		linklen = readlink(buffer, linkpath, sizeof(linkpath) - 1);
+		if (linklen == -1) {
+			fprintf(stderr, "Invalid symlink\n");
+			return 1;
+		}
+		linkpath[linklen] = '\0';
+
+		// Relative links are relative to the directory holding them.
+		if (linkpath[0] != '/') {
+			*strrchr(current, '/') = '\0';
+			if (0 != concat_path(current, sizeof(current), "/") ||
+			    0 != concat_path(current, sizeof(current),
+					     linkpath))
+				return 1;
+		} else {
+			strcpy(current, linkpath);
+		}
+		normalize_path(current);
+	}
+	return 1;
 }
 
 /* The following are only used for omegaUp */
@@ -1671,7 +4030,8 @@ void API minijail_memory_limit(struct minijail *j, int byte_limit)
 int API minijail_meta_file(struct minijail *j, const char *meta_path)
 {
 	j->flags.meta_file = 1;
-	j->meta_file = fopen(meta_path, "w");
+	/* Readable, so that minijail_try_wait() can parse it. */
+	j->meta_file = fopen(meta_path, "w+e");
 	if (j->meta_file == NULL) {
 		return -1;
 	}
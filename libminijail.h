@@ -27,6 +27,13 @@ enum {
 	MINIJAIL_ERR_INIT = 254,
 };
 
+/* Options for the /proc mounted when remounting readonly. */
+enum {
+	MINIJAIL_PROC_NONE = 1 << 0,		/* don't mount /proc at all */
+	MINIJAIL_PROC_HIDEPID = 1 << 1,		/* hidepid=invisible */
+	MINIJAIL_PROC_SUBSET_PID = 1 << 2,	/* subset=pid */
+};
+
 struct minijail;
 
 /* Allocates a new minijail with no restrictions. */
@@ -45,16 +52,27 @@ int minijail_change_group(struct minijail *j, const char *group);
 void minijail_use_seccomp(struct minijail *j);
 void minijail_no_new_privs(struct minijail *j);
 void minijail_use_seccomp_filter(struct minijail *j);
+/* Enters the whole jail right before execve(2) in minijail_run*(), instead of
+ * injecting libminijailpreload.so into the program to do it after. This
+ * works for any binary and saves the preload library's startup cost, but the
+ * seccomp filter is then in force during execve(2): its policy has to allow
+ * execve and, for dynamically-linked programs, the loader's system calls.
+ * Capabilities are kept across execve(2) as ambient capabilities (Linux 4.3).
+ */
+void minijail_no_preload(struct minijail *j);
 void minijail_parse_seccomp_filters(struct minijail *j, const char *path);
 void minijail_log_seccomp_filter_failures(struct minijail *j);
 void minijail_use_caps(struct minijail *j, uint64_t capmask);
 void minijail_namespace_vfs(struct minijail *j);
 void minijail_namespace_net(struct minijail *j);
-/* Implies namespace_vfs and remount_readonly.
- * WARNING: this is NOT THREAD SAFE. See the block comment in </libminijail.c>.
- */
+/* Implies namespace_vfs and remount_readonly. */
 void minijail_namespace_pids(struct minijail *j);
 void minijail_remount_readonly(struct minijail *j);
+/* Sets the MINIJAIL_PROC_* @options for the /proc mounted by
+ * minijail_remount_readonly(). Jails that don't need /proc can skip the
+ * mount entirely with MINIJAIL_PROC_NONE.
+ */
+void minijail_proc_options(struct minijail *j, int options);
 void minijail_inherit_usergroups(struct minijail *j);
 void minijail_disable_ptrace(struct minijail *j);
 
@@ -72,9 +90,34 @@ int minijail_enter_chroot(struct minijail *j, const char *dir);
 
 /* minijail_mount_tmp: enables mounting of a tmpfs filesystem on /tmp.
  * As be rules of bind mounts, /tmp must exist in chroot.
+ * Implies namespace_vfs.
  */
 void minijail_mount_tmp(struct minijail *j);
 
+/* minijail_mount_tmp_size: like minijail_mount_tmp(), capped at @size bytes
+ * @j    minijail to apply restriction to
+ * @size maximum size of the tmpfs, or 0 for the default of 128M
+ */
+void minijail_mount_tmp_size(struct minijail *j, size_t size);
+
+/* minijail_scratch: makes @dir writable for the duration of each run
+ * @j    minijail to apply restriction to
+ * @dir  directory to make writable (inside chroot), expressed as an absolute
+ *       path. Owned by caller.
+ * @size maximum number of bytes that can be written to @dir
+ *
+ * Stacks an overlayfs on @dir whose upper layer lives on a private tmpfs of
+ * @size bytes, so the jailed process sees the original contents and can
+ * modify them without touching the underlying directory. Nothing is
+ * mounted unless this is called. When a meta file is in use, the bytes
+ * left on /tmp and the scratch when the jail exits are reported as "tmp:"
+ * and "scratch:". @dir must not be the destination of a binding.
+ * Implies namespace_vfs.
+ *
+ * Returns 0 on success.
+ */
+int minijail_scratch(struct minijail *j, const char *dir, size_t size);
+
 /* minijail_chroot_chdir: calls chdir() after chroot() restriction for @j
  * @j   minijail to apply restriction to
  * @dir directory to chdir() to. Owned by caller.
@@ -99,6 +142,133 @@ int minijail_chroot_chdir(struct minijail *j, const char *dir);
 int minijail_bind(struct minijail *j, const char *src, const char *dest,
 		  int writeable);
 
+/* minijail_preserve_fd: gives @parent_fd to each run as @child_fd
+ * @j         minijail to set up
+ * @parent_fd fd to pass on. Owned by caller, and must stay open while @j is
+ *            used to run programs.
+ * @child_fd  fd number the program gets it as
+ *
+ * Implies minijail_close_open_fds(), so the fds given this way and stdio are
+ * all the program starts with. Up to 32 fds can be given.
+ *
+ * Returns 0 on success, -EINVAL if @child_fd is already taken, or -ENOMEM if
+ * there are too many.
+ */
+int minijail_preserve_fd(struct minijail *j, int parent_fd, int child_fd);
+
+/* Keeps the program run in @j from inheriting any fd other than stdio and
+ * those given with minijail_preserve_fd(), however many the caller has open.
+ */
+void minijail_close_open_fds(struct minijail *j);
+
+/* minijail_stdin_fd: feeds standard input from @fd in each run
+ * @j  minijail to set up
+ * @fd regular file or memfd holding the input. Owned by caller, and must
+ *     stay open while @j is used to run programs.
+ *
+ * Every run gets its own read-only file description of @fd, so it starts
+ * reading at the beginning no matter what other runs do, and the input is
+ * read straight from the page cache rather than copied through a pipe.
+ * Can't be combined with a @pstdin_fd from minijail_run_pid_pipes().
+ *
+ * Returns 0 on success, or -EINVAL if @fd isn't a regular file.
+ */
+int minijail_stdin_fd(struct minijail *j, int fd);
+
+/* Starts reading @fd into the page cache in the background, so that the next
+ * run doesn't wait for the disk. Meant for the upcoming test input while
+ * the current one runs. Returns 0 on success, or a negative errno.
+ */
+int minijail_prefetch_input(int fd);
+
+/* Copies the regular file @fd into a memfd, sealed against any further
+ * change, and returns it or a negative errno. The memfd stays in memory and
+ * can be passed to minijail_stdin_fd() for as many runs as needed. Owned by
+ * caller.
+ */
+int minijail_input_memfd(int fd);
+
+/* minijail_build_mount_template: prebuilds the chroot mount tree for @j
+ * @j minijail to build the template for
+ *
+ * Clones the chroot directory and every binding made so far into a detached
+ * mount tree. As when bindings are mounted one by one, mounts under the
+ * source of a binding are not included. Each run then attaches a copy of it
+ * with a single open_tree()/move_mount() pair instead of remounting every
+ * binding. Bindings added afterwards, such as a run's own on a
+ * minijail_clone_template() copy, are still mounted one by one on top of it.
+ * Requires minijail_enter_chroot(), CAP_SYS_ADMIN and Linux 6.15 or later.
+ *
+ * Returns 0 on success, or a negative errno, in which case @j is unchanged
+ * and the bindings are mounted one by one as usual.
+ */
+int minijail_build_mount_template(struct minijail *j);
+
+/* Flags for minijail_parse_profile(). */
+enum {
+	MINIJAIL_PROFILE_UNPRIVILEGED = 1 << 0,	/* no uid=, gid= or caps= */
+};
+
+/* minijail_parse_profile: configures @j from a profile file
+ * @j    minijail to configure
+ * @path profile file
+ * @name profile to use from it
+ * @flags MINIJAIL_PROFILE_* flags
+ *
+ * A profile file holds any number of profiles, each a "[name]" line followed
+ * by one "key" or "key=value" setting per line. Anything after '#' or ';' is
+ * a comment. The settings are:
+ *   pids, vfs, net, readonly, no-new-privs, no-preload: the matching
+ *     minijail_namespace_*(), minijail_remount_readonly(),
+ *     minijail_no_new_privs() and minijail_no_preload() calls
+ *   chroot=<dir>, chdir=<dir>, bind=<src>,<dest>[,<writeable>],
+ *     scratch=<dir>,<size>, tmp=<size>, policy=<file>, uid=<uid>, gid=<gid>,
+ *     caps=<mask>: the matching setters
+ *   stack=, time=, wall-time=, output=, memory=: the omegaUp limits
+ *   mount-template: minijail_build_mount_template() once the rest is applied,
+ *     which needs CAP_SYS_ADMIN while parsing; if that fails, a warning is
+ *     logged and bindings are mounted one by one as usual
+ *
+ * Meant to be parsed once into a template jail, from which each run gets its
+ * own with minijail_clone_template().
+ *
+ * With MINIJAIL_PROFILE_UNPRIVILEGED, for a profile chosen by a caller that
+ * may not pick who the program runs as, uid=, gid= and caps= are -EPERM.
+ *
+ * Returns 0 on success, -ENOENT if there is no such profile, or another
+ * negative errno, in which case @j may be partially configured. Unlike the
+ * setters, a uid or gid of 0 or a policy that can't be read or compiled is
+ * -EINVAL rather than fatal.
+ */
+int minijail_parse_profile(struct minijail *j, const char *path,
+			   const char *name, int flags);
+
+/* minijail_clone_template: copies a configured jail for a new run
+ * @j jail to copy; it must not have been run
+ *
+ * The copy shares the prebuilt mount tree of @j, if any, but not the meta
+ * file, the minijail_stdin_fd() input or the minijail_preserve_fd() fds,
+ * which are set per run. Returns NULL
+ * if out of memory.
+ */
+struct minijail *minijail_clone_template(const struct minijail *j);
+
+/* minijail_dup: cheaply duplicates a configured jail for a new run
+ * @j jail to duplicate
+ *
+ * Unlike minijail_clone_template(), the duplicate shares the bindings, chroot
+ * and other paths, seccomp filter and mount template of @j instead of copying
+ * them, so it takes a single allocation. Limits and flags are copied; the meta
+ * file, minijail_stdin_fd() input, minijail_preserve_fd() fds and run state
+ * are not. The duplicate can
+ * still be changed (e.g. more bindings), which copies what it changes. @j
+ * itself can't be reconfigured while it has duplicates, and is only freed
+ * once minijail_destroy() has been called on it and all of them.
+ *
+ * Returns NULL if out of memory.
+ */
+struct minijail *minijail_dup(struct minijail *j);
+
 /* Lock this process into the given minijail. Note that this procedure cannot fail,
  * since there is no way to undo privilege-dropping; therefore, if any part of
  * the privilege-drop fails, minijail_enter() will abort the entire process.
@@ -106,16 +276,20 @@ int minijail_bind(struct minijail *j, const char *src, const char *dest,
  * Some restrictions cannot be enabled this way (pid namespaces) and attempting
  * to do so will cause an abort.
  */
-void minijail_enter(const struct minijail *j);
+void minijail_enter(struct minijail *j);
 
 /* Run the specified command in the given minijail, execve(3)-style. This is
  * required if minijail_namespace_pids() was used.
+ *
+ * The minijail_run*() functions leave the caller's environment alone and can
+ * be called from several threads at once, as long as each thread uses its
+ * own minijail.
  */
 int minijail_run(struct minijail *j, const char *filename,
 		 char *const argv[]);
 
 /* Run the specified command in the given minijail, execve(3)-style.
- * Used with static binaries.
+ * Used with static binaries; implies minijail_no_preload() for this run only.
  */
 int minijail_run_static(struct minijail *j, const char *filename,
 			char *const argv[]);
@@ -155,6 +329,43 @@ int minijail_run_pid_pipes(struct minijail *j, const char *filename,
 			   char *const argv[], pid_t *pchild_pid,
 			   int *pstdin_fd, int *pstdout_fd, int *pstderr_fd);
 
+/* What minijail_run_fds() connects each fd of the child to. */
+enum minijail_fd_type {
+	MINIJAIL_FD_INHERIT,	/* the caller's |parent_fd| */
+	MINIJAIL_FD_PIPE_IN,	/* a new pipe the child reads from */
+	MINIJAIL_FD_PIPE_OUT,	/* a new pipe the child writes to */
+	MINIJAIL_FD_SOCKETPAIR,	/* a new stream socket pair, both ways */
+};
+
+struct minijail_fd {
+	int child_fd;
+	enum minijail_fd_type type;
+	/*
+	 * For MINIJAIL_FD_INHERIT, the fd to pass on, which stays the
+	 * caller's. Otherwise set by minijail_run_fds() to the caller's end of
+	 * the new pipe or socket pair, which the caller must close.
+	 */
+	int parent_fd;
+};
+
+/* Run the specified command in the given minijail, execve(3)-style, with
+ * its fds wired up as @fds says.
+ * Update |*pchild_pid| with the pid of the child.
+ *
+ * The child gets stdio, the fds from minijail_preserve_fd() and @fds, and
+ * nothing else; @fds can replace stdio, but not minijail_preserve_fd() fds.
+ * The caller's ends of new pipes and socket pairs are close-on-exec, so they
+ * can be passed to another run with MINIJAIL_FD_INHERIT to connect two jails
+ * directly, without leaking into any other. Up to 32 fds can be given,
+ * minijail_preserve_fd() ones included.
+ *
+ * Returns 0 on success, or a negative errno, in which case no pipe or socket
+ * pair is left open.
+ */
+int minijail_run_fds(struct minijail *j, const char *filename,
+		     char *const argv[], pid_t *pchild_pid,
+		     struct minijail_fd *fds, size_t nfds);
+
 /* Kill the specified minijail. The minijail must have been created with pid
  * namespacing; if it was, all processes inside it are atomically killed.
  */
@@ -165,6 +376,144 @@ int minijail_kill(struct minijail *j);
  */
 int minijail_wait(struct minijail *j);
 
+/* Returns a pidfd for the init of the last run of @j, or a negative errno.
+ * It becomes readable once the jail exits, so it can be added to poll(2) or
+ * epoll(7) sets to supervise many jails from one thread. Owned by @j, and
+ * only valid until the next run.
+ */
+int minijail_pidfd(struct minijail *j);
+
+/* What init() wrote to the meta file, see minijail_meta_file(). */
+struct minijail_meta {
+	long long time;		/* CPU time, in microseconds */
+	long long time_wall;	/* wall time, in microseconds */
+	long long mem;		/* peak resident set size, in bytes */
+	int signal;		/* fatal signal, or 0 */
+	int status;		/* exit status if |signal| is 0 */
+	/* Set by the supervisor's comparators; see minijail_compare_new(). */
+	int wrong_answer;
+	long long wrong_answer_offset;
+};
+
+/* minijail_try_wait: reaps the jail if it has exited, without blocking
+ * @j      minijail to check
+ * @status set to what minijail_wait() would return. May be NULL.
+ * @meta   filled in from the meta file, or zeroed if there is none. May be
+ *         NULL.
+ *
+ * Returns 1 if the jail exited and was reaped, 0 if it is still running, or
+ * a negative errno.
+ */
+int minijail_try_wait(struct minijail *j, int *status,
+		      struct minijail_meta *meta);
+
+/* A supervisor waits for many running jails from a single thread. */
+struct minijail_supervisor;
+
+/* Called once the jail has exited, with what minijail_try_wait() returns.
+ * Without a pid namespace, @meta is filled in by the supervisor itself.
+ */
+typedef void (*minijail_done_t)(struct minijail *j, int status,
+				const struct minijail_meta *meta, void *data);
+/* Called with output read from a watched fd. A zero @len means EOF. */
+typedef void (*minijail_output_t)(struct minijail *j, int fd, const char *buf,
+				  size_t len, void *data);
+
+struct minijail_supervisor *minijail_supervisor_new(void);
+
+/* Returns an fd that becomes readable when there is something to dispatch,
+ * for nesting the supervisor into another event loop.
+ */
+int minijail_supervisor_fd(const struct minijail_supervisor *s);
+
+/* minijail_supervisor_add: starts supervising a running jail
+ * @s    supervisor
+ * @j    minijail started with one of the minijail_run*() functions.
+ *       Owned by caller, and must outlive the supervision.
+ * @done called once @j exits and has been reaped
+ * @data passed to @done and to output callbacks
+ *
+ * If @j has a time limit, it is killed once its wall time runs out, just
+ * like init() does for pid-namespaced jails.
+ *
+ * Returns 0 on success, or a negative errno (-ENOSYS without pidfds).
+ */
+int minijail_supervisor_add(struct minijail_supervisor *s, struct minijail *j,
+			    minijail_done_t done, void *data);
+
+/* Reads @fd, typically a pipe from minijail_run_pid_pipes(), as data
+ * arrives, passing it to @output. The supervisor takes ownership of @fd and
+ * closes it at EOF or once @j is done. Any output still buffered when @j
+ * exits is delivered before its done callback.
+ */
+int minijail_supervisor_add_output(struct minijail_supervisor *s,
+				   struct minijail *j, int fd,
+				   minijail_output_t output);
+
+/* A bounded in-memory capture of a jail's output, backed by a memfd. */
+struct minijail_capture;
+
+/* Returns a capture that holds up to @limit bytes, or NULL. */
+struct minijail_capture *minijail_capture_new(size_t limit);
+/* The memfd holding the output. Its offset stays at 0, so it can be read,
+ * mmap()ed or passed on directly. Owned by @c.
+ */
+int minijail_capture_fd(const struct minijail_capture *c);
+size_t minijail_capture_len(const struct minijail_capture *c);
+/* Whether the output went over the limit, which kills the jail. */
+int minijail_capture_truncated(const struct minijail_capture *c);
+void minijail_capture_destroy(struct minijail_capture *c);
+
+/* Like minijail_supervisor_add_output(), but stores the output in @capture.
+ * If @j writes more than its limit, the excess is dropped, @j is killed and
+ * its meta data reports SIGXFSZ, as if RLIMIT_FSIZE had been hit writing to
+ * a file. @capture is owned by the caller and outlives the supervision.
+ */
+int minijail_supervisor_add_capture(struct minijail_supervisor *s,
+				    struct minijail *j, int fd,
+				    struct minijail_capture *capture);
+
+/* Comparison modes for minijail_compare_new(). */
+enum {
+	MINIJAIL_COMPARE_EXACT = 0,	/* byte for byte */
+	MINIJAIL_COMPARE_TOKENS = 1,	/* same tokens, any whitespace */
+};
+
+/* Compares a jail's output against what is expected while it runs. */
+struct minijail_compare;
+
+/* Returns a comparator against the contents of @expected_fd, which are
+ * mmap()ed, or NULL. @expected_fd may be closed afterwards.
+ */
+struct minijail_compare *minijail_compare_new(int expected_fd, int mode);
+/* Returns 1 if the output matched, -1 if it hasn't finished yet, or 0 if it
+ * differs, in which case @offset (if not NULL) is set to the byte offset in
+ * the output where that became certain. Output that is only missing its end
+ * stays at -1 if the jail was killed or crashed before finishing it.
+ */
+int minijail_compare_result(const struct minijail_compare *c, size_t *offset);
+void minijail_compare_destroy(struct minijail_compare *c);
+
+/* Like minijail_supervisor_add_output(), but streams the output through
+ * @compare. As soon as it can't match, @j is killed rather than left to run
+ * until its time limit. The meta data then reports wrong_answer, and
+ * "verdict:WA" and "wa-offset:" are appended to the meta file, if any. A run
+ * that ends in a timeout or another signal first is not a wrong answer.
+ * @compare is owned by the caller and outlives the supervision.
+ */
+int minijail_supervisor_add_compare(struct minijail_supervisor *s,
+				    struct minijail *j, int fd,
+				    struct minijail_compare *compare);
+
+/* Waits up to @timeout_ms (-1 for no limit) for events and dispatches them.
+ * Returns the number of jails still running, or a negative errno.
+ */
+int minijail_supervisor_dispatch(struct minijail_supervisor *s,
+				 int timeout_ms);
+
+/* Stops supervising all jails, which are left running, and frees @s. */
+void minijail_supervisor_destroy(struct minijail_supervisor *s);
+
 /* Frees the given minijail. It does not matter if the process is inside the minijail or
  * not. */
 void minijail_destroy(struct minijail *j);
@@ -7,7 +7,13 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 
+#include <sys/mount.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
@@ -139,10 +145,75 @@ TEST_F(marshal, empty) {
 
 TEST_F(marshal, 0xff) {
   memset(self->buf, 0xff, sizeof(self->buf));
-  /* Should fail on the first consumestr since a NUL will never be found. */
+  /* Should fail on the header since the magic won't match. */
   EXPECT_EQ(-EINVAL, minijail_unmarshal(self->j, self->buf, sizeof(self->buf)));
 }
 
+TEST_F(marshal, round_trip) {
+  char copy[4096];
+  char *wire;
+  struct minijail *k = minijail_new();
+
+  minijail_change_uid(self->m, 1000);
+  minijail_use_caps(self->m, 0x5);
+  ASSERT_EQ(0, minijail_enter_chroot(self->m, "/var/empty"));
+  ASSERT_EQ(0, minijail_chroot_chdir(self->m, "/home"));
+  ASSERT_EQ(0, minijail_bind(self->m, "/usr/lib", "/lib", 0));
+  ASSERT_EQ(0, minijail_bind(self->m, "/tmp", "/home", 1));
+  self->size = minijail_size(self->m);
+  ASSERT_EQ(0, minijail_marshal(self->m, self->buf, sizeof(self->buf)));
+
+  /* Decoding and encoding again gives back the same bytes. */
+  ASSERT_EQ(0, minijail_unmarshal(self->j, self->buf, self->size));
+  ASSERT_EQ(self->size, minijail_size(self->j));
+  ASSERT_EQ(0, minijail_marshal(self->j, copy, sizeof(copy)));
+  EXPECT_EQ(0, memcmp(self->buf, copy, self->size));
+
+  /* Also when the jail points into the buffer instead. */
+  ASSERT_TRUE(k != NULL);
+  wire = malloc(self->size);
+  ASSERT_TRUE(wire != NULL);
+  memcpy(wire, self->buf, self->size);
+  ASSERT_EQ(0, minijail_unmarshal_inplace(k, wire, self->size));
+  memset(copy, 0, sizeof(copy));
+  ASSERT_EQ(0, minijail_marshal(k, copy, sizeof(copy)));
+  EXPECT_EQ(0, memcmp(self->buf, copy, self->size));
+  minijail_destroy(k);
+}
+
+TEST_F(marshal, truncated) {
+  size_t len;
+
+  ASSERT_EQ(0, minijail_enter_chroot(self->m, "/var/empty"));
+  ASSERT_EQ(0, minijail_bind(self->m, "/usr/lib", "/lib", 0));
+  self->size = minijail_size(self->m);
+  ASSERT_EQ(0, minijail_marshal(self->m, self->buf, sizeof(self->buf)));
+  for (len = 0; len < self->size; len++)
+    EXPECT_EQ(-EINVAL, minijail_unmarshal(self->j, self->buf, len));
+  EXPECT_EQ(0, minijail_unmarshal(self->j, self->buf, self->size));
+}
+
+TEST_F(marshal, unknown_tags) {
+  struct marshal_header hdr;
+  struct marshal_record rec = { .tag = 0x7f00, .length = 8 };
+
+  /* Append a record from some newer library, then fix up the length. */
+  ASSERT_EQ(0, minijail_marshal(self->m, self->buf, sizeof(self->buf)));
+  memcpy(self->buf + self->size, &rec, sizeof(rec));
+  memset(self->buf + self->size + sizeof(rec), 0, rec.length);
+  self->size += sizeof(rec) + rec.length;
+  memcpy(&hdr, self->buf, sizeof(hdr));
+  hdr.length = self->size;
+  memcpy(self->buf, &hdr, sizeof(hdr));
+  EXPECT_EQ(0, minijail_unmarshal(self->j, self->buf, self->size));
+
+  /* Unless the jail isn't safe to enter without understanding it. */
+  rec.tag |= MARSHAL_REQUIRED;
+  memcpy(self->buf + self->size - sizeof(rec) - rec.length, &rec,
+         sizeof(rec));
+  EXPECT_EQ(-EINVAL, minijail_unmarshal(self->j, self->buf, self->size));
+}
+
 TEST(test_minijail_run_pid_pipe) {
   pid_t pid;
   int child_stdin;
@@ -219,4 +290,1056 @@ TEST(test_minijail_run_pid_pipes) {
   minijail_destroy(j);
 }
 
+#define RUN_THREADS 4
+#define RUNS_PER_THREAD 6
+
+/*
+ * Runs a few jails, each echoing back its input and then lingering with
+ * stdout closed. Returns how many of them didn't give back their input and
+ * EOF in time: a run that inherited another's pipes keeps them open.
+ */
+static void *run_jails(void *arg)
+{
+  long id = (long)arg;
+  long failures = 0;
+  int run;
+  char *argv[] = { "/bin/sh", "-c",
+                   "read x && echo \"$x $RUN_MARK\" && "
+                   "exec sleep 0.5 >&- 2>&-", NULL };
+
+  for (run = 0; run < RUNS_PER_THREAD; run++) {
+    char expected[32], buf[64];
+    size_t len = 0;
+    ssize_t bytes = 1;
+    pid_t pid;
+    int child_stdin, child_stdout, status;
+    struct pollfd pfd;
+    struct minijail *j = minijail_new();
+
+    minijail_no_preload(j);
+    snprintf(expected, sizeof(expected), "t%ld.%d mark\n", id, run);
+    if (minijail_run_pid_pipes(j, argv[0], argv, &pid, &child_stdin,
+                               &child_stdout, NULL)) {
+      failures++;
+      minijail_destroy(j);
+      continue;
+    }
+    if (write(child_stdin, expected, strcspn(expected, " ")) < 0 ||
+        write(child_stdin, "\n", 1) != 1)
+      failures++;
+    close(child_stdin);
+    pfd.fd = child_stdout;
+    pfd.events = POLLIN;
+    while (bytes > 0 && len < sizeof(buf) &&
+           poll(&pfd, 1, 250) == 1) {
+      bytes = read(child_stdout, buf + len, sizeof(buf) - len);
+      if (bytes > 0)
+        len += bytes;
+    }
+    /* Stopped on EOF, rather than on the timeout. */
+    if (bytes != 0 || len != strlen(expected) ||
+        memcmp(buf, expected, len))
+      failures++;
+    close(child_stdout);
+    waitpid(pid, &status, 0);
+    minijail_destroy(j);
+  }
+  return (void *)failures;
+}
+
+TEST(test_minijail_run_concurrently) {
+  pthread_t threads[RUN_THREADS];
+  void *failures;
+  long i;
+
+  unsetenv(kLdPreloadEnvVar);
+  setenv("RUN_MARK", "mark", 1);
+  for (i = 0; i < RUN_THREADS; i++)
+    ASSERT_EQ(pthread_create(&threads[i], NULL, run_jails, (void *)i), 0);
+  for (i = 0; i < RUN_THREADS; i++) {
+    ASSERT_EQ(pthread_join(threads[i], &failures), 0);
+    EXPECT_EQ((long)failures, 0);
+  }
+
+  /* Runs build the child's environment without touching ours. */
+  EXPECT_STREQ(getenv("RUN_MARK"), "mark");
+  EXPECT_EQ(getenv(kLdPreloadEnvVar), NULL);
+  EXPECT_EQ(getenv(kFdEnvVar), NULL);
+  unsetenv("RUN_MARK");
+}
+
+TEST(test_minijail_no_preload) {
+  pid_t pid;
+  int status;
+  /* no_new_privs is set before execve, with no preload library around. */
+  char *argv[] = { "/bin/sh", "-c",
+                   "test -z \"$LD_PRELOAD$__MINIJAIL_FD\" && "
+                   "grep -q '^NoNewPrivs:.*1' /proc/self/status", NULL };
+
+  unsetenv(kLdPreloadEnvVar);
+  struct minijail *j = minijail_new();
+  minijail_no_new_privs(j);
+  minijail_no_preload(j);
+  EXPECT_EQ(minijail_run_pid(j, argv[0], argv, &pid), 0);
+  waitpid(pid, &status, 0);
+  ASSERT_TRUE(WIFEXITED(status));
+  EXPECT_EQ(WEXITSTATUS(status), 0);
+  minijail_destroy(j);
+}
+
+TEST(test_minijail_try_wait) {
+  pid_t pid;
+  int child_stdin;
+  int status = -1;
+  struct pollfd pfd;
+  struct minijail_meta meta;
+  char meta_path[] = "/tmp/minijail_try_wait.XXXXXX";
+  char *cat[] = { "/bin/cat", NULL };
+  char *exit3[] = { "/bin/sh", "-c", "exit 3", NULL };
+
+  struct minijail *j = minijail_new();
+  EXPECT_EQ(minijail_pidfd(j), -ECHILD);
+  ASSERT_EQ(minijail_run_pid_pipe(j, cat[0], cat, &pid, &child_stdin), 0);
+  pfd.fd = minijail_pidfd(j);
+  pfd.events = POLLIN;
+  /* Kernels before 5.3 have no pidfd_open(2). */
+  if (pfd.fd == -ENOSYS) {
+    close(child_stdin);
+    minijail_wait(j);
+    minijail_destroy(j);
+    return;
+  }
+  ASSERT_GE(pfd.fd, 0);
+
+  /* cat(1) waits for its input. */
+  EXPECT_EQ(poll(&pfd, 1, 0), 0);
+  EXPECT_EQ(minijail_try_wait(j, &status, NULL), 0);
+  close(child_stdin);
+  EXPECT_EQ(poll(&pfd, 1, 5000), 1);
+  EXPECT_EQ(minijail_try_wait(j, &status, &meta), 1);
+  EXPECT_EQ(status, 0);
+  EXPECT_EQ(meta.time_wall, 0);
+  minijail_destroy(j);
+
+  /* init() needs a pid namespace, which needs root. */
+  if (geteuid() != 0)
+    return;
+  ASSERT_NE(mkstemp(meta_path), -1);
+  j = minijail_new();
+  minijail_namespace_pids(j);
+  EXPECT_EQ(minijail_meta_file(j, meta_path), 0);
+  ASSERT_EQ(minijail_run_pid(j, exit3[0], exit3, &pid), 0);
+  pfd.fd = minijail_pidfd(j);
+  EXPECT_EQ(poll(&pfd, 1, 5000), 1);
+  EXPECT_EQ(minijail_try_wait(j, &status, &meta), 1);
+  EXPECT_EQ(status, 3);
+  EXPECT_EQ(meta.status, 3);
+  EXPECT_EQ(meta.signal, 0);
+  EXPECT_LT(0, meta.time_wall);
+  minijail_destroy(j);
+  unlink(meta_path);
+}
+
+struct supervised_run {
+  int done;
+  int status;
+  struct minijail_meta meta;
+  char output[64];
+  size_t output_len;
+  int eof;
+};
+
+static void supervised_done(struct minijail *j, int status,
+                            const struct minijail_meta *meta, void *data) {
+  struct supervised_run *run = data;
+  (void)j;
+  run->done++;
+  run->status = status;
+  run->meta = *meta;
+}
+
+static void supervised_output(struct minijail *j, int fd, const char *buf,
+                              size_t len, void *data) {
+  struct supervised_run *run = data;
+  (void)j;
+  (void)fd;
+  if (len == 0)
+    run->eof = 1;
+  if (len > sizeof(run->output) - run->output_len)
+    len = sizeof(run->output) - run->output_len;
+  memcpy(run->output + run->output_len, buf, len);
+  run->output_len += len;
+}
+
+TEST(test_minijail_supervisor) {
+  struct supervised_run runs[3];
+  struct minijail *jails[3];
+  pid_t pid;
+  int child_stdin, child_stdout;
+  int i;
+  char *exit3[] = { "/bin/sh", "-c", "exit 3", NULL };
+  char *echo[] = { "/bin/sh", "-c", "echo hello", NULL };
+  char *hang[] = { "/bin/sh", "-c", "trap '' ALRM; sleep 10", NULL };
+
+  memset(runs, 0, sizeof(runs));
+  struct minijail_supervisor *s = minijail_supervisor_new();
+  ASSERT_NE(s, NULL);
+  for (i = 0; i < 3; i++)
+    jails[i] = minijail_new();
+
+  ASSERT_EQ(minijail_run_pid(jails[0], exit3[0], exit3, &pid), 0);
+  /* Kernels before 5.3 have no pidfd_open(2). */
+  if (minijail_pidfd(jails[0]) == -ENOSYS) {
+    minijail_wait(jails[0]);
+    goto out;
+  }
+  ASSERT_EQ(minijail_supervisor_add(s, jails[0], supervised_done, &runs[0]), 0);
+
+  ASSERT_EQ(minijail_run_pid_pipes(jails[1], echo[0], echo, &pid,
+                                   &child_stdin, &child_stdout, NULL), 0);
+  close(child_stdin);
+  ASSERT_EQ(minijail_supervisor_add(s, jails[1], supervised_done, &runs[1]), 0);
+  ASSERT_EQ(minijail_supervisor_add_output(s, jails[1], child_stdout,
+                                           supervised_output), 0);
+
+  /* Ignores the SIGALRM at the end of its time, so the supervisor kills it. */
+  minijail_time_limit(jails[2], 100);
+  ASSERT_EQ(minijail_run_pid(jails[2], hang[0], hang, &pid), 0);
+  ASSERT_EQ(minijail_supervisor_add(s, jails[2], supervised_done, &runs[2]), 0);
+  EXPECT_EQ(minijail_supervisor_add(s, jails[2], supervised_done, &runs[2]),
+            -EEXIST);
+
+  while (minijail_supervisor_dispatch(s, 5000) > 0)
+    ;
+
+  for (i = 0; i < 3; i++)
+    EXPECT_EQ(runs[i].done, 1);
+  EXPECT_EQ(runs[0].status, 3);
+  EXPECT_EQ(runs[0].meta.status, 3);
+  EXPECT_EQ(runs[1].status, 0);
+  EXPECT_EQ(runs[1].output_len, strlen("hello\n"));
+  EXPECT_EQ(memcmp(runs[1].output, "hello\n", strlen("hello\n")), 0);
+  EXPECT_TRUE(runs[1].eof);
+  EXPECT_EQ(runs[2].status, 128 + SIGKILL);
+  EXPECT_EQ(runs[2].meta.signal, SIGXCPU);
+  EXPECT_LT(1000000, runs[2].meta.time_wall);
+
+out:
+  minijail_supervisor_destroy(s);
+  for (i = 0; i < 3; i++)
+    minijail_destroy(jails[i]);
+}
+
+TEST(test_minijail_capture) {
+  struct supervised_run runs[2];
+  struct minijail_capture *captures[2];
+  struct minijail *jails[2];
+  pid_t pid;
+  int child_stdin, child_stdout;
+  int i;
+  char buf[16];
+  char *echo[] = { "/bin/sh", "-c", "echo hello", NULL };
+  char *yes[] = { "/usr/bin/yes", NULL };
+
+  memset(runs, 0, sizeof(runs));
+  struct minijail_supervisor *s = minijail_supervisor_new();
+  ASSERT_NE(s, NULL);
+  for (i = 0; i < 2; i++) {
+    jails[i] = minijail_new();
+    captures[i] = minijail_capture_new(4096);
+    ASSERT_NE(captures[i], NULL);
+  }
+
+  ASSERT_EQ(minijail_run_pid_pipes(jails[0], echo[0], echo, &pid,
+                                   &child_stdin, &child_stdout, NULL), 0);
+  close(child_stdin);
+  /* Kernels before 5.3 have no pidfd_open(2). */
+  if (minijail_pidfd(jails[0]) == -ENOSYS) {
+    close(child_stdout);
+    minijail_wait(jails[0]);
+    goto out;
+  }
+  ASSERT_EQ(minijail_supervisor_add(s, jails[0], supervised_done, &runs[0]), 0);
+  ASSERT_EQ(minijail_supervisor_add_capture(s, jails[0], child_stdout,
+                                            captures[0]), 0);
+
+  /* yes(1) never stops on its own. */
+  ASSERT_EQ(minijail_run_pid_pipes(jails[1], yes[0], yes, &pid,
+                                   &child_stdin, &child_stdout, NULL), 0);
+  close(child_stdin);
+  ASSERT_EQ(minijail_supervisor_add(s, jails[1], supervised_done, &runs[1]), 0);
+  ASSERT_EQ(minijail_supervisor_add_capture(s, jails[1], child_stdout,
+                                            captures[1]), 0);
+
+  while (minijail_supervisor_dispatch(s, 5000) > 0)
+    ;
+
+  EXPECT_EQ(runs[0].status, 0);
+  EXPECT_EQ(minijail_capture_len(captures[0]), strlen("hello\n"));
+  EXPECT_FALSE(minijail_capture_truncated(captures[0]));
+  EXPECT_EQ(read(minijail_capture_fd(captures[0]), buf, sizeof(buf)),
+            (ssize_t)strlen("hello\n"));
+  EXPECT_EQ(memcmp(buf, "hello\n", strlen("hello\n")), 0);
+
+  EXPECT_EQ(runs[1].status, 128 + SIGKILL);
+  EXPECT_EQ(runs[1].meta.signal, SIGXFSZ);
+  EXPECT_EQ(minijail_capture_len(captures[1]), (size_t)4096);
+  EXPECT_TRUE(minijail_capture_truncated(captures[1]));
+
+out:
+  minijail_supervisor_destroy(s);
+  for (i = 0; i < 2; i++) {
+    minijail_capture_destroy(captures[i]);
+    minijail_destroy(jails[i]);
+  }
+}
+
+/*
+ * Runs |cmd| under a supervisor, comparing its output against |expected|,
+ * with a time limit of |time_limit| ms unless it is 0.
+ * Returns minijail_compare_result(), or -2 if pidfds are missing.
+ */
+static int run_compare(const char *cmd, const char *expected, int mode,
+                       size_t *offset, struct supervised_run *run,
+                       const char *meta_path, int time_limit) {
+  char path[] = "/tmp/minijail_expected.XXXXXX";
+  char *argv[] = { "/bin/sh", "-c", (char *)cmd, NULL };
+  pid_t pid;
+  int child_stdin, child_stdout;
+  int fd, ret = -2;
+  struct minijail_supervisor *s = minijail_supervisor_new();
+  struct minijail *j = minijail_new();
+  struct minijail_compare *c;
+
+  fd = mkstemp(path);
+  if (fd < 0 || write(fd, expected, strlen(expected)) < 0)
+    return -3;
+  c = minijail_compare_new(fd, mode);
+  close(fd);
+  unlink(path);
+  if (!c)
+    return -3;
+
+  if (meta_path)
+    minijail_meta_file(j, meta_path);
+  if (time_limit)
+    minijail_time_limit(j, time_limit);
+  memset(run, 0, sizeof(*run));
+  if (minijail_run_pid_pipes(j, argv[0], argv, &pid, &child_stdin,
+                             &child_stdout, NULL))
+    return -3;
+  close(child_stdin);
+  if (minijail_pidfd(j) < 0) {
+    close(child_stdout);
+    minijail_wait(j);
+  } else if (!minijail_supervisor_add(s, j, supervised_done, run) &&
+             !minijail_supervisor_add_compare(s, j, child_stdout, c)) {
+    while (minijail_supervisor_dispatch(s, 5000) > 0)
+      ;
+    ret = minijail_compare_result(c, offset);
+  }
+  minijail_supervisor_destroy(s);
+  minijail_compare_destroy(c);
+  minijail_destroy(j);
+  return ret;
+}
+
+TEST(test_minijail_compare) {
+  struct supervised_run run;
+  char meta_path[] = "/tmp/minijail_compare_meta.XXXXXX";
+  char timeout_meta_path[] = "/tmp/minijail_compare_meta.XXXXXX";
+  char meta[128];
+  size_t offset = 0;
+  ssize_t len;
+  int fd;
+
+  int ret = run_compare("echo 1 2", "1 2\n", MINIJAIL_COMPARE_EXACT,
+                        &offset, &run, NULL, 0);
+  /* Kernels before 5.3 have no pidfd_open(2). */
+  if (ret == -2)
+    return;
+  EXPECT_EQ(ret, 1);
+  EXPECT_EQ(run_compare("echo 1 2", "1  2", MINIJAIL_COMPARE_EXACT,
+                        &offset, &run, NULL, 0), 0);
+  EXPECT_EQ(offset, (size_t)2);
+  EXPECT_EQ(run_compare("printf '1\\n2'", " 1 2\n\n",
+                        MINIJAIL_COMPARE_TOKENS, &offset, &run, NULL, 0), 1);
+  EXPECT_EQ(run_compare("echo 1 23", "1 2 3", MINIJAIL_COMPARE_TOKENS,
+                        &offset, &run, NULL, 0), 0);
+  EXPECT_EQ(offset, (size_t)3);
+  EXPECT_EQ(run_compare("echo 1 2", "1 2 3", MINIJAIL_COMPARE_TOKENS,
+                        &offset, &run, NULL, 0), 0);
+  EXPECT_EQ(offset, (size_t)4);
+  EXPECT_TRUE(run.meta.wrong_answer);
+
+  /* A wrong answer is cut short instead of running to its end. */
+  fd = mkstemp(meta_path);
+  ASSERT_NE(fd, -1);
+  EXPECT_EQ(run_compare("echo hexlo; exec sleep 10", "hello\n",
+                        MINIJAIL_COMPARE_TOKENS, &offset, &run, meta_path, 0), 0);
+  EXPECT_EQ(offset, (size_t)2);
+  EXPECT_EQ(run.done, 1);
+  EXPECT_TRUE(run.meta.wrong_answer);
+  EXPECT_EQ(run.meta.wrong_answer_offset, 2);
+  EXPECT_GT(5000000, run.meta.time_wall);
+  len = read(fd, meta, sizeof(meta) - 1);
+  ASSERT_GE(len, 0);
+  meta[len] = '\0';
+  EXPECT_NE(strstr(meta, "verdict:WA\nwa-offset:2\n"), NULL);
+  close(fd);
+  unlink(meta_path);
+
+  /* Output cut short by a timeout is not a wrong answer. */
+  fd = mkstemp(timeout_meta_path);
+  ASSERT_NE(fd, -1);
+  EXPECT_EQ(run_compare("echo 1; exec sleep 10", "1 2\n",
+                        MINIJAIL_COMPARE_TOKENS, &offset, &run,
+                        timeout_meta_path, 100), -1);
+  EXPECT_EQ(run.done, 1);
+  EXPECT_NE(run.meta.signal, 0);
+  EXPECT_FALSE(run.meta.wrong_answer);
+  len = read(fd, meta, sizeof(meta) - 1);
+  ASSERT_GE(len, 0);
+  meta[len] = '\0';
+  EXPECT_EQ(strstr(meta, "verdict:WA"), NULL);
+  close(fd);
+  unlink(timeout_meta_path);
+}
+
+TEST(test_minijail_stdin_fd) {
+  pid_t pid;
+  int status;
+  int run;
+  int pipe_fds[2];
+  int child_stdin;
+  char *argv[] = { "/bin/sh", "-c",
+                   "read x && test \"$x\" = hello && ! echo x >&0", NULL };
+  char path[] = "/tmp/minijail_input.XXXXXX";
+  int fd = mkstemp(path);
+
+  ASSERT_GE(fd, 0);
+  unlink(path);
+  ASSERT_EQ(write(fd, "hello\n", 6), 6);
+  struct minijail *j = minijail_new();
+  ASSERT_EQ(pipe(pipe_fds), 0);
+  EXPECT_EQ(minijail_stdin_fd(j, pipe_fds[0]), -EINVAL);
+  close(pipe_fds[0]);
+  close(pipe_fds[1]);
+  ASSERT_EQ(minijail_stdin_fd(j, fd), 0);
+
+  /* Each run reads from the start, and can't write to the input. */
+  for (run = 0; run < 2; run++) {
+    EXPECT_EQ(minijail_run_pid(j, argv[0], argv, &pid), 0);
+    waitpid(pid, &status, 0);
+    ASSERT_TRUE(WIFEXITED(status));
+    EXPECT_EQ(WEXITSTATUS(status), 0);
+  }
+  EXPECT_EQ(minijail_run_pid_pipe(j, argv[0], argv, &pid, &child_stdin),
+            -EINVAL);
+
+  minijail_destroy(j);
+  close(fd);
+}
+
+TEST(test_minijail_preserve_fd) {
+  pid_t pid;
+  int status;
+  int pipe_fds[2];
+  char buf[8];
+  /* Only the pipe shows up as fd 7; the leaked fd 8 doesn't. */
+  char *argv[] = { "/bin/sh", "-c",
+                   "echo hi >&7 && test ! -e /proc/$$/fd/8", NULL };
+  int leaked = open("/dev/null", O_RDONLY);
+  struct minijail *j = minijail_new();
+
+  ASSERT_GE(leaked, 0);
+  ASSERT_EQ(dup2(leaked, 8), 8);
+  ASSERT_EQ(pipe(pipe_fds), 0);
+  ASSERT_EQ(minijail_preserve_fd(j, pipe_fds[1], 7), 0);
+  EXPECT_EQ(minijail_preserve_fd(j, leaked, 7), -EINVAL);
+  EXPECT_EQ(minijail_preserve_fd(j, -1, 9), -EINVAL);
+
+  EXPECT_EQ(minijail_run_pid(j, argv[0], argv, &pid), 0);
+  close(pipe_fds[1]);
+  waitpid(pid, &status, 0);
+  ASSERT_TRUE(WIFEXITED(status));
+  EXPECT_EQ(WEXITSTATUS(status), 0);
+  EXPECT_EQ(read(pipe_fds[0], buf, sizeof(buf)), 3);
+  EXPECT_EQ(memcmp(buf, "hi\n", 3), 0);
+
+  minijail_destroy(j);
+  close(pipe_fds[0]);
+  close(leaked);
+  close(8);
+}
+
+TEST(test_minijail_preserve_fd_over_meta_file) {
+  char meta_path[] = "/tmp/minijail-meta.XXXXXX";
+  char link[64];
+  char line[64];
+  int status = -1;
+  pid_t pid;
+  int pipe_fds[2];
+  int saved_fd3;
+  int fd;
+  ssize_t len;
+  FILE *f;
+  char *argv[] = { "/bin/sh", "-c", "echo hi >&3", NULL };
+  struct minijail *j;
+
+  /* init() needs a pid namespace, which needs root. */
+  if (geteuid() != 0)
+    return;
+
+  fd = mkstemp(meta_path);
+  ASSERT_NE(fd, -1);
+  close(fd);
+  j = minijail_new();
+  minijail_namespace_pids(j);
+  minijail_no_preload(j);
+
+  /* Free up fd 3, and anything below it, so that the meta file lands there. */
+  saved_fd3 = fcntl(3, F_DUPFD, 10);
+  close(3);
+  while ((fd = open("/dev/null", O_RDONLY)) >= 0 && fd < 3)
+    ;
+  close(fd);
+  ASSERT_EQ(minijail_meta_file(j, meta_path), 0);
+  len = readlink("/proc/self/fd/3", link, sizeof(link) - 1);
+  ASSERT_GT(len, 0);
+  link[len] = '\0';
+  EXPECT_EQ(strcmp(link, meta_path), 0);
+  ASSERT_EQ(pipe(pipe_fds), 0);
+  ASSERT_EQ(minijail_preserve_fd(j, pipe_fds[1], 3), 0);
+
+  EXPECT_EQ(minijail_run_pid(j, argv[0], argv, &pid), 0);
+  close(pipe_fds[1]);
+  waitpid(pid, &status, 0);
+  ASSERT_TRUE(WIFEXITED(status));
+  EXPECT_EQ(WEXITSTATUS(status), 0);
+  minijail_destroy(j);
+
+  /* The program got the pipe, and init still wrote to the meta file. */
+  EXPECT_EQ(read(pipe_fds[0], line, sizeof(line)), 3);
+  EXPECT_EQ(memcmp(line, "hi\n", 3), 0);
+  close(pipe_fds[0]);
+  status = -1;
+  f = fopen(meta_path, "r");
+  ASSERT_NE(f, NULL);
+  while (fgets(line, sizeof(line), f))
+    sscanf(line, "status:%d", &status);
+  fclose(f);
+  EXPECT_EQ(status, 0);
+  unlink(meta_path);
+
+  if (saved_fd3 >= 0) {
+    dup2(saved_fd3, 3);
+    close(saved_fd3);
+  }
+}
+
+TEST(test_minijail_run_fds) {
+  pid_t pid;
+  int status;
+  char buf[16];
+  char *argv[] = { "/bin/sh", "-c",
+                   "read x && echo $x-out && echo side >&5", NULL };
+  struct minijail_fd fds[] = {
+    { 0, MINIJAIL_FD_PIPE_IN, -1 },
+    { 1, MINIJAIL_FD_PIPE_OUT, -1 },
+    { 5, MINIJAIL_FD_SOCKETPAIR, -1 },
+  };
+  struct minijail_fd bad[] = {
+    { 3, MINIJAIL_FD_PIPE_IN, -1 },
+    { 3, MINIJAIL_FD_PIPE_OUT, -1 },
+  };
+  struct minijail *j = minijail_new();
+
+  EXPECT_EQ(minijail_run_fds(j, argv[0], argv, &pid, bad, 2), -EINVAL);
+  EXPECT_EQ(bad[0].parent_fd, -1);
+
+  ASSERT_EQ(minijail_run_fds(j, argv[0], argv, &pid, fds, 3), 0);
+  ASSERT_EQ(write(fds[0].parent_fd, "hi\n", 3), 3);
+  close(fds[0].parent_fd);
+  EXPECT_EQ(read(fds[1].parent_fd, buf, sizeof(buf)), 7);
+  EXPECT_EQ(memcmp(buf, "hi-out\n", 7), 0);
+  EXPECT_EQ(read(fds[2].parent_fd, buf, sizeof(buf)), 5);
+  EXPECT_EQ(memcmp(buf, "side\n", 5), 0);
+  waitpid(pid, &status, 0);
+  ASSERT_TRUE(WIFEXITED(status));
+  EXPECT_EQ(WEXITSTATUS(status), 0);
+
+  minijail_destroy(j);
+  close(fds[1].parent_fd);
+  close(fds[2].parent_fd);
+}
+
+TEST(test_minijail_input_memfd) {
+  pid_t pid;
+  int status;
+  char buf[8];
+  char path[] = "/tmp/minijail_input.XXXXXX";
+  char *argv[] = { "/bin/sh", "-c", "read x && test \"$x\" = hello", NULL };
+  int fd = mkstemp(path);
+  int memfd;
+
+  ASSERT_GE(fd, 0);
+  unlink(path);
+  ASSERT_EQ(write(fd, "hello\n", 6), 6);
+  EXPECT_EQ(minijail_prefetch_input(fd), 0);
+  memfd = minijail_input_memfd(fd);
+  close(fd);
+  ASSERT_GE(memfd, 0);
+
+  /* The copy is complete and sealed. */
+  EXPECT_EQ(pread(memfd, buf, sizeof(buf), 0), 6);
+  EXPECT_EQ(memcmp(buf, "hello\n", 6), 0);
+  EXPECT_EQ(pwrite(memfd, "j", 1, 0), -1);
+  EXPECT_EQ(errno, EPERM);
+  EXPECT_NE(ftruncate(memfd, 0), 0);
+
+  struct minijail *j = minijail_new();
+  ASSERT_EQ(minijail_stdin_fd(j, memfd), 0);
+  EXPECT_EQ(minijail_run_pid(j, argv[0], argv, &pid), 0);
+  waitpid(pid, &status, 0);
+  ASSERT_TRUE(WIFEXITED(status));
+  EXPECT_EQ(WEXITSTATUS(status), 0);
+  minijail_destroy(j);
+  close(memfd);
+}
+
+/* Mirrors the host's /|name| into |root|, as a symlink or a read-only bind. */
+static void mirror_dir(struct minijail *j, const char *root, const char *name)
+{
+  char host[PATH_MAX], jailed[PATH_MAX], link[PATH_MAX];
+  struct stat st;
+  ssize_t len;
+
+  snprintf(host, sizeof(host), "/%s", name);
+  snprintf(jailed, sizeof(jailed), "%s/%s", root, name);
+  if (lstat(host, &st))
+    return;
+  if (S_ISLNK(st.st_mode)) {
+    len = readlink(host, link, sizeof(link) - 1);
+    if (len < 0)
+      return;
+    link[len] = '\0';
+    symlink(link, jailed);
+  } else if (S_ISDIR(st.st_mode)) {
+    mkdir(jailed, 0755);
+    minijail_bind(j, host, host, 0);
+  }
+}
+
+static void unmirror_dir(const char *root, const char *name)
+{
+  char jailed[PATH_MAX];
+
+  snprintf(jailed, sizeof(jailed), "%s/%s", root, name);
+  if (unlink(jailed))
+    rmdir(jailed);
+}
+
+TEST(test_minijail_mount_template) {
+  const char *dirs[] = { "bin", "lib", "lib64", "usr" };
+  char root[] = "/tmp/minijail_template.XXXXXX";
+  char src[] = "/tmp/minijail_template_src.XXXXXX";
+  char marker[PATH_MAX];
+  char sub[64];
+  char data[64];
+  char late[64];
+  pid_t pid;
+  int status;
+  int ret;
+  size_t i;
+  int run;
+  int fd;
+  /* Submounts of a binding's source aren't bound, like with MS_BIND. */
+  char *argv[] = { "/bin/sh", "-c",
+                   "test -x /bin/sh && ! touch /usr/x && "
+                   "test -d /data/sub && ! test -e /data/sub/hidden", NULL };
+  char *late_argv[] = { "/bin/sh", "-c", "test -d /late/sub", NULL };
+  struct minijail *clone;
+
+  /* Building mount trees needs CAP_SYS_ADMIN. */
+  if (geteuid() != 0)
+    return;
+
+  ASSERT_NE(mkdtemp(root), NULL);
+  ASSERT_NE(mkdtemp(src), NULL);
+  snprintf(sub, sizeof(sub), "%s/sub", src);
+  ASSERT_EQ(mkdir(sub, 0755), 0);
+  ASSERT_EQ(mount("none", sub, "tmpfs", 0, NULL), 0);
+  snprintf(marker, sizeof(marker), "%s/hidden", sub);
+  fd = open(marker, O_WRONLY | O_CREAT, 0644);
+  ASSERT_GE(fd, 0);
+  close(fd);
+  snprintf(data, sizeof(data), "%s/data", root);
+  ASSERT_EQ(mkdir(data, 0755), 0);
+  snprintf(late, sizeof(late), "%s/late", root);
+  ASSERT_EQ(mkdir(late, 0755), 0);
+
+  struct minijail *j = minijail_new();
+  EXPECT_EQ(minijail_enter_chroot(j, root), 0);
+  for (i = 0; i < sizeof(dirs) / sizeof(dirs[0]); i++)
+    mirror_dir(j, root, dirs[i]);
+  EXPECT_EQ(minijail_bind(j, src, "/data", 0), 0);
+
+  ret = minijail_build_mount_template(j);
+  /* Older kernels can't attach to or clone detached mount trees. */
+  if (ret == 0) {
+    /* The template is reused across runs. */
+    for (run = 0; run < 2; run++) {
+      EXPECT_EQ(minijail_run_pid(j, argv[0], argv, &pid), 0);
+      waitpid(pid, &status, 0);
+      ASSERT_TRUE(WIFEXITED(status));
+      EXPECT_EQ(WEXITSTATUS(status), 0);
+    }
+    /* Nothing was mounted in our namespace. */
+    snprintf(marker, sizeof(marker), "%s/usr/bin", root);
+    EXPECT_NE(access(marker, F_OK), 0);
+
+    /* Bindings made after the template are mounted on top of it. */
+    clone = minijail_clone_template(j);
+    ASSERT_NE(clone, NULL);
+    EXPECT_EQ(minijail_bind(clone, src, "/late", 0), 0);
+    EXPECT_EQ(minijail_run_pid(clone, late_argv[0], late_argv, &pid), 0);
+    waitpid(pid, &status, 0);
+    ASSERT_TRUE(WIFEXITED(status));
+    EXPECT_EQ(WEXITSTATUS(status), 0);
+    minijail_destroy(clone);
+  } else {
+    EXPECT_NE(ret, -EBADF);
+  }
+
+  minijail_destroy(j);
+  for (i = 0; i < sizeof(dirs) / sizeof(dirs[0]); i++)
+    unmirror_dir(root, dirs[i]);
+  rmdir(data);
+  rmdir(late);
+  rmdir(root);
+  umount(sub);
+  rmdir(sub);
+  rmdir(src);
+}
+
+TEST(test_minijail_proc_options) {
+  pid_t pid;
+  int status;
+  char *subset[] = { "/bin/sh", "-c",
+                     "test -d /proc/self && ! test -e /proc/sys", NULL };
+  char *none[] = { "/bin/sh", "-c", "! test -e /proc/self", NULL };
+
+  /* Mounting /proc needs CAP_SYS_ADMIN. */
+  if (geteuid() != 0)
+    return;
+
+  struct minijail *j = minijail_new();
+  minijail_namespace_pids(j);
+  minijail_proc_options(j, MINIJAIL_PROC_SUBSET_PID);
+  EXPECT_EQ(minijail_run_pid(j, subset[0], subset, &pid), 0);
+  waitpid(pid, &status, 0);
+  ASSERT_TRUE(WIFEXITED(status));
+  EXPECT_EQ(WEXITSTATUS(status), 0);
+
+  minijail_proc_options(j, MINIJAIL_PROC_NONE);
+  EXPECT_EQ(minijail_run_pid(j, none[0], none, &pid), 0);
+  waitpid(pid, &status, 0);
+  ASSERT_TRUE(WIFEXITED(status));
+  EXPECT_EQ(WEXITSTATUS(status), 0);
+  minijail_destroy(j);
+}
+
+static int touch_file(const char *dir, const char *name) {
+  char path[PATH_MAX];
+  FILE *f;
+
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  f = fopen(path, "w");
+  if (!f)
+    return -1;
+  return fclose(f);
+}
+
+TEST(test_minijail_get_path) {
+  char dir[] = "/tmp/minijail_get_path.XXXXXX";
+  char path[PATH_MAX];
+  char expected[PATH_MAX];
+  char root[64];
+  char lib[64];
+
+  ASSERT_NE(mkdtemp(dir), NULL);
+  snprintf(root, sizeof(root), "%s/root", dir);
+  snprintf(lib, sizeof(lib), "%s/lib", dir);
+  ASSERT_EQ(mkdir(root, 0700), 0);
+  ASSERT_EQ(mkdir(lib, 0700), 0);
+  snprintf(path, sizeof(path), "%s/bin", root);
+  ASSERT_EQ(mkdir(path, 0700), 0);
+  snprintf(path, sizeof(path), "%s/optx", root);
+  ASSERT_EQ(mkdir(path, 0700), 0);
+  ASSERT_EQ(touch_file(root, "bin/prog"), 0);
+  ASSERT_EQ(touch_file(root, "optx/f"), 0);
+  ASSERT_EQ(touch_file(lib, "tool"), 0);
+  ASSERT_EQ(touch_file(lib, "prog"), 0);
+  snprintf(path, sizeof(path), "%s/bin/rel", root);
+  ASSERT_EQ(symlink("../bin/prog", path), 0);
+  snprintf(path, sizeof(path), "%s/bin/abs", root);
+  ASSERT_EQ(symlink("/opt/tool", path), 0);
+  snprintf(path, sizeof(path), "%s/bin/loop", root);
+  ASSERT_EQ(symlink("loop", path), 0);
+
+  struct minijail *j = minijail_new();
+  ASSERT_EQ(minijail_enter_chroot(j, root), 0);
+  ASSERT_EQ(minijail_bind(j, lib, "/opt", 0), 0);
+
+  snprintf(expected, sizeof(expected), "%s/bin/prog", root);
+  EXPECT_EQ(minijail_get_path(j, path, sizeof(path), "/bin/prog"), 0);
+  EXPECT_STREQ(path, expected);
+  /* Twice, to go through the cache. */
+  EXPECT_EQ(minijail_get_path(j, path, sizeof(path), "/bin/prog"), 0);
+  EXPECT_STREQ(path, expected);
+  EXPECT_EQ(minijail_get_path(j, path, sizeof(path), "//bin/./x/../prog"), 0);
+  EXPECT_STREQ(path, expected);
+  EXPECT_EQ(minijail_get_path(j, path, sizeof(path), "/bin/rel"), 0);
+  EXPECT_STREQ(path, expected);
+
+  /* Links can point into bindings, and bindings cover whole components. */
+  snprintf(expected, sizeof(expected), "%s/tool", lib);
+  EXPECT_EQ(minijail_get_path(j, path, sizeof(path), "/bin/abs"), 0);
+  EXPECT_STREQ(path, expected);
+  snprintf(expected, sizeof(expected), "%s/optx/f", root);
+  EXPECT_EQ(minijail_get_path(j, path, sizeof(path), "/optx/f"), 0);
+  EXPECT_STREQ(path, expected);
+
+  EXPECT_NE(minijail_get_path(j, path, sizeof(path), "/bin/loop"), 0);
+  EXPECT_NE(minijail_get_path(j, path, sizeof(path), "/bin"), 0);
+  EXPECT_NE(minijail_get_path(j, path, 8, "/bin/prog"), 0);
+
+  /* A cached file that became a symlink is resolved again. */
+  snprintf(path, sizeof(path), "%s/bin/prog", root);
+  ASSERT_EQ(unlink(path), 0);
+  ASSERT_EQ(symlink("/opt/tool", path), 0);
+  snprintf(expected, sizeof(expected), "%s/tool", lib);
+  EXPECT_EQ(minijail_get_path(j, path, sizeof(path), "/bin/prog"), 0);
+  EXPECT_STREQ(path, expected);
+
+  /* Later bindings apply to paths resolved before. */
+  ASSERT_EQ(minijail_bind(j, lib, "/bin", 0), 0);
+  snprintf(expected, sizeof(expected), "%s/prog", lib);
+  EXPECT_EQ(minijail_get_path(j, path, sizeof(path), "/bin/prog"), 0);
+  EXPECT_STREQ(path, expected);
+  minijail_destroy(j);
+
+  snprintf(path, sizeof(path), "rm -rf %s", dir);
+  EXPECT_EQ(system(path), 0);
+}
+
+TEST(test_minijail_parse_profile) {
+  char dir[] = "/tmp/minijail_profile.XXXXXX";
+  char profile[PATH_MAX];
+  char path[PATH_MAX];
+  char expected[PATH_MAX];
+  char cmd[PATH_MAX + 128];
+  char root[64];
+  FILE *f;
+
+  ASSERT_NE(mkdtemp(dir), NULL);
+  snprintf(root, sizeof(root), "%s/root", dir);
+  ASSERT_EQ(mkdir(root, 0700), 0);
+  ASSERT_EQ(touch_file(dir, "prog"), 0);
+  snprintf(profile, sizeof(profile), "%s/profile", dir);
+  f = fopen(profile, "w");
+  ASSERT_NE(f, NULL);
+  fprintf(f, "# Test profiles.\n"
+             "[c]\n"
+             "chroot=/nonexistent\n"
+             "[cpp17]\n"
+             "  chroot = %s   ; the jail\n"
+             "bind=%s,/bin\n"
+             "no-new-privs\n"
+             "time=1000\n"
+             "[bad]\n"
+             "time=soon\n"
+             "[root]\n"
+             "uid=0\n"
+             "[root-group]\n"
+             "gid=0\n"
+             "[no-policy]\n"
+             "policy=/nonexistent\n"
+             "[bad-policy]\n"
+             "policy=%s\n"
+             "[caps]\n"
+             "caps=0x8000000000000001\n"
+             "[other-user]\n"
+             "uid=1234\n", root, dir, profile);
+  fclose(f);
+
+  struct minijail *j = minijail_new();
+  EXPECT_EQ(minijail_parse_profile(j, profile, "java", 0), -ENOENT);
+  EXPECT_EQ(minijail_parse_profile(j, profile, "bad", 0), -EINVAL);
+  EXPECT_EQ(minijail_parse_profile(j, profile, "root", 0), -EINVAL);
+  EXPECT_EQ(minijail_parse_profile(j, profile, "root-group", 0), -EINVAL);
+  EXPECT_EQ(minijail_parse_profile(j, profile, "no-policy", 0), -EINVAL);
+  /* The profile itself is no seccomp policy. */
+  EXPECT_EQ(minijail_parse_profile(j, profile, "bad-policy", 0), -EINVAL);
+  EXPECT_EQ(minijail_parse_profile(j, profile, "caps", 0), 0);
+  EXPECT_EQ(minijail_parse_profile(j, profile, "other-user", 0), 0);
+  minijail_destroy(j);
+
+  /* Profiles picked by an unprivileged caller don't get to choose these. */
+  j = minijail_new();
+  EXPECT_EQ(minijail_parse_profile(j, profile, "caps",
+                                   MINIJAIL_PROFILE_UNPRIVILEGED), -EPERM);
+  EXPECT_EQ(minijail_parse_profile(j, profile, "other-user",
+                                   MINIJAIL_PROFILE_UNPRIVILEGED), -EPERM);
+  EXPECT_EQ(minijail_parse_profile(j, profile, "cpp17",
+                                   MINIJAIL_PROFILE_UNPRIVILEGED), 0);
+  minijail_destroy(j);
+
+  /* Neither does whoever runs minijail0 through sudo, if it's been built. */
+  if (geteuid() == 0 && !access("./minijail0", X_OK)) {
+    /* minijail0 reads the profile as the caller. */
+    ASSERT_EQ(chmod(dir, 0755), 0);
+    snprintf(cmd, sizeof(cmd),
+             "SUDO_USER=nobody ./minijail0 -F %s,caps /bin/true 2>&1 | "
+             "grep -q 'Could not use profile'", profile);
+    EXPECT_EQ(system(cmd), 0);
+    snprintf(cmd, sizeof(cmd),
+             "SUDO_USER=nobody ./minijail0 -F %s,cpp17 /bin/true 2>&1 | "
+             "grep -q 'Could not use profile'", profile);
+    EXPECT_NE(system(cmd), 0);
+  }
+
+  j = minijail_new();
+  ASSERT_EQ(minijail_parse_profile(j, profile, "cpp17", 0), 0);
+  snprintf(expected, sizeof(expected), "%s/prog", dir);
+  EXPECT_EQ(minijail_get_path(j, path, sizeof(path), "/bin/prog"), 0);
+  EXPECT_STREQ(path, expected);
+
+  /* Clones stand on their own. */
+  struct minijail *clone = minijail_clone_template(j);
+  ASSERT_NE(clone, NULL);
+  minijail_destroy(j);
+  EXPECT_EQ(minijail_get_path(clone, path, sizeof(path), "/bin/prog"), 0);
+  EXPECT_STREQ(path, expected);
+  /* The chroot was taken from the profile, so it can't be set again. */
+  EXPECT_EQ(minijail_enter_chroot(clone, "/"), -EINVAL);
+  minijail_destroy(clone);
+
+  snprintf(path, sizeof(path), "rm -rf %s", dir);
+  EXPECT_EQ(system(path), 0);
+}
+
+TEST(test_minijail_dup) {
+  char dir[] = "/tmp/minijail_dup.XXXXXX";
+  char path[PATH_MAX];
+  char expected[PATH_MAX];
+  char lib[64];
+  pid_t pid;
+  int status;
+  char *argv[] = { "/bin/true", NULL };
+
+  ASSERT_NE(mkdtemp(dir), NULL);
+  snprintf(lib, sizeof(lib), "%s/lib", dir);
+  ASSERT_EQ(mkdir(lib, 0700), 0);
+  ASSERT_EQ(touch_file(dir, "prog"), 0);
+  ASSERT_EQ(touch_file(lib, "prog"), 0);
+
+  struct minijail *tmpl = minijail_new();
+  ASSERT_EQ(minijail_bind(tmpl, dir, "/bin", 0), 0);
+  struct minijail *first = minijail_dup(tmpl);
+  ASSERT_NE(first, NULL);
+  struct minijail *second = minijail_dup(first);
+  ASSERT_NE(second, NULL);
+  /* Duplicates keep the template alive. */
+  minijail_destroy(tmpl);
+
+  /* Changing a duplicate leaves the others alone. */
+  ASSERT_EQ(minijail_bind(second, lib, "/bin", 0), 0);
+  snprintf(expected, sizeof(expected), "%s/prog", dir);
+  EXPECT_EQ(minijail_get_path(first, path, sizeof(path), "/bin/prog"), 0);
+  EXPECT_STREQ(path, expected);
+  EXPECT_EQ(minijail_get_path(second, path, sizeof(path), "/bin/prog"), 0);
+  EXPECT_STREQ(path, expected);
+  EXPECT_EQ(minijail_get_path(second, path, sizeof(path), "/bin/lib/prog"),
+            0);
+
+  /* Each duplicate runs on its own. */
+  EXPECT_EQ(minijail_pidfd(second), -ECHILD);
+  EXPECT_EQ(minijail_run_pid(second, argv[0], argv, &pid), 0);
+  waitpid(pid, &status, 0);
+  ASSERT_TRUE(WIFEXITED(status));
+  EXPECT_EQ(WEXITSTATUS(status), 0);
+  minijail_destroy(second);
+  EXPECT_EQ(minijail_pidfd(first), -ECHILD);
+  minijail_destroy(first);
+
+  snprintf(path, sizeof(path), "rm -rf %s", dir);
+  EXPECT_EQ(system(path), 0);
+}
+
+TEST(test_minijail_scratch) {
+  char dir[] = "/tmp/minijail_scratch.XXXXXX";
+  char meta[] = "/tmp/minijail_scratch_meta.XXXXXX";
+  char path[PATH_MAX];
+  char cmd[PATH_MAX * 2];
+  char line[64];
+  long long used = -1;
+  struct stat dir_st, tmp_st;
+  pid_t pid;
+  int status;
+  FILE *f;
+  char *argv[] = { "/bin/sh", "-c", cmd, NULL };
+
+  /* Mounting overlayfs needs CAP_SYS_ADMIN. */
+  if (geteuid() != 0)
+    return;
+
+  ASSERT_NE(mkdtemp(dir), NULL);
+  ASSERT_NE(mkstemp(meta), -1);
+  snprintf(path, sizeof(path), "%s/a", dir);
+  f = fopen(path, "w");
+  ASSERT_NE(f, NULL);
+  fclose(f);
+
+  /* The original contents are visible and writes are capped at 1M. */
+  snprintf(cmd, sizeof(cmd),
+           "cd %s && test -e a && rm a && echo x > b && "
+           "! dd if=/dev/zero of=c bs=1024 count=2048 2>/dev/null && "
+           "rm c && head -c 65536 /dev/zero > d", dir);
+  struct minijail *j = minijail_new();
+  minijail_namespace_pids(j);
+  EXPECT_EQ(minijail_scratch(j, "relative", 1 << 20), -EINVAL);
+  EXPECT_EQ(minijail_scratch(j, dir, 1 << 20), 0);
+  EXPECT_EQ(minijail_meta_file(j, meta), 0);
+  EXPECT_EQ(minijail_run_pid(j, argv[0], argv, &pid), 0);
+  waitpid(pid, &status, 0);
+  ASSERT_TRUE(WIFEXITED(status));
+  EXPECT_EQ(WEXITSTATUS(status), 0);
+  minijail_destroy(j);
+
+  /* The overlay stayed in the jail's mount namespace. */
+  ASSERT_EQ(stat(dir, &dir_st), 0);
+  ASSERT_EQ(stat("/tmp", &tmp_st), 0);
+  EXPECT_EQ(dir_st.st_dev, tmp_st.st_dev);
+
+  /* None of the changes reached the real directory. */
+  EXPECT_EQ(access(path, F_OK), 0);
+  snprintf(path, sizeof(path), "%s/b", dir);
+  EXPECT_NE(access(path, F_OK), 0);
+
+  f = fopen(meta, "r");
+  ASSERT_NE(f, NULL);
+  while (fgets(line, sizeof(line), f))
+    sscanf(line, "scratch:%lld", &used);
+  fclose(f);
+  EXPECT_LT(65535, used);
+  EXPECT_GT(1 << 20, used);
+
+  snprintf(path, sizeof(path), "%s/a", dir);
+  unlink(path);
+  rmdir(dir);
+  unlink(meta);
+}
+
 TEST_HARNESS_MAIN
@@ -20,6 +20,10 @@
 #include "elfparse.h"
 #include "util.h"
 
+static int use_preload = 1;
+static int use_elf_cache;
+static int elf_cache_fd = -1;
+
 static void add_binding(struct minijail *j, char *arg)
 {
 	char *src = strtok(arg, ",");
@@ -35,17 +39,113 @@ static void add_binding(struct minijail *j, char *arg)
 	}
 }
 
+static void use_profile(struct minijail *j, char *arg)
+{
+	char *path = strtok(arg, ",");
+	char *name = strtok(NULL, ",");
+	if (!path || !name) {
+		fprintf(stderr, "Bad profile: %s\n", arg);
+		exit(1);
+	}
+	/*
+	 * The profile is the caller's choice, so it only gets to set what the
+	 * caller could with options: never the uid, gid or capabilities.
+	 */
+	if (minijail_parse_profile(j, path, name,
+				   MINIJAIL_PROFILE_UNPRIVILEGED)) {
+		fprintf(stderr, "Could not use profile %s from %s\n", name,
+			path);
+		exit(1);
+	}
+}
+
+static void add_scratch(struct minijail *j, char *arg)
+{
+	char *dir = strtok(arg, ",");
+	char *size = strtok(NULL, ",");
+	if (!dir || !size) {
+		fprintf(stderr, "Bad scratch: %s %s\n", dir, size);
+		exit(1);
+	}
+	if (minijail_scratch(j, dir, strtoull(size, NULL, 0))) {
+		fprintf(stderr, "Scratch failure.\n");
+		exit(1);
+	}
+}
+
+static int parse_proc_options(char *arg)
+{
+	int options = 0;
+	char *opt;
+	for (opt = strtok(arg, ","); opt; opt = strtok(NULL, ",")) {
+		if (!strcmp(opt, "none"))
+			options |= MINIJAIL_PROC_NONE;
+		else if (!strcmp(opt, "hidepid"))
+			options |= MINIJAIL_PROC_HIDEPID;
+		else if (!strcmp(opt, "subset=pid"))
+			options |= MINIJAIL_PROC_SUBSET_PID;
+		else {
+			fprintf(stderr, "Bad /proc option: %s\n", opt);
+			exit(1);
+		}
+	}
+	return options;
+}
+
+/* Finds interpreters of scripts through the jail's bindings. */
+static int resolve_path(void *data, char *buf, size_t len, const char *path)
+{
+	return minijail_get_path(data, buf, len, path);
+}
+
+/*
+ * Checks that we can dlopen() libminijailpreload.so. That maps and relocates
+ * the whole library, so with -E it is only done once for each version of the
+ * library, and a statx(2) is enough from then on. The cache is root's, and
+ * keyed on the birth and change times, so the caller can't make it vouch for
+ * another file.
+ */
+static int check_preload(const char *path)
+{
+	char fdpath[32];
+	int validated = 0;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0) {
+		fprintf(stderr, "%s not found\n", PRELOADPATH);
+		return -1;
+	}
+	if (!elf_cache_lookup(elf_cache_fd, fd, ELF_CACHE_PRELOAD,
+			      &validated) && validated) {
+		close(fd);
+		return 0;
+	}
+	/* Load the very file recorded, not whatever |path| is by now. */
+	snprintf(fdpath, sizeof(fdpath), "/proc/self/fd/%d", fd);
+	if (!dlopen(fdpath, RTLD_LAZY | RTLD_LOCAL)) {
+		fprintf(stderr, "dlopen(): %s\n", dlerror());
+		close(fd);
+		return -1;
+	}
+	elf_cache_store(elf_cache_fd, fd, ELF_CACHE_PRELOAD, 1);
+	close(fd);
+	return 0;
+}
+
 static void usage(const char *progn)
 {
 	size_t i;
 
-	printf("Usage: %s [-Ghinprsvt] [-b <src>,<dest>[,<writeable>]] "
-	       "[-c <caps>] [-C <dir>] [-g <group>] [-S <file>] [-u <user>] "
-	       "<program> [args...]\n"
+	printf("Usage: %s [-GhiNnprsvt] [-b <src>,<dest>[,<writeable>]] "
+	       "[-c <caps>] [-C <dir>] [-E] [-F <file>,<name>] "
+	       "[-g <group>] [-S <file>] [-u <user>] <program> [args...]\n"
 	       "  -b:         binds <src> to <dest> in chroot. Multiple "
 	       "instances allowed\n"
 	       "  -C <dir>:   chroot to <dir>\n"
 	       "  -d <dir>:   chdir to <dir> (requires -C)\n"
+	       "  -F <file>,<name>: apply the profile <name> from <file>\n"
+	       "  -E:         cache the linkage of programs and the check of "
+	       "the preload library in " ELFCACHEPATH "\n"
 	       "  -G:         inherit secondary groups from uid\n"
 	       "  -g <group>: change gid to <group>\n"
 	       "  -h:         help (this message)\n"
@@ -57,11 +157,18 @@ static void usage(const char *progn)
 		printf("%s ", log_syscalls[i]);
 
 	printf("\n"
+	       "  -N:         enter the jail before execve instead of "
+	       "preloading libminijailpreload.so\n"
+	       "  -P <opts>:  mount /proc with <opts>, a comma-separated list of "
+	       "none, hidepid and subset=pid\n"
 	       "  -s:         use seccomp\n"
 	       "  -S <file>:  set seccomp filter using <file>\n"
 	       "              E.g., -S /usr/share/filters/<prog>.$(uname -m)\n"
 	       "  -t:         set the current time limit (msec)\n"
-	       "  -w:         add wall time (msec) to the current time limit\n");
+	       "  -T <size>:  mount a tmpfs of <size> bytes on /tmp\n"
+	       "  -w:         add wall time (msec) to the current time limit\n"
+	       "  -W <dir>,<size>: make <dir> writable, keeping up to <size> "
+	       "bytes of changes in memory\n");
 }
 
 static void seccomp_filter_usage(const char *progn)
@@ -79,7 +186,7 @@ static int parse_args(struct minijail *j, int argc, char *argv[])
 	int opt;
 	if (argc > 1 && argv[1][0] != '-')
 		return 1;
-	while ((opt = getopt(argc, argv, "u:g:sS:c:C:d:b:vrGhHinpLet:w:k:O:m:M:0:1:2:")) != -1) {
+	while ((opt = getopt(argc, argv, "u:g:sS:c:C:d:b:vrEF:GhHiNnpP:Let:T:w:W:k:O:m:M:0:1:2:")) != -1) {
 		switch (opt) {
 		case 's':
 			minijail_use_seccomp(j);
@@ -88,6 +195,13 @@ static int parse_args(struct minijail *j, int argc, char *argv[])
 			minijail_parse_seccomp_filters(j, optarg);
 			minijail_use_seccomp_filter(j);
 			break;
+		case 'N':
+			minijail_no_preload(j);
+			use_preload = 0;
+			break;
+		case 'P':
+			minijail_proc_options(j, parse_proc_options(optarg));
+			break;
 		case 'L':
 			minijail_log_seccomp_filter_failures(j);
 			break;
@@ -102,6 +216,12 @@ static int parse_args(struct minijail *j, int argc, char *argv[])
 			if (0 != minijail_chroot_chdir(j, optarg))
 				exit(1);
 			break;
+		case 'E':
+			use_elf_cache = 1;
+			break;
+		case 'F':
+			use_profile(j, optarg);
+			break;
 		case 'G':
 			minijail_inherit_usergroups(j);
 			break;
@@ -111,9 +231,15 @@ static int parse_args(struct minijail *j, int argc, char *argv[])
 		case 't':
 			minijail_time_limit(j, atoi(optarg));
 			break;
+		case 'T':
+			minijail_mount_tmp_size(j, strtoull(optarg, NULL, 0));
+			break;
 		case 'w':
 			minijail_extra_wall_time(j, atoi(optarg));
 			break;
+		case 'W':
+			add_scratch(j, optarg);
+			break;
 		case 'k':
 			minijail_stack_limit(j, atoi(optarg));
 			break;
@@ -205,7 +331,30 @@ int main(int argc, char *argv[])
 	int consumed = parse_args(j, argc, argv);
 	argc -= consumed;
 	argv += consumed;
-	char *dl_mesg = NULL;
+
+	/*
+	 * The cache decides how programs get jailed, so it is opened as root,
+	 * and only trusted if just root can write it. Its path is fixed at
+	 * build time: root writes to it, so the caller mustn't pick it.
+	 */
+	if (use_elf_cache) {
+		if (seteuid(0)) {
+			die("seteuid root");
+		}
+		if (setegid(0)) {
+			die("setegid root");
+		}
+		elf_cache_fd = elf_cache_open(ELFCACHEPATH);
+		if (setegid(passwd->pw_gid)) {
+			die("setegid user");
+		}
+		if (seteuid(passwd->pw_uid)) {
+			die("seteuid user");
+		}
+		if (elf_cache_fd < 0)
+			fprintf(stderr, "Not using ELF cache %s\n",
+				ELFCACHEPATH);
+	}
 	char filepath[PATH_MAX+1];
 	if (minijail_get_path(j, filepath, sizeof(filepath), argv[0])) {
 		fprintf(stderr, "Invalid path\n");
@@ -220,7 +369,8 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 	/* Check if target is statically or dynamically linked. */
-	elftype = get_elf_linkage(filepath);
+	elftype = get_program_linkage(filepath, resolve_path, j,
+				      elf_cache_fd);
 	if (elftype == ELFSTATIC) {
 		/* Target binary is static. */
 		// Become root again to set the jail up.
@@ -234,20 +384,17 @@ int main(int argc, char *argv[])
 	} else if (elftype == ELFDYNAMIC) {
 		/*
 		 * Target binary is dynamically linked so we can
-		 * inject libminijailpreload.so into it.
+		 * inject libminijailpreload.so into it, unless -N was given.
 		 */
-
-		if (minijail_get_path(j, filepath, sizeof(filepath), PRELOADPATH)) {
+		if (use_preload && minijail_get_path(j, filepath,
+						     sizeof(filepath),
+						     PRELOADPATH)) {
 			fprintf(stderr, "%s not found\n", PRELOADPATH);
 			return 1;
 		}
 
-		/* Check that we can dlopen() libminijailpreload.so. */
-		if (!dlopen(filepath, RTLD_LAZY | RTLD_LOCAL)) {
-			    dl_mesg = dlerror();
-			    fprintf(stderr, "dlopen(): %s\n", dl_mesg);
-			    return 1;
-		}
+		if (use_preload && check_preload(filepath))
+			return 1;
 		// Become root again to set the jail up.
 		if (seteuid(0)) {
 			die("seteuid root");
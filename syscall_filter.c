@@ -25,148 +25,159 @@ int str_to_op(const char *op_str)
 		return NE;
 	} else if (!strcmp(op_str, "&")) {
 		return SET;
+	} else if (!strcmp(op_str, "<")) {
+		return LT;
+	} else if (!strcmp(op_str, "<=")) {
+		return LE;
+	} else if (!strcmp(op_str, ">")) {
+		return GT;
+	} else if (!strcmp(op_str, ">=")) {
+		return GE;
+	} else if (!strcmp(op_str, "in")) {
+		return IN;
 	} else {
 		return 0;
 	}
 }
 
-struct sock_filter *new_instr_buf(size_t count)
-{
-	struct sock_filter *buf = calloc(count, sizeof(struct sock_filter));
-	if (!buf)
-		die("could not allocate BPF instruction buffer");
-
-	return buf;
-}
-
-struct filter_block *new_filter_block()
-{
-	struct filter_block *block = calloc(1, sizeof(struct filter_block));
-	if (!block)
-		die("could not allocate BPF filter block");
-
-	block->instrs = NULL;
-	block->last = block->next = NULL;
-
-	return block;
-}
+#define ARENA_INITIAL_CAP	256
 
-void append_filter_block(struct filter_block *head,
-		struct sock_filter *instrs, size_t len)
+struct sock_filter *new_instr_buf(struct filter_arena *arena, size_t count)
 {
-	struct filter_block *new_last;
-
-	/*
-	 * If |head| has no filter assigned yet,
-	 * we don't create a new node.
-	 */
-	if (head->instrs == NULL) {
-		new_last = head;
-	} else {
-		new_last = new_filter_block();
-		if (head->next != NULL) {
-			head->last->next = new_last;
-			head->last = new_last;
-		} else {
-			head->last = head->next = new_last;
-		}
-		head->total_len += len;
+	struct sock_filter *buf;
+
+	if (arena->len + count > arena->cap) {
+		size_t cap = arena->cap ? arena->cap : ARENA_INITIAL_CAP;
+		while (arena->len + count > cap)
+			cap *= 2;
+		buf = realloc(arena->instrs, cap * sizeof(struct sock_filter));
+		if (!buf)
+			die("could not allocate BPF instruction buffer");
+		arena->instrs = buf;
+		arena->cap = cap;
 	}
 
-	new_last->instrs = instrs;
-	new_last->total_len = new_last->len = len;
-	new_last->last = new_last->next = NULL;
+	buf = arena->instrs + arena->len;
+	memset(buf, 0, count * sizeof(struct sock_filter));
+	arena->len += count;
+	return buf;
 }
 
-void extend_filter_block_list(struct filter_block *list,
-		struct filter_block *another)
+void free_arena(struct filter_arena *arena)
 {
-	if (list->last != NULL) {
-		list->last->next = another;
-		list->last = another->last;
-	} else {
-		list->next = another;
-		list->last = another->last;
-	}
-	list->total_len += another->total_len;
+	free(arena->instrs);
+	arena->instrs = NULL;
+	arena->len = arena->cap = 0;
 }
 
-void append_ret_kill(struct filter_block *head)
+void append_ret_kill(struct filter_arena *arena)
 {
-	struct sock_filter *filter = new_instr_buf(ONE_INSTR);
+	struct sock_filter *filter = new_instr_buf(arena, ONE_INSTR);
 	set_bpf_ret_kill(filter);
-	append_filter_block(head, filter, ONE_INSTR);
 }
 
-void append_ret_trap(struct filter_block *head)
+void append_ret_trap(struct filter_arena *arena)
 {
-	struct sock_filter *filter = new_instr_buf(ONE_INSTR);
+	struct sock_filter *filter = new_instr_buf(arena, ONE_INSTR);
 	set_bpf_ret_trap(filter);
-	append_filter_block(head, filter, ONE_INSTR);
 }
 
-void append_ret_errno(struct filter_block *head, int errno_val)
+void append_ret_errno(struct filter_arena *arena, int errno_val)
 {
-	struct sock_filter *filter = new_instr_buf(ONE_INSTR);
+	struct sock_filter *filter = new_instr_buf(arena, ONE_INSTR);
 	set_bpf_ret_errno(filter, errno_val);
-	append_filter_block(head, filter, ONE_INSTR);
 }
 
-void append_allow_syscall(struct filter_block *head, int nr)
+void append_allow_syscall(struct filter_arena *arena, int nr)
 {
-	struct sock_filter *filter = new_instr_buf(ALLOW_SYSCALL_LEN);
+	struct sock_filter *filter = new_instr_buf(arena, ALLOW_SYSCALL_LEN);
 	size_t len = bpf_allow_syscall(filter, nr);
 	if (len != ALLOW_SYSCALL_LEN)
 		die("error building syscall number comparison");
-
-	append_filter_block(head, filter, len);
 }
 
-void allow_log_syscalls(struct filter_block *head)
+void allow_log_syscalls(struct filter_arena *arena)
 {
 	unsigned int i;
 	for (i = 0; i < log_syscalls_len; i++)
-		append_allow_syscall(head, lookup_syscall(log_syscalls[i]));
+		append_allow_syscall(arena, lookup_syscall(log_syscalls[i]));
 }
 
-unsigned int get_label_id(struct bpf_labels *labels, const char *label_str)
+unsigned int get_label_id(struct bpf_labels *labels, uint64_t key)
 {
-	int label_id = bpf_label_id(labels, label_str);
+	int label_id = bpf_label_id(labels, key);
 	if (label_id < 0)
-		die("could not allocate BPF label string");
+		die("could not allocate BPF label");
 	return label_id;
 }
 
+unsigned int entry_lbl(struct bpf_labels *labels, int nr)
+{
+	return get_label_id(labels, bpf_label_key(nr, LABEL_KIND_ENTRY, 0));
+}
+
 unsigned int group_end_lbl(struct bpf_labels *labels, int nr, int idx)
 {
-	char lbl_str[MAX_BPF_LABEL_LEN];
-	snprintf(lbl_str, MAX_BPF_LABEL_LEN, "%d_%d_end", nr, idx);
-	return get_label_id(labels, lbl_str);
+	return get_label_id(labels,
+			bpf_label_key(nr, LABEL_KIND_GROUP_END, idx));
 }
 
 unsigned int success_lbl(struct bpf_labels *labels, int nr)
 {
-	char lbl_str[MAX_BPF_LABEL_LEN];
-	snprintf(lbl_str, MAX_BPF_LABEL_LEN, "%d_success", nr);
-	return get_label_id(labels, lbl_str);
+	return get_label_id(labels, bpf_label_key(nr, LABEL_KIND_SUCCESS, 0));
 }
 
-int compile_atom(struct filter_block *head, char *atom,
+/*
+ * Parses a set of the form "{NUM, NUM, ...}" into |set|.
+ * Returns the number of values, or 0 on error.
+ */
+static size_t parse_set(char *set_str, unsigned long *set)
+{
+	size_t n = 0;
+	size_t len;
+	char *set_ptr;
+	char *value_str;
+
+	set_str = strip(set_str);
+	len = strlen(set_str);
+	if (len < 2 || set_str[0] != '{' || set_str[len - 1] != '}')
+		return 0;
+	set_str[len - 1] = '\0';
+
+	for (value_str = strtok_r(set_str + 1, ",", &set_ptr); value_str;
+	     value_str = strtok_r(NULL, ",", &set_ptr)) {
+		char *value_ptr;
+
+		if (n == BPF_ARG_SET_MAX)
+			return 0;
+		value_str = strip(value_str);
+		set[n++] = parse_constant(value_str, &value_ptr);
+		if (value_ptr == value_str || *value_ptr != '\0')
+			return 0;
+	}
+	return n;
+}
+
+int compile_atom(struct filter_arena *arena, char *atom,
 		struct bpf_labels *labels, int nr, int group_idx)
 {
 	/* Splits the atom. */
 	char *atom_ptr;
 	char *argidx_str = strtok_r(atom, " ", &atom_ptr);
 	char *operator_str = strtok_r(NULL, " ", &atom_ptr);
-	char *constant_str = strtok_r(NULL, " ", &atom_ptr);
 
-	if (argidx_str == NULL || operator_str == NULL || constant_str == NULL)
+	if (argidx_str == NULL || operator_str == NULL)
 		return -1;
 
 	int op = str_to_op(operator_str);
 	if (op < MIN_OPERATOR)
 		return -1;
 
+	/* Sets may contain spaces, so they take the rest of the atom. */
+	char *constant_str = strtok_r(NULL, op == IN ? "" : " ", &atom_ptr);
+	if (constant_str == NULL)
+		return -1;
+
 	if (strncmp(argidx_str, "arg", 3)) {
 		return -1;
 	}
@@ -180,10 +191,18 @@ int compile_atom(struct filter_block *head, char *atom,
 	if (argidx_ptr == argidx_str + 3)
 		return -1;
 
-	char* constant_str_ptr;
-	long int c = parse_constant(constant_str, &constant_str_ptr);
-	if (constant_str_ptr == constant_str) {
-		return -1;
+	unsigned long set[BPF_ARG_SET_MAX];
+	size_t set_len = 0;
+	long int c = 0;
+	if (op == IN) {
+		set_len = parse_set(constant_str, set);
+		if (set_len == 0)
+			return -1;
+	} else {
+		char *constant_str_ptr;
+		c = parse_constant(constant_str, &constant_str_ptr);
+		if (constant_str_ptr == constant_str)
+			return -1;
 	}
 
 	/*
@@ -201,16 +220,27 @@ int compile_atom(struct filter_block *head, char *atom,
 	 * If this comparison fails, the whole AND statement
 	 * will fail, so we jump to the end of this AND statement.
 	 */
+	size_t start = arena->len;
 	struct sock_filter *comp_block;
-	size_t len = bpf_arg_comp(&comp_block, op, argidx, c, id);
-	if (len == 0)
+	size_t len;
+	if (op == IN) {
+		comp_block = new_instr_buf(arena, BPF_ARG_SET_MAX_LEN(set_len));
+		len = bpf_arg_comp_in(comp_block, argidx, set, set_len, id);
+	} else {
+		comp_block = new_instr_buf(arena, BPF_ARG_COMP_MAX_LEN + 1);
+		len = bpf_arg_comp(comp_block, op, argidx, c, id);
+	}
+	if (len == 0) {
+		arena->len = start;
 		return -1;
+	}
 
-	append_filter_block(head, comp_block, len);
+	/* Give back whatever the comparison didn't use. */
+	arena->len = start + len;
 	return 0;
 }
 
-int compile_errno(struct filter_block *head, char *ret_errno)
+int compile_errno(struct filter_arena *arena, char *ret_errno)
 {
 	char *errno_ptr;
 
@@ -228,15 +258,16 @@ int compile_errno(struct filter_block *head, char *ret_errno)
 		if (errno_val_ptr == errno_val_str || errno_val == -1)
 			return -1;
 
-		append_ret_errno(head, errno_val);
+		append_ret_errno(arena, errno_val);
 	} else {
-		append_ret_kill(head);
+		append_ret_kill(arena);
 	}
 	return 0;
 }
 
-struct filter_block *compile_section(int nr, const char *policy_line,
-		unsigned int entry_lbl_id, struct bpf_labels *labels)
+int compile_section(struct filter_arena *arena, int nr,
+		const char *policy_line, unsigned int entry_lbl_id,
+		struct bpf_labels *labels)
 {
 	/*
 	 * |policy_line| should be an expression of the form:
@@ -249,8 +280,10 @@ struct filter_block *compile_section(int nr, const char *policy_line,
 	 * Atoms are of the form "arg{DNUM} {OP} {NUM}"
 	 * where:
 	 *   - DNUM is a decimal number.
-	 *   - OP is an operator: ==, !=, or & (flags set).
+	 *   - OP is an operator: ==, !=, & (flags set), the unsigned
+	 *     comparisons <, <=, > and >=, or 'in' (set membership).
 	 *   - NUM is an octal, decimal, or hexadecimal number.
+	 *     For 'in', it is instead a set of numbers: "{NUM, NUM, ...}".
 	 *
 	 * When the syscall arguments make the expression true,
 	 * the syscall is allowed. If not, the process is killed.
@@ -270,38 +303,37 @@ struct filter_block *compile_section(int nr, const char *policy_line,
 	 * the syscall will be blocked as above instead of killing the process.
 	 */
 
-	size_t len = 0;
 	int group_idx = 0;
+	struct sock_filter *instrs;
 
 	/* Checks for overly long policy lines. */
 	if (strlen(policy_line) >= MAX_POLICY_LINE_LENGTH)
-		return NULL;
+		return -1;
 
 	/* We will modify |policy_line|, so let's make a copy. */
 	char *line = strndup(policy_line, MAX_POLICY_LINE_LENGTH);
 	if (!line)
-		return NULL;
+		return -1;
 
 	/*
-	 * We build the filter section as a collection of smaller
-	 * "filter blocks" linked together in a singly-linked list.
+	 * We emit the filter section straight into |arena|. On failure,
+	 * the arena is rolled back to |start| so no partial section is left.
 	 */
-	struct filter_block *head = new_filter_block();
+	size_t start = arena->len;
 
 	/*
 	 * Filter sections begin with a label where the main filter
 	 * will jump after checking the syscall number.
 	 */
-	struct sock_filter *entry_label = new_instr_buf(ONE_INSTR);
-	set_bpf_lbl(entry_label, entry_lbl_id);
-	append_filter_block(head, entry_label, ONE_INSTR);
+	instrs = new_instr_buf(arena, ONE_INSTR);
+	set_bpf_lbl(instrs, entry_lbl_id);
 
 	/* Checks whether we're unconditionally blocking this syscall. */
 	if (strncmp(line, "return", strlen("return")) == 0) {
-		if (compile_errno(head, line) < 0)
-			return NULL;
+		if (compile_errno(arena, line) < 0)
+			goto error;
 		free(line);
-		return head;
+		return 0;
 	}
 
 	/* Splits the optional "return <errno>" part. */
@@ -320,23 +352,22 @@ struct filter_block *compile_section(int nr, const char *policy_line,
 		char *comp;
 		while ((comp = tokenize(&group_str, "&&")) != NULL) {
 			/* Compiles each atom into a BPF block. */
-			if (compile_atom(head, comp, labels, nr, group_idx) < 0)
-				return NULL;
+			if (compile_atom(arena, comp, labels, nr, group_idx) < 0)
+				goto error;
 		}
 		/*
 		 * If the AND statement succeeds, we're done,
 		 * so jump to SUCCESS line.
 		 */
 		unsigned int id = success_lbl(labels, nr);
-		struct sock_filter *group_end_block = new_instr_buf(TWO_INSTRS);
-		len = set_bpf_jump_lbl(group_end_block, id);
+		instrs = new_instr_buf(arena, TWO_INSTRS);
+		instrs += set_bpf_jump_lbl(instrs, id);
 		/*
 		 * The end of each AND statement falls after the
 		 * jump to SUCCESS.
 		 */
 		id = group_end_lbl(labels, nr, group_idx++);
-		len += set_bpf_lbl(group_end_block + len, id);
-		append_filter_block(head, group_end_block, len);
+		set_bpf_lbl(instrs, id);
 	}
 
 	/*
@@ -346,10 +377,10 @@ struct filter_block *compile_section(int nr, const char *policy_line,
 	 * otherwise just kill the task.
 	 */
 	if (ret_errno) {
-		if (compile_errno(head, ret_errno) < 0)
-			return NULL;
+		if (compile_errno(arena, ret_errno) < 0)
+			goto error;
 	} else {
-		append_ret_kill(head);
+		append_ret_kill(arena);
 	}
 
 	/*
@@ -357,13 +388,17 @@ struct filter_block *compile_section(int nr, const char *policy_line,
 	 * label. Add that label and BPF RET_ALLOW code now.
 	 */
 	unsigned int id = success_lbl(labels, nr);
-	struct sock_filter *success_block = new_instr_buf(TWO_INSTRS);
-	len = set_bpf_lbl(success_block, id);
-	len += set_bpf_ret_allow(success_block + len);
-	append_filter_block(head, success_block, len);
+	instrs = new_instr_buf(arena, TWO_INSTRS);
+	instrs += set_bpf_lbl(instrs, id);
+	set_bpf_ret_allow(instrs);
 
 	free(line);
-	return head;
+	return 0;
+
+error:
+	arena->len = start;
+	free(line);
+	return -1;
 }
 
 int compile_filter(FILE *policy_file, struct sock_fprog *prog,
@@ -371,37 +406,39 @@ int compile_filter(FILE *policy_file, struct sock_fprog *prog,
 {
 	char line[MAX_LINE_LENGTH];
 	int line_count = 0;
+	int ret = -1;
 
 	struct bpf_labels labels;
-	labels.count = 0;
+	memset(&labels, 0, sizeof(labels));
 
 	if (!policy_file)
 		return -1;
 
-	struct filter_block *head = new_filter_block();
-	struct filter_block *arg_blocks = NULL;
+	/*
+	 * The syscall number jump table and the arg filter sections it
+	 * jumps into are emitted into separate arenas, since the sections
+	 * must all come after the end of the jump table.
+	 */
+	struct filter_arena head, arg_blocks;
+	memset(&head, 0, sizeof(head));
+	memset(&arg_blocks, 0, sizeof(arg_blocks));
 
 	/* Start filter by validating arch. */
-	struct sock_filter *valid_arch = new_instr_buf(ARCH_VALIDATION_LEN);
-	size_t len = bpf_validate_arch(valid_arch);
-	append_filter_block(head, valid_arch, len);
+	bpf_validate_arch(new_instr_buf(&head, ARCH_VALIDATION_LEN));
 
 	/* Load syscall number. */
-	struct sock_filter *load_nr = new_instr_buf(ONE_INSTR);
-	len = bpf_load_syscall_nr(load_nr);
-	append_filter_block(head, load_nr, len);
+	bpf_load_syscall_nr(new_instr_buf(&head, ONE_INSTR));
 
 	/* If we're logging failures, allow the necessary syscalls first. */
 	if (log_failures)
-		allow_log_syscalls(head);
+		allow_log_syscalls(&head);
 
 	/*
 	 * Loop through all the lines in the policy file.
 	 * Build a jump table for the syscall number.
 	 * If the policy line has an arg filter, build the arg filter
 	 * as well.
-	 * Chain the filter sections together and dump them into
-	 * the final buffer at the end.
+	 * Append the filter sections to the jump table at the end.
 	 */
 	while (fgets(line, sizeof(line), policy_file)) {
 		++line_count;
@@ -416,13 +453,13 @@ int compile_filter(FILE *policy_file, struct sock_fprog *prog,
 			continue;
 
 		if (!policy_line)
-			return -1;
+			goto out;
 
 		nr = lookup_syscall(syscall_name);
 		if (nr < 0) {
 			warn("compile_filter: nonexistent syscall '%s'",
 			     syscall_name);
-			return -1;
+			goto out;
 		}
 
 		policy_line = strip(policy_line);
@@ -433,30 +470,21 @@ int compile_filter(FILE *policy_file, struct sock_fprog *prog,
 		 */
 		if (strcmp(policy_line, "1") == 0) {
 			/* Add simple ALLOW. */
-			append_allow_syscall(head, nr);
+			append_allow_syscall(&head, nr);
 		} else {
 			/*
 			 * Create and jump to the label that will hold
 			 * the arg filter block.
 			 */
-			unsigned int id = bpf_label_id(&labels, syscall_name);
-			struct sock_filter *nr_comp =
-					new_instr_buf(ALLOW_SYSCALL_LEN);
-			bpf_allow_syscall_args(nr_comp, nr, id);
-			append_filter_block(head, nr_comp, ALLOW_SYSCALL_LEN);
+			unsigned int id = entry_lbl(&labels, nr);
+			bpf_allow_syscall_args(
+				new_instr_buf(&head, ALLOW_SYSCALL_LEN),
+				nr, id);
 
 			/* Build the arg filter block. */
-			struct filter_block *block =
-				compile_section(nr, policy_line, id, &labels);
-
-			if (!block)
-				return -1;
-
-			if (arg_blocks) {
-				extend_filter_block_list(arg_blocks, block);
-			} else {
-				arg_blocks = block;
-			}
+			if (compile_section(&arg_blocks, nr, policy_line, id,
+					    &labels) < 0)
+				goto out;
 		}
 	}
 
@@ -465,65 +493,44 @@ int compile_filter(FILE *policy_file, struct sock_fprog *prog,
 	 * or return TRAP.
 	 */
 	if (!log_failures)
-		append_ret_kill(head);
+		append_ret_kill(&head);
 	else
-		append_ret_trap(head);
-
-	/* Allocate the final buffer, now that we know its size. */
-	size_t final_filter_len = head->total_len +
-		(arg_blocks? arg_blocks->total_len : 0);
-	if (final_filter_len > BPF_MAXINSNS)
-		return -1;
-
-	struct sock_filter *final_filter =
-			calloc(final_filter_len, sizeof(struct sock_filter));
+		append_ret_trap(&head);
 
-	if (flatten_block_list(head, final_filter, 0, final_filter_len) < 0)
-		return -1;
-
-	if (flatten_block_list(arg_blocks, final_filter,
-			head->total_len, final_filter_len) < 0)
-		return -1;
-
-	free_block_list(head);
-	free_block_list(arg_blocks);
-
-	bpf_resolve_jumps(&labels, final_filter, final_filter_len);
-
-	free_label_strings(&labels);
-
-	prog->filter = final_filter;
-	prog->len = final_filter_len;
-	return 0;
-}
-
-int flatten_block_list(struct filter_block *head, struct sock_filter *filter,
-		size_t index, size_t cap)
-{
-	size_t _index = index;
-
-	struct filter_block *curr;
-	size_t i;
-
-	for (curr = head; curr; curr = curr->next) {
-		for (i = 0; i < curr->len; i++) {
-			if (_index >= cap)
-				return -1;
-			filter[_index++] = curr->instrs[i];
-		}
+	/* Append the arg filter sections after the jump table. */
+	if (arg_blocks.len) {
+		memcpy(new_instr_buf(&head, arg_blocks.len), arg_blocks.instrs,
+		       arg_blocks.len * sizeof(struct sock_filter));
 	}
-	return 0;
-}
 
-void free_block_list(struct filter_block *head)
-{
-	struct filter_block *current, *prev;
-
-	current = head;
-	while (current) {
-		free(current->instrs);
-		prev = current;
-		current = current->next;
-		free(prev);
+	if (bpf_resolve_jumps(&labels, head.instrs, head.len))
+		goto out;
+
+	/* Strip out the dead weight left behind by labels and sections. */
+	size_t unoptimized_len = head.len;
+	head.len = bpf_optimize(head.instrs, head.len);
+	if (head.len < unoptimized_len)
+		info("optimized seccomp filter: %zu -> %zu instructions "
+		     "(%zu saved)", unoptimized_len, head.len,
+		     unoptimized_len - head.len);
+
+	if (head.len > BPF_MAXINSNS) {
+		warn("compile_filter: filter too long (%zu instructions)",
+		     head.len);
+		goto out;
 	}
+	if (bpf_check_jumps(head.instrs, head.len))
+		goto out;
+
+	/* Hand the arena's buffer over to |prog|. */
+	prog->filter = head.instrs;
+	prog->len = head.len;
+	memset(&head, 0, sizeof(head));
+	ret = 0;
+
+out:
+	free_arena(&head);
+	free_arena(&arg_blocks);
+	free_labels(&labels);
+	return ret;
 }
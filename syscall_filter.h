@@ -14,24 +14,30 @@
 #define NO_LOGGING  0
 #define USE_LOGGING 1
 
-struct filter_block {
+/*
+ * Per-compilation instruction arena. Filter blocks are carved out of one
+ * growable buffer and emitted in place, so compiling a policy takes a
+ * handful of allocations and the arena is freed in one go, on success
+ * and on every error path alike. A zeroed struct is a valid empty arena.
+ *
+ * Pointers returned by new_instr_buf() are only valid until the next
+ * allocation from the same arena, since the buffer may move as it grows.
+ */
+struct filter_arena {
 	struct sock_filter *instrs;
 	size_t len;
-
-	struct filter_block *next;
-	struct filter_block *last;
-	size_t total_len;
+	size_t cap;
 };
 
 struct bpf_labels;
 
-struct filter_block *compile_section(int nr, const char *policy_line,
-		unsigned int label_id, struct bpf_labels *labels);
+struct sock_filter *new_instr_buf(struct filter_arena *arena, size_t count);
+void free_arena(struct filter_arena *arena);
+
+int compile_section(struct filter_arena *arena, int nr,
+		const char *policy_line, unsigned int label_id,
+		struct bpf_labels *labels);
 int compile_filter(FILE *policy_file, struct sock_fprog *prog,
 		int log_failures);
 
-int flatten_block_list(struct filter_block *head, struct sock_filter *filter,
-		size_t index, size_t cap);
-void free_block_list(struct filter_block *head);
-
 #endif /* SYSCALL_FILTER_H */
@@ -13,6 +13,7 @@
 #include "test_harness.h"
 
 #include "bpf.h"
+#include "libsyscalls.h"
 #include "syscall_filter.h"
 
 #include "util.h"
@@ -31,8 +32,8 @@ do {	\
 
 #define EXPECT_COMP(_block) \
 do {	\
-	EXPECT_EQ((_block)->len, BPF_ARG_COMP_LEN + 1);			\
-	EXPECT_EQ((_block)->instrs->code, BPF_LD+BPF_W+BPF_ABS);	\
+	EXPECT_EQ((_block)[0].code, BPF_LD+BPF_W+BPF_ABS);		\
+	EXPECT_JUMP_LBL(&(_block)[BPF_ARG_COMP_LEN]);			\
 } while (0)
 
 #define EXPECT_LBL(_block) \
@@ -51,23 +52,17 @@ do {	\
 
 #define EXPECT_GROUP_END(_block) \
 do {	\
-	EXPECT_EQ((_block)->len, 2U);			\
-	EXPECT_JUMP_LBL(&(_block)->instrs[0]);		\
-	EXPECT_LBL(&(_block)->instrs[1]);		\
+	EXPECT_JUMP_LBL(&(_block)[0]);			\
+	EXPECT_LBL(&(_block)[1]);			\
 } while (0)
 
 #define EXPECT_KILL(_block) \
-do {	\
-	EXPECT_EQ((_block)->len, 1U);				\
-	EXPECT_EQ_STMT(_block->instrs,				\
-			BPF_RET+BPF_K, SECCOMP_RET_KILL);	\
-} while (0)
+	EXPECT_EQ_STMT(_block, BPF_RET+BPF_K, SECCOMP_RET_KILL)
 
 #define EXPECT_ALLOW(_block) \
 do {	\
-	EXPECT_EQ((_block)->len, 2U);				\
-	EXPECT_LBL(&(_block)->instrs[0]);			\
-	EXPECT_EQ_STMT(&(_block)->instrs[1],			\
+	EXPECT_LBL(&(_block)[0]);				\
+	EXPECT_EQ_STMT(&(_block)[1],				\
 			BPF_RET+BPF_K, SECCOMP_RET_ALLOW);	\
 } while (0)
 
@@ -95,6 +90,77 @@ do {	\
 			BPF_JMP+BPF_JA, (_id), (_jt), (_jf));		\
 } while (0)
 
+/*
+ * Optimized filters share a single RET per action, so conditional jumps
+ * are checked by absolute target index rather than by shape.
+ */
+#define EXPECT_JEQ_TO(_prog, _idx, _k, _jt_idx, _jf_idx) \
+	EXPECT_EQ_BLOCK(&(_prog)[_idx], BPF_JMP+BPF_JEQ+BPF_K, (_k),	\
+			(_jt_idx) - (_idx) - 1, (_jf_idx) - (_idx) - 1)
+
+#define EXPECT_RET(_prog, _idx, _action) \
+	EXPECT_EQ_STMT(&(_prog)[_idx], BPF_RET+BPF_K, (_action))
+
+/*
+ * Minimal classic BPF evaluator covering what compile_filter() emits.
+ * Returns the RET value, or 0xdeadbeef if the program falls off the end
+ * or uses an unexpected opcode.
+ */
+static unsigned int run_filter(const struct sock_fprog *prog,
+			       const struct seccomp_data *data)
+{
+	unsigned int a = 0, mem[BPF_MEMWORDS];
+	size_t pc = 0;
+
+	memset(mem, 0, sizeof(mem));
+	while (pc < prog->len) {
+		const struct sock_filter *insn = &prog->filter[pc++];
+		switch (insn->code) {
+		case BPF_LD+BPF_W+BPF_ABS:
+			memcpy(&a, (const char *)data + insn->k, sizeof(a));
+			break;
+		case BPF_LD+BPF_MEM:
+			a = mem[insn->k];
+			break;
+		case BPF_ST:
+			mem[insn->k] = a;
+			break;
+		case BPF_JMP+BPF_JA:
+			pc += insn->k;
+			break;
+		case BPF_JMP+BPF_JEQ+BPF_K:
+			pc += (a == insn->k) ? insn->jt : insn->jf;
+			break;
+		case BPF_JMP+BPF_JSET+BPF_K:
+			pc += (a & insn->k) ? insn->jt : insn->jf;
+			break;
+		case BPF_JMP+BPF_JGT+BPF_K:
+			pc += (a > insn->k) ? insn->jt : insn->jf;
+			break;
+		case BPF_JMP+BPF_JGE+BPF_K:
+			pc += (a >= insn->k) ? insn->jt : insn->jf;
+			break;
+		case BPF_RET+BPF_K:
+			return insn->k;
+		default:
+			return 0xdeadbeef;
+		}
+	}
+	return 0xdeadbeef;
+}
+
+static unsigned int run_syscall(const struct sock_fprog *prog, int nr,
+				unsigned long arg0)
+{
+	struct seccomp_data data;
+
+	memset(&data, 0, sizeof(data));
+	data.nr = nr;
+	data.arch = ARCH_NR;
+	data.args[0] = arg0;
+	return run_filter(prog, &data);
+}
+
 
 FIXTURE(bpf) {};
 
@@ -175,14 +241,55 @@ TEST_F(bpf, bpf_comp_jset) {
 #endif
 }
 
+TEST_F(bpf, bpf_comp_jgt) {
+	struct sock_filter comp_jgt[BPF_ORD_COMP_LEN];
+	unsigned long c = 1;
+	unsigned char jt = 1;
+	unsigned char jf = 2;
+
+	size_t len = bpf_comp_jgt(comp_jgt, c, jt, jf);
+
+	EXPECT_EQ(len, BPF_ORD_COMP_LEN);
+
+#if defined(BITS32)
+	EXPECT_EQ_BLOCK(&comp_jgt[0],
+			BPF_JMP+BPF_JGT+BPF_K, c, jt, jf);
+#elif defined(BITS64)
+	EXPECT_EQ_BLOCK(&comp_jgt[0],
+			BPF_JMP+BPF_JGT+BPF_K, 0, jt + 3, 0);
+	EXPECT_EQ_BLOCK(&comp_jgt[1],
+			BPF_JMP+BPF_JEQ+BPF_K, 0, 0, jf + 2);
+	EXPECT_EQ_STMT(&comp_jgt[2], BPF_LD+BPF_MEM, 0);
+	EXPECT_EQ_BLOCK(&comp_jgt[3],
+			BPF_JMP+BPF_JGT+BPF_K, c, jt, jf);
+#endif
+}
+
+TEST_F(bpf, bpf_arg_comp_in) {
+	struct sock_filter arg_comp[BPF_ARG_SET_MAX_LEN(8)];
+	const unsigned long set[] = { 8, 1, 5, 3, 1, 13, 21, 2 };
+	unsigned int label_id = 0;
+
+	size_t len = bpf_arg_comp_in(arg_comp, 0, set, 8, label_id);
+
+	/* Duplicates are dropped; the rest is a search tree. */
+	EXPECT_LE(BPF_LOAD_ARG_LEN + 7 + 1, len);
+	EXPECT_GE(BPF_ARG_SET_MAX_LEN(8), len);
+	EXPECT_JUMP_LBL(&arg_comp[len - 1]);
+
+	EXPECT_EQ(bpf_arg_comp_in(arg_comp, 0, set, 0, label_id), 0U);
+	EXPECT_EQ(bpf_arg_comp_in(arg_comp, 0, set, BPF_ARG_SET_MAX + 1,
+				  label_id), 0U);
+}
+
 TEST_F(bpf, bpf_arg_comp) {
-	struct sock_filter *arg_comp;
+	struct sock_filter arg_comp[BPF_ARG_COMP_LEN + 1];
 	int op = EQ;
 	int argidx = 1;
 	unsigned long c = 3;
 	unsigned int label_id = 0;
 
-	size_t len = bpf_arg_comp(&arg_comp, op, argidx, c, label_id);
+	size_t len = bpf_arg_comp(arg_comp, op, argidx, c, label_id);
 
 	EXPECT_EQ(len, BPF_ARG_COMP_LEN + 1);
 
@@ -207,7 +314,6 @@ TEST_F(bpf, bpf_arg_comp) {
 			BPF_JMP+BPF_JEQ+BPF_K, c, 1, 0);
 	EXPECT_JUMP_LBL(&arg_comp[7]);
 #endif
-	free(arg_comp);
 }
 
 TEST_F(bpf, bpf_validate_arch) {
@@ -240,95 +346,160 @@ TEST_F(bpf, bpf_allow_syscall_args) {
 	EXPECT_ALLOW_SYSCALL_ARGS(allow_syscall, nr, id, JUMP_JT, JUMP_JF);
 }
 
+TEST_F(bpf, bpf_label_id) {
+	struct bpf_labels labels;
+	int nr, id;
+	/* Force the table to grow well past its initial capacity. */
+	const int nlabels = 4 * BPF_LABELS_INITIAL_CAP;
+
+	memset(&labels, 0, sizeof(labels));
+	for (nr = 0; nr < nlabels; nr++) {
+		id = bpf_label_id(&labels,
+				  bpf_label_key(nr, LABEL_KIND_SUCCESS, 0));
+		EXPECT_EQ(id, nr);
+	}
+	EXPECT_EQ(labels.count, nlabels);
+
+	/* Existing keys map back to the same id. */
+	for (nr = 0; nr < nlabels; nr++) {
+		id = bpf_label_id(&labels,
+				  bpf_label_key(nr, LABEL_KIND_SUCCESS, 0));
+		EXPECT_EQ(id, nr);
+	}
+	EXPECT_EQ(labels.count, nlabels);
+
+	/* Keys differing only in kind or group are distinct labels. */
+	id = bpf_label_id(&labels, bpf_label_key(0, LABEL_KIND_GROUP_END, 0));
+	EXPECT_EQ(id, nlabels);
+	id = bpf_label_id(&labels, bpf_label_key(0, LABEL_KIND_GROUP_END, 1));
+	EXPECT_EQ(id, nlabels + 1);
+
+	free_labels(&labels);
+}
+
+TEST_F(bpf, bpf_optimize) {
+	struct sock_filter prog[] = {
+		BPF_STMT(BPF_LD+BPF_W+BPF_ABS, syscall_nr),
+		BPF_JUMP(BPF_JMP+BPF_JA, 0, 0, 0),	/* no-op */
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, __NR_read, 0, 3),
+		BPF_STMT(BPF_LD+BPF_W+BPF_ABS, syscall_nr),	/* redundant */
+		BPF_JUMP(BPF_JMP+BPF_JA, 0, 0, 0),	/* no-op */
+		BPF_JUMP(BPF_JMP+BPF_JA, 2, 0, 0),	/* jump to a RET */
+		BPF_STMT(BPF_RET+BPF_K, SECCOMP_RET_KILL),
+		BPF_STMT(BPF_RET+BPF_K, SECCOMP_RET_KILL),
+		BPF_STMT(BPF_RET+BPF_K, SECCOMP_RET_ALLOW),
+	};
+	size_t len = bpf_optimize(prog, sizeof(prog) / sizeof(prog[0]));
+
+	/*
+	 * The no-ops and the reload go away, the JA becomes a copy of the
+	 * ALLOW it targets (leaving the original unreachable), and the two
+	 * KILLs merge.
+	 */
+	EXPECT_EQ(len, 4U);
+	EXPECT_EQ_STMT(&prog[0], BPF_LD+BPF_W+BPF_ABS, syscall_nr);
+	EXPECT_EQ_BLOCK(&prog[1], BPF_JMP+BPF_JEQ+BPF_K, __NR_read, 0, 1);
+	EXPECT_EQ_STMT(&prog[2], BPF_RET+BPF_K, SECCOMP_RET_ALLOW);
+	EXPECT_EQ_STMT(&prog[3], BPF_RET+BPF_K, SECCOMP_RET_KILL);
+}
+
+TEST_F(bpf, bpf_check_jumps) {
+	struct sock_filter prog[] = {
+		BPF_STMT(BPF_LD+BPF_W+BPF_ABS, syscall_nr),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, __NR_read, 0, 1),
+		BPF_STMT(BPF_RET+BPF_K, SECCOMP_RET_ALLOW),
+		BPF_STMT(BPF_RET+BPF_K, SECCOMP_RET_KILL),
+	};
+	size_t len = sizeof(prog) / sizeof(prog[0]);
+
+	EXPECT_EQ(bpf_check_jumps(prog, len), 0);
+
+	/* A conditional jump past the end. */
+	prog[1].jf = 2;
+	EXPECT_EQ(bpf_check_jumps(prog, len), -1);
+	prog[1].jf = 1;
+
+	/* A JA past the end. */
+	set_bpf_jump(&prog[2], BPF_JMP+BPF_JA, 1, 0, 0);
+	EXPECT_EQ(bpf_check_jumps(prog, len), -1);
+
+	/* Falling off the end. */
+	EXPECT_EQ(bpf_check_jumps(prog, len - 1), -1);
+}
+
 FIXTURE(arg_filter) {
 	struct bpf_labels labels;
+	struct filter_arena arena;
 };
 
 FIXTURE_SETUP(arg_filter) {}
-FIXTURE_TEARDOWN(arg_filter) {}
+FIXTURE_TEARDOWN(arg_filter) {
+	free_arena(&self->arena);
+	free_labels(&self->labels);
+}
 
 TEST_F(arg_filter, arg0_equals) {
 	const char *fragment = "arg0 == 0";
 	int nr = 1;
 	unsigned int id = 0;
-	struct filter_block *block =
-		compile_section(nr, fragment, id, &self->labels);
+	int res = compile_section(&self->arena, nr, fragment, id,
+			&self->labels);
 
-	ASSERT_NE(block, NULL);
+	ASSERT_EQ(res, 0);
 	size_t exp_total_len = 1 + (BPF_ARG_COMP_LEN + 1) + 2 + 1 + 2;
-	EXPECT_EQ(block->total_len, exp_total_len);
+	EXPECT_EQ(self->arena.len, exp_total_len);
 
 	/* First block is a label. */
-	struct filter_block *curr_block = block;
-	ASSERT_NE(curr_block, NULL);
-	EXPECT_EQ(block->len, 1U);
-	EXPECT_LBL(curr_block->instrs);
+	struct sock_filter *curr_block = self->arena.instrs;
+	EXPECT_LBL(curr_block);
 
 	/* Second block is a comparison. */
-	curr_block = block->next;
+	curr_block += 1;
 	EXPECT_COMP(curr_block);
 
 	/* Third block is a jump and a label (end of AND group). */
-	curr_block = curr_block->next;
-	EXPECT_NE(curr_block, NULL);
+	curr_block += BPF_ARG_COMP_LEN + 1;
 	EXPECT_GROUP_END(curr_block);
 
 	/* Fourth block is SECCOMP_RET_KILL */
-	curr_block = curr_block->next;
-	EXPECT_NE(curr_block, NULL);
+	curr_block += 2;
 	EXPECT_KILL(curr_block);
 
 	/* Fifth block is "SUCCESS" label and SECCOMP_RET_ALLOW */
-	curr_block = curr_block->next;
-	EXPECT_NE(curr_block, NULL);
+	curr_block += 1;
 	EXPECT_ALLOW(curr_block);
-
-	EXPECT_EQ(curr_block->next, NULL);
-
-	free_block_list(block);
-	free_label_strings(&self->labels);
 }
 
 TEST_F(arg_filter, arg0_mask) {
 	const char *fragment = "arg1 & 02";	/* O_RDWR */
 	int nr = 1;
 	unsigned int id = 0;
-	struct filter_block *block =
-		compile_section(nr, fragment, id, &self->labels);
+	int res = compile_section(&self->arena, nr, fragment, id,
+			&self->labels);
 
-	ASSERT_NE(block, NULL);
+	ASSERT_EQ(res, 0);
 	size_t exp_total_len = 1 + (BPF_ARG_COMP_LEN + 1) + 2 + 1 + 2;
-	EXPECT_EQ(block->total_len, exp_total_len);
+	EXPECT_EQ(self->arena.len, exp_total_len);
 
 	/* First block is a label. */
-	struct filter_block *curr_block = block;
-	ASSERT_NE(curr_block, NULL);
-	EXPECT_EQ(block->len, 1U);
-	EXPECT_LBL(curr_block->instrs);
+	struct sock_filter *curr_block = self->arena.instrs;
+	EXPECT_LBL(curr_block);
 
 	/* Second block is a comparison. */
-	curr_block = block->next;
+	curr_block += 1;
 	EXPECT_COMP(curr_block);
 
 	/* Third block is a jump and a label (end of AND group). */
-	curr_block = curr_block->next;
-	EXPECT_NE(curr_block, NULL);
+	curr_block += BPF_ARG_COMP_LEN + 1;
 	EXPECT_GROUP_END(curr_block);
 
 	/* Fourth block is SECCOMP_RET_KILL */
-	curr_block = curr_block->next;
-	EXPECT_NE(curr_block, NULL);
+	curr_block += 2;
 	EXPECT_KILL(curr_block);
 
 	/* Fifth block is "SUCCESS" label and SECCOMP_RET_ALLOW */
-	curr_block = curr_block->next;
-	EXPECT_NE(curr_block, NULL);
+	curr_block += 1;
 	EXPECT_ALLOW(curr_block);
-
-	EXPECT_EQ(curr_block->next, NULL);
-
-	free_block_list(block);
-	free_label_strings(&self->labels);
 }
 
 TEST_F(arg_filter, and_or) {
@@ -336,57 +507,43 @@ TEST_F(arg_filter, and_or) {
 	int nr = 1;
 	unsigned int id = 0;
 
-	struct filter_block *block =
-		compile_section(nr, fragment, id, &self->labels);
-	ASSERT_NE(block, NULL);
+	int res = compile_section(&self->arena, nr, fragment, id,
+			&self->labels);
+	ASSERT_EQ(res, 0);
 	size_t exp_total_len = 1 + 3 * (BPF_ARG_COMP_LEN + 1) + 2 + 2 + 1 + 2;
-	EXPECT_EQ(block->total_len, exp_total_len);
+	EXPECT_EQ(self->arena.len, exp_total_len);
 
 	/* First block is a label. */
-	struct filter_block *curr_block = block;
-	ASSERT_NE(curr_block, NULL);
-	EXPECT_EQ(block->len, 1U);
-	EXPECT_LBL(curr_block->instrs);
+	struct sock_filter *curr_block = self->arena.instrs;
+	EXPECT_LBL(curr_block);
 
 	/* Second block is a comparison ("arg0 == 0"). */
-	curr_block = curr_block->next;
-	EXPECT_NE(curr_block, NULL);
+	curr_block += 1;
 	EXPECT_COMP(curr_block);
 
 	/* Third block is a comparison ("arg1 == 0"). */
-	curr_block = curr_block->next;
-	EXPECT_NE(curr_block, NULL);
+	curr_block += BPF_ARG_COMP_LEN + 1;
 	EXPECT_COMP(curr_block);
 
 	/* Fourth block is a jump and a label (end of AND group). */
-	curr_block = curr_block->next;
-	EXPECT_NE(curr_block, NULL);
+	curr_block += BPF_ARG_COMP_LEN + 1;
 	EXPECT_GROUP_END(curr_block);
 
 	/* Fifth block is a comparison ("arg0 == 1"). */
-	curr_block = curr_block->next;
-	EXPECT_NE(curr_block, NULL);
+	curr_block += 2;
 	EXPECT_COMP(curr_block);
 
 	/* Sixth block is a jump and a label (end of AND group). */
-	curr_block = curr_block->next;
-	EXPECT_NE(curr_block, NULL);
+	curr_block += BPF_ARG_COMP_LEN + 1;
 	EXPECT_GROUP_END(curr_block);
 
 	/* Seventh block is SECCOMP_RET_KILL */
-	curr_block = curr_block->next;
-	EXPECT_NE(curr_block, NULL);
+	curr_block += 2;
 	EXPECT_KILL(curr_block);
 
 	/* Eigth block is "SUCCESS" label and SECCOMP_RET_ALLOW */
-	curr_block = curr_block->next;
-	EXPECT_NE(curr_block, NULL);
+	curr_block += 1;
 	EXPECT_ALLOW(curr_block);
-
-	EXPECT_EQ(curr_block->next, NULL);
-
-	free_block_list(block);
-	free_label_strings(&self->labels);
 }
 
 TEST_F(arg_filter, ret_errno) {
@@ -394,55 +551,41 @@ TEST_F(arg_filter, ret_errno) {
 	int nr = 1;
 	unsigned int id = 0;
 
-	struct filter_block *block =
-		compile_section(nr, fragment, id, &self->labels);
-	ASSERT_NE(block, NULL);
+	int res = compile_section(&self->arena, nr, fragment, id,
+			&self->labels);
+	ASSERT_EQ(res, 0);
 	size_t exp_total_len = 1 + 2 * (BPF_ARG_COMP_LEN + 1) + 2 + 2 + 1 + 2;
-	EXPECT_EQ(block->total_len, exp_total_len);
+	EXPECT_EQ(self->arena.len, exp_total_len);
 
 	/* First block is a label. */
-	struct filter_block *curr_block = block;
-	ASSERT_NE(curr_block, NULL);
-	EXPECT_EQ(block->len, 1U);
-	EXPECT_LBL(curr_block->instrs);
+	struct sock_filter *curr_block = self->arena.instrs;
+	EXPECT_LBL(curr_block);
 
 	/* Second block is a comparison ("arg0 == 0"). */
-	curr_block = curr_block->next;
-	EXPECT_NE(curr_block, NULL);
+	curr_block += 1;
 	EXPECT_COMP(curr_block);
 
 	/* Third block is a jump and a label (end of AND group). */
-	curr_block = curr_block->next;
-	EXPECT_NE(curr_block, NULL);
+	curr_block += BPF_ARG_COMP_LEN + 1;
 	EXPECT_GROUP_END(curr_block);
 
 	/* Fourth block is a comparison ("arg0 == 1"). */
-	curr_block = curr_block->next;
-	EXPECT_NE(curr_block, NULL);
+	curr_block += 2;
 	EXPECT_COMP(curr_block);
 
 	/* Fifth block is a jump and a label (end of AND group). */
-	curr_block = curr_block->next;
-	EXPECT_NE(curr_block, NULL);
+	curr_block += BPF_ARG_COMP_LEN + 1;
 	EXPECT_GROUP_END(curr_block);
 
 	/* Sixth block is SECCOMP_RET_ERRNO */
-	curr_block = curr_block->next;
-	EXPECT_NE(curr_block, NULL);
-	EXPECT_EQ(curr_block->len, 1U);
-	EXPECT_EQ_STMT(curr_block->instrs,
+	curr_block += 2;
+	EXPECT_EQ_STMT(curr_block,
 			BPF_RET+BPF_K,
 			SECCOMP_RET_ERRNO | (1 & SECCOMP_RET_DATA));
 
 	/* Seventh block is "SUCCESS" label and SECCOMP_RET_ALLOW */
-	curr_block = curr_block->next;
-	EXPECT_NE(curr_block, NULL);
+	curr_block += 1;
 	EXPECT_ALLOW(curr_block);
-
-	EXPECT_EQ(curr_block->next, NULL);
-
-	free_block_list(block);
-	free_label_strings(&self->labels);
 }
 
 TEST_F(arg_filter, unconditional_errno) {
@@ -450,30 +593,21 @@ TEST_F(arg_filter, unconditional_errno) {
 	int nr = 1;
 	unsigned int id = 0;
 
-	struct filter_block *block =
-		compile_section(nr, fragment, id, &self->labels);
-	ASSERT_NE(block, NULL);
+	int res = compile_section(&self->arena, nr, fragment, id,
+			&self->labels);
+	ASSERT_EQ(res, 0);
 	size_t exp_total_len = 2;
-	EXPECT_EQ(block->total_len, exp_total_len);
+	EXPECT_EQ(self->arena.len, exp_total_len);
 
 	/* First block is a label. */
-	struct filter_block *curr_block = block;
-	ASSERT_NE(curr_block, NULL);
-	EXPECT_EQ(block->len, 1U);
-	EXPECT_LBL(curr_block->instrs);
+	struct sock_filter *curr_block = self->arena.instrs;
+	EXPECT_LBL(curr_block);
 
 	/* Second block is SECCOMP_RET_ERRNO */
-	curr_block = curr_block->next;
-	EXPECT_NE(curr_block, NULL);
-	EXPECT_EQ(curr_block->len, 1U);
-	EXPECT_EQ_STMT(curr_block->instrs,
+	curr_block += 1;
+	EXPECT_EQ_STMT(curr_block,
 			BPF_RET+BPF_K,
 			SECCOMP_RET_ERRNO | (1 & SECCOMP_RET_DATA));
-
-	EXPECT_EQ(curr_block->next, NULL);
-
-	free_block_list(block);
-	free_label_strings(&self->labels);
 }
 
 TEST_F(arg_filter, invalid) {
@@ -481,13 +615,31 @@ TEST_F(arg_filter, invalid) {
 	int nr = 1;
 	unsigned int id = 0;
 
-	struct filter_block *block =
-			compile_section(nr, fragment, id, &self->labels);
-	ASSERT_EQ(block, NULL);
+	int res = compile_section(&self->arena, nr, fragment, id,
+			&self->labels);
+	ASSERT_EQ(res, -1);
+	/* Failed sections leave nothing behind in the arena. */
+	EXPECT_EQ(self->arena.len, 0U);
 
 	fragment = "arg0 == 0 && arg1 == 1; return errno";
-	block = compile_section(nr, fragment, id, &self->labels);
-	ASSERT_EQ(block, NULL);
+	res = compile_section(&self->arena, nr, fragment, id, &self->labels);
+	ASSERT_EQ(res, -1);
+	EXPECT_EQ(self->arena.len, 0U);
+
+	fragment = "arg0 in {1, 2";
+	res = compile_section(&self->arena, nr, fragment, id, &self->labels);
+	ASSERT_EQ(res, -1);
+	EXPECT_EQ(self->arena.len, 0U);
+
+	fragment = "arg0 in {}";
+	res = compile_section(&self->arena, nr, fragment, id, &self->labels);
+	ASSERT_EQ(res, -1);
+	EXPECT_EQ(self->arena.len, 0U);
+
+	fragment = "arg0 in {1, two}";
+	res = compile_section(&self->arena, nr, fragment, id, &self->labels);
+	ASSERT_EQ(res, -1);
+	EXPECT_EQ(self->arena.len, 0U);
 }
 
 FIXTURE(filter) {};
@@ -504,22 +656,20 @@ TEST_F(filter, seccomp_mode1) {
 	 * Checks return value, filter length, and that the filter
 	 * validates arch, loads syscall number, and
 	 * only allows expected syscalls.
+	 * The optimizer merges the arch check's KILL with the final one and
+	 * points every allowed syscall at a single ALLOW.
 	 */
 	ASSERT_EQ(res, 0);
-	EXPECT_EQ(actual.len, 13);
-	EXPECT_ARCH_VALIDATION(actual.filter);
-	EXPECT_EQ_STMT(actual.filter + ARCH_VALIDATION_LEN,
-			BPF_LD+BPF_W+BPF_ABS, syscall_nr);
-	EXPECT_ALLOW_SYSCALL(actual.filter + ARCH_VALIDATION_LEN + 1,
-			__NR_read);
-	EXPECT_ALLOW_SYSCALL(actual.filter + ARCH_VALIDATION_LEN + 3,
-			__NR_write);
-	EXPECT_ALLOW_SYSCALL(actual.filter + ARCH_VALIDATION_LEN + 5,
-			__NR_rt_sigreturn);
-	EXPECT_ALLOW_SYSCALL(actual.filter + ARCH_VALIDATION_LEN + 7,
-			__NR_exit);
-	EXPECT_EQ_STMT(actual.filter + ARCH_VALIDATION_LEN + 9, BPF_RET+BPF_K,
-			SECCOMP_RET_KILL);
+	EXPECT_EQ(actual.len, 9);
+	EXPECT_EQ_STMT(&actual.filter[0], BPF_LD+BPF_W+BPF_ABS, arch_nr);
+	EXPECT_JEQ_TO(actual.filter, 1, ARCH_NR, 2, 8);
+	EXPECT_EQ_STMT(&actual.filter[2], BPF_LD+BPF_W+BPF_ABS, syscall_nr);
+	EXPECT_JEQ_TO(actual.filter, 3, __NR_read, 7, 4);
+	EXPECT_JEQ_TO(actual.filter, 4, __NR_write, 7, 5);
+	EXPECT_JEQ_TO(actual.filter, 5, __NR_rt_sigreturn, 7, 6);
+	EXPECT_JEQ_TO(actual.filter, 6, __NR_exit, 7, 8);
+	EXPECT_RET(actual.filter, 7, SECCOMP_RET_ALLOW);
+	EXPECT_RET(actual.filter, 8, SECCOMP_RET_KILL);
 
 	free(actual.filter);
 	fclose(policy);
@@ -531,28 +681,109 @@ TEST_F(filter, seccomp_read_write) {
 	int res = compile_filter(policy, &actual, NO_LOGGING);
 
 	/*
-	 * Checks return value, filter length, and that the filter
-	 * validates arch, loads syscall number, and
-	 * only allows expected syscalls, jumping to correct arg filter
-	 * offsets.
+	 * Checks return value, and that the filter validates arch, loads
+	 * syscall number, and only allows expected syscalls with the expected
+	 * arguments.
 	 */
 	ASSERT_EQ(res, 0);
-	size_t exp_total_len = 27 + 3 * (BPF_ARG_COMP_LEN + 1);
-	EXPECT_EQ(actual.len, exp_total_len);
+	EXPECT_GT(27 + 3 * (BPF_ARG_COMP_LEN + 1), actual.len);
+
+	EXPECT_EQ_STMT(&actual.filter[0], BPF_LD+BPF_W+BPF_ABS, arch_nr);
+	EXPECT_EQ_STMT(&actual.filter[2], BPF_LD+BPF_W+BPF_ABS, syscall_nr);
+	EXPECT_RET(actual.filter, actual.len - 1, SECCOMP_RET_ALLOW);
+	EXPECT_RET(actual.filter, actual.len - 2, SECCOMP_RET_KILL);
+
+	EXPECT_EQ(run_syscall(&actual, __NR_read, 0), SECCOMP_RET_ALLOW);
+	EXPECT_EQ(run_syscall(&actual, __NR_read, 1), SECCOMP_RET_KILL);
+	EXPECT_EQ(run_syscall(&actual, __NR_write, 0), SECCOMP_RET_KILL);
+	EXPECT_EQ(run_syscall(&actual, __NR_write, 1), SECCOMP_RET_ALLOW);
+	EXPECT_EQ(run_syscall(&actual, __NR_write, 2), SECCOMP_RET_ALLOW);
+	EXPECT_EQ(run_syscall(&actual, __NR_write, 3), SECCOMP_RET_KILL);
+	EXPECT_EQ(run_syscall(&actual, __NR_exit, 0), SECCOMP_RET_ALLOW);
+	EXPECT_EQ(run_syscall(&actual, __NR_open, 0), SECCOMP_RET_KILL);
+#if defined(BITS64)
+	/* The upper half of a 64-bit argument must match too. */
+	EXPECT_EQ(run_syscall(&actual, __NR_write, 0x100000001UL),
+			SECCOMP_RET_KILL);
+#endif
 
-	EXPECT_ARCH_VALIDATION(actual.filter);
-	EXPECT_EQ_STMT(actual.filter + ARCH_VALIDATION_LEN,
-			BPF_LD+BPF_W+BPF_ABS, syscall_nr);
-	EXPECT_ALLOW_SYSCALL_ARGS(actual.filter + ARCH_VALIDATION_LEN + 1,
-			__NR_read, 7, 0, 0);
-	EXPECT_ALLOW_SYSCALL_ARGS(actual.filter + ARCH_VALIDATION_LEN + 3,
-			__NR_write, 12 + BPF_ARG_COMP_LEN, 0, 0);
-	EXPECT_ALLOW_SYSCALL(actual.filter + ARCH_VALIDATION_LEN + 5,
-			__NR_rt_sigreturn);
-	EXPECT_ALLOW_SYSCALL(actual.filter + ARCH_VALIDATION_LEN + 7,
-			__NR_exit);
-	EXPECT_EQ_STMT(actual.filter + ARCH_VALIDATION_LEN + 9, BPF_RET+BPF_K,
+	free(actual.filter);
+	fclose(policy);
+}
+
+TEST_F(filter, arg_ranges) {
+	struct sock_fprog actual;
+	FILE *policy = fopen("test/arg_ranges.policy", "r");
+	int res = compile_filter(policy, &actual, NO_LOGGING);
+
+	ASSERT_EQ(res, 0);
+
+	EXPECT_EQ(run_syscall(&actual, __NR_read, 2), SECCOMP_RET_KILL);
+	EXPECT_EQ(run_syscall(&actual, __NR_read, 3), SECCOMP_RET_ALLOW);
+	EXPECT_EQ(run_syscall(&actual, __NR_read, 9), SECCOMP_RET_ALLOW);
+	EXPECT_EQ(run_syscall(&actual, __NR_read, 10), SECCOMP_RET_KILL);
+	EXPECT_EQ(run_syscall(&actual, __NR_read, 0xfffffffe),
+			SECCOMP_RET_KILL);
+	EXPECT_EQ(run_syscall(&actual, __NR_read, 0xffffffff),
+			SECCOMP_RET_ALLOW);
+
+	EXPECT_EQ(run_syscall(&actual, __NR_write, 0), SECCOMP_RET_KILL);
+	EXPECT_EQ(run_syscall(&actual, __NR_write, 1), SECCOMP_RET_ALLOW);
+	EXPECT_EQ(run_syscall(&actual, __NR_write, 2), SECCOMP_RET_ALLOW);
+	EXPECT_EQ(run_syscall(&actual, __NR_write, 3), SECCOMP_RET_KILL);
+	EXPECT_EQ(run_syscall(&actual, __NR_write, 0x10), SECCOMP_RET_ALLOW);
+
+	EXPECT_EQ(run_syscall(&actual, __NR_exit, 0), SECCOMP_RET_ALLOW);
+	EXPECT_EQ(run_syscall(&actual, __NR_exit, 1), SECCOMP_RET_KILL);
+
+#if defined(BITS64)
+	/* The high words take part in every comparison. */
+	EXPECT_EQ(run_syscall(&actual, __NR_read, 0x100000005UL),
+			SECCOMP_RET_ALLOW);
+	EXPECT_EQ(run_syscall(&actual, __NR_write, 0x100000001UL),
+			SECCOMP_RET_KILL);
+	EXPECT_EQ(run_syscall(&actual, __NR_write, 0x100000002UL),
+			SECCOMP_RET_ALLOW);
+	EXPECT_EQ(run_syscall(&actual, __NR_exit, 0x100000000UL),
 			SECCOMP_RET_KILL);
+#endif
+
+	free(actual.filter);
+	fclose(policy);
+}
+
+TEST_F(filter, long_jumps) {
+	struct sock_fprog actual;
+	struct seccomp_data data;
+	FILE *policy = tmpfile();
+	const int nsyscalls = 128;
+	int i;
+
+	/*
+	 * Enough arg-filtered syscalls that the arg filter blocks end up
+	 * well over 255 instructions away from the jump table.
+	 */
+	ASSERT_NE(policy, NULL);
+	for (i = 0; i < nsyscalls; i++)
+		fprintf(policy, "%s: arg0 == %d || arg1 == %d\n",
+			syscall_table[i].name, i, i + 1);
+	rewind(policy);
+
+	int res = compile_filter(policy, &actual, NO_LOGGING);
+	ASSERT_EQ(res, 0);
+	EXPECT_GT(actual.len, 255);
+
+	for (i = 0; i < nsyscalls; i++) {
+		memset(&data, 0, sizeof(data));
+		data.arch = ARCH_NR;
+		data.nr = syscall_table[i].nr;
+		data.args[0] = i;
+		EXPECT_EQ(run_filter(&actual, &data), SECCOMP_RET_ALLOW);
+		data.args[0] = i + 1;
+		EXPECT_EQ(run_filter(&actual, &data), SECCOMP_RET_KILL);
+		data.args[1] = i + 1;
+		EXPECT_EQ(run_filter(&actual, &data), SECCOMP_RET_ALLOW);
+	}
 
 	free(actual.filter);
 	fclose(policy);
@@ -596,24 +827,27 @@ TEST_F(filter, log) {
 	 * for logging.
 	 */
 	ASSERT_EQ(res, 0);
-	EXPECT_EQ(actual.len, 13 + 2 * log_syscalls_len);
+	size_t allow = ARCH_VALIDATION_LEN + 1 + log_syscalls_len + 4;
+	EXPECT_EQ(actual.len, allow + 2);
 	EXPECT_ARCH_VALIDATION(actual.filter);
 	EXPECT_EQ_STMT(actual.filter + ARCH_VALIDATION_LEN,
 			BPF_LD+BPF_W+BPF_ABS, syscall_nr);
 
 	index = ARCH_VALIDATION_LEN + 1;
 	for (i = 0; i < log_syscalls_len; i++)
-		EXPECT_ALLOW_SYSCALL(actual.filter + (index + 2 * i),
-				     lookup_syscall(log_syscalls[i]));
-
-	index += 2 * log_syscalls_len;
-
-	EXPECT_ALLOW_SYSCALL(actual.filter + index, __NR_read);
-	EXPECT_ALLOW_SYSCALL(actual.filter + index + 2, __NR_write);
-	EXPECT_ALLOW_SYSCALL(actual.filter + index + 4, __NR_rt_sigreturn);
-	EXPECT_ALLOW_SYSCALL(actual.filter + index + 6, __NR_exit);
-	EXPECT_EQ_STMT(actual.filter + index + 8, BPF_RET+BPF_K,
-			SECCOMP_RET_TRAP);
+		EXPECT_JEQ_TO(actual.filter, index + i,
+			      lookup_syscall(log_syscalls[i]),
+			      allow, index + i + 1);
+
+	index += log_syscalls_len;
+
+	EXPECT_JEQ_TO(actual.filter, index, __NR_read, allow, index + 1);
+	EXPECT_JEQ_TO(actual.filter, index + 1, __NR_write, allow, index + 2);
+	EXPECT_JEQ_TO(actual.filter, index + 2, __NR_rt_sigreturn,
+		      allow, index + 3);
+	EXPECT_JEQ_TO(actual.filter, index + 3, __NR_exit, allow, allow + 1);
+	EXPECT_RET(actual.filter, allow, SECCOMP_RET_ALLOW);
+	EXPECT_RET(actual.filter, allow + 1, SECCOMP_RET_TRAP);
 
 	free(actual.filter);
 	fclose(policy);